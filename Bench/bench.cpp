@@ -0,0 +1,495 @@
+//  This Source Code Form is subject to the terms of the Mozilla Public
+//  License, v. 2.0. If a copy of the MPL was not distributed with this
+//  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "../amx.h"
+#include "../amx_jit.h"
+
+// Micro-kernels for every cell size, data backing and engine, reporting ns per call and instructions per second.
+// The kernels are assembled here rather than compiled from Pawn, so they are the same for every cell size.
+//
+// usage: bench [--quick] [filter], where filter is matched against "kernel/cells/backing/engine"
+
+namespace
+{
+  enum : uint8_t
+  {
+    LOAD_S_PRI = 3, LOAD_S_ALT = 4, LOAD_I = 7, CONST_PRI = 9, CONST_ALT = 10, STOR_S = 14, INC_I = 60,
+    PUSH_PRI = 22, POP_ALT = 25, STACK = 28, PROC = 30, RETN = 32, CALL = 33, JUMP = 34, JZER = 35, JNZ = 36,
+    SMUL = 42, ADD = 44, SUB = 45, AND = 46, XOR = 48, SLESS = 54, DEC_PRI = 61, MOVS = 64, HALT = 67, SYSREQ = 69,
+    SWITCH = 70, CASETBL = 74
+  };
+
+  // Appends instructions after a HALT at cell 0, for the return address of call() to point at. Entry is cell 2.
+  template <typename Cell>
+  class assembler
+  {
+    constexpr static auto cb = (Cell)sizeof(Cell);
+
+    struct fixup
+    {
+      size_t at;
+      size_t base;
+      size_t label;
+    };
+
+    std::vector<Cell> _code{ HALT, 0 };
+    std::vector<size_t> _labels;
+    std::vector<fixup> _fixups;
+
+  public:
+    size_t label()
+    {
+      _labels.push_back(0);
+      return _labels.size() - 1;
+    }
+
+    void bind(size_t l) { _labels[l] = _code.size(); }
+
+    void op(Cell opcode) { _code.push_back(opcode); }
+
+    void op(Cell opcode, Cell operand)
+    {
+      _code.push_back(opcode);
+      _code.push_back(operand);
+    }
+
+    // operand is `cells` cells as bytes, which may be negative
+    void op_cells(Cell opcode, long long cells) { op(opcode, (Cell)(cells * (long long)cb)); }
+
+    // Jumps, calls and SWITCH are relative to their own opcode.
+    void jump(Cell opcode, size_t l)
+    {
+      _code.push_back(opcode);
+      ref(l, _code.size() - 1);
+    }
+
+    // a code address relative to the cell at `base`, as case table entries are
+    void ref(size_t l, size_t base)
+    {
+      _fixups.push_back({ _code.size(), base, l });
+      _code.push_back(0);
+    }
+
+    size_t here() const { return _code.size(); }
+
+    void data(Cell v) { _code.push_back(v); }
+
+    std::vector<Cell> finish()
+    {
+      for (const auto& f : _fixups)
+        _code[f.at] = (Cell)((_labels[f.label] - f.base) * sizeof(Cell));
+      return _code;
+    }
+  };
+
+  // Arrays of the kernels in the data segment, as byte addresses
+  constexpr size_t array_cells = 256;
+  constexpr size_t copy_cells = 64;
+  constexpr size_t copy_src = 1024;
+  constexpr size_t copy_dst = 2048;
+
+  // sum = ((sum * 3) + i) ^ 0x55 for i from n down to 1
+  template <typename Cell>
+  void arithmetic(assembler<Cell>& a)
+  {
+    const auto loop = a.label(), done = a.label();
+    a.op(PROC);
+    a.op(CONST_PRI, 0); a.op(PUSH_PRI);
+    a.op_cells(LOAD_S_PRI, 3); a.op(PUSH_PRI);
+    a.bind(loop);
+    a.op_cells(LOAD_S_PRI, -2); a.jump(JZER, done);
+    a.op_cells(LOAD_S_PRI, -1); a.op(CONST_ALT, 3); a.op(SMUL);
+    a.op_cells(LOAD_S_ALT, -2); a.op(ADD);
+    a.op(CONST_ALT, 0x55); a.op(XOR);
+    a.op_cells(STOR_S, -1);
+    a.op_cells(LOAD_S_PRI, -2); a.op(DEC_PRI); a.op_cells(STOR_S, -2);
+    a.jump(JUMP, loop);
+    a.bind(done);
+    a.op_cells(LOAD_S_PRI, -1); a.op_cells(STACK, 2); a.op(RETN);
+  }
+
+  // n passes over an array, summing and incrementing every element
+  template <typename Cell>
+  void array_walk(assembler<Cell>& a)
+  {
+    const auto outer = a.label(), inner = a.label(), done = a.label();
+    a.op(PROC);
+    a.op(CONST_PRI, 0); a.op(PUSH_PRI);
+    a.op_cells(LOAD_S_PRI, 3); a.op(PUSH_PRI);
+    a.op(CONST_PRI, 0); a.op(PUSH_PRI);
+    a.bind(outer);
+    a.op_cells(LOAD_S_PRI, -2); a.jump(JZER, done);
+    a.op(CONST_PRI, 0); a.op_cells(STOR_S, -3);
+    a.bind(inner);
+    a.op_cells(LOAD_S_PRI, -3); a.op(LOAD_I); a.op_cells(LOAD_S_ALT, -1); a.op(ADD); a.op_cells(STOR_S, -1);
+    a.op_cells(LOAD_S_PRI, -3); a.op(INC_I);
+    a.op_cells(LOAD_S_PRI, -3); a.op_cells(CONST_ALT, 1); a.op(ADD); a.op_cells(STOR_S, -3);
+    a.op_cells(CONST_ALT, array_cells); a.op(SLESS); a.jump(JNZ, inner);
+    a.op_cells(LOAD_S_PRI, -2); a.op(DEC_PRI); a.op_cells(STOR_S, -2);
+    a.jump(JUMP, outer);
+    a.bind(done);
+    a.op_cells(LOAD_S_PRI, -1); a.op_cells(STACK, 3); a.op(RETN);
+  }
+
+  // n block copies with MOVS, as strcopy does
+  template <typename Cell>
+  void string_copy(assembler<Cell>& a)
+  {
+    const auto loop = a.label(), done = a.label();
+    a.op(PROC);
+    a.op_cells(LOAD_S_PRI, 3); a.op(PUSH_PRI);
+    a.bind(loop);
+    a.op_cells(LOAD_S_PRI, -1); a.jump(JZER, done);
+    a.op_cells(CONST_PRI, copy_src); a.op_cells(CONST_ALT, copy_dst); a.op_cells(MOVS, copy_cells);
+    a.op_cells(LOAD_S_PRI, -1); a.op(DEC_PRI); a.op_cells(STOR_S, -1);
+    a.jump(JUMP, loop);
+    a.bind(done);
+    a.op(CONST_PRI, 0); a.op_cells(STACK, 1); a.op(RETN);
+  }
+
+  // naive recursive fib(n)
+  template <typename Cell>
+  void recursion(assembler<Cell>& a)
+  {
+    const auto fib = a.label(), rec = a.label();
+    a.bind(fib);
+    a.op(PROC);
+    a.op_cells(LOAD_S_PRI, 3); a.op(CONST_ALT, 2); a.op(SLESS); a.jump(JZER, rec);
+    a.op_cells(LOAD_S_PRI, 3); a.op(RETN);
+    a.bind(rec);
+    a.op_cells(LOAD_S_PRI, 3); a.op(DEC_PRI); a.op(PUSH_PRI); a.op_cells(CONST_PRI, 1); a.op(PUSH_PRI);
+    a.jump(CALL, fib);
+    a.op(PUSH_PRI);
+    a.op_cells(LOAD_S_ALT, 3); a.op(CONST_PRI, 2); a.op(SUB);
+    a.op(PUSH_PRI); a.op_cells(CONST_PRI, 1); a.op(PUSH_PRI);
+    a.jump(CALL, fib);
+    a.op(POP_ALT); a.op(ADD); a.op(RETN);
+  }
+
+  // a 64 case switch on i & 63 for i from n down to 1
+  template <typename Cell>
+  void large_switch(assembler<Cell>& a)
+  {
+    constexpr size_t cases = 64;
+    const auto loop = a.label(), done = a.label(), next = a.label(), table = a.label();
+    size_t targets[cases];
+    for (auto& t : targets)
+      t = a.label();
+    a.op(PROC);
+    a.op(CONST_PRI, 0); a.op(PUSH_PRI);
+    a.op_cells(LOAD_S_PRI, 3); a.op(PUSH_PRI);
+    a.bind(loop);
+    a.op_cells(LOAD_S_PRI, -2); a.jump(JZER, done);
+    a.op(CONST_ALT, cases - 1); a.op(AND); a.jump(SWITCH, table);
+    for (size_t k = 0; k < cases; ++k)
+    {
+      a.bind(targets[k]);
+      a.op_cells(LOAD_S_PRI, -1); a.op(CONST_ALT, (Cell)(k * 3 + 1)); a.op(ADD); a.op_cells(STOR_S, -1);
+      a.jump(JUMP, next);
+    }
+    a.bind(table);
+    a.op(CASETBL);
+    const auto count_at = a.here();
+    a.data((Cell)cases);
+    a.ref(next, count_at);
+    for (size_t k = 0; k < cases; ++k)
+    {
+      // in a scrambled order, as a compiler sorting by value wouldn't
+      const auto value = (Cell)((k * 37) % cases);
+      const auto value_at = a.here();
+      a.data(value);
+      a.ref(targets[value], value_at);
+    }
+    a.bind(next);
+    a.op_cells(LOAD_S_PRI, -2); a.op(DEC_PRI); a.op_cells(STOR_S, -2);
+    a.jump(JUMP, loop);
+    a.bind(done);
+    a.op_cells(LOAD_S_PRI, -1); a.op_cells(STACK, 2); a.op(RETN);
+  }
+
+  // sums twice(i) for i from n down to 1, twice being native 0
+  template <typename Cell>
+  void native_calls(assembler<Cell>& a)
+  {
+    const auto loop = a.label(), done = a.label();
+    a.op(PROC);
+    a.op(CONST_PRI, 0); a.op(PUSH_PRI);
+    a.op_cells(LOAD_S_PRI, 3); a.op(PUSH_PRI);
+    a.bind(loop);
+    a.op_cells(LOAD_S_PRI, -2); a.jump(JZER, done);
+    a.op(PUSH_PRI); a.op_cells(CONST_PRI, 1); a.op(PUSH_PRI); a.op(SYSREQ, 0); a.op_cells(STACK, 2);
+    a.op_cells(LOAD_S_ALT, -1); a.op(ADD); a.op_cells(STOR_S, -1);
+    a.op_cells(LOAD_S_PRI, -2); a.op(DEC_PRI); a.op_cells(STOR_S, -2);
+    a.jump(JUMP, loop);
+    a.bind(done);
+    a.op_cells(LOAD_S_PRI, -1); a.op_cells(STACK, 2); a.op(RETN);
+  }
+
+  struct kernel
+  {
+    const char* name;
+    // argument of the call
+    uint32_t n;
+    void(*build16)(assembler<uint16_t>&);
+    void(*build32)(assembler<uint32_t>&);
+    void(*build64)(assembler<uint64_t>&);
+  };
+
+#define KERNEL(name, n) { #name, n, &name<uint16_t>, &name<uint32_t>, &name<uint64_t> }
+  const kernel kernels[]{
+    KERNEL(arithmetic, 1000),
+    KERNEL(array_walk, 4),
+    KERNEL(string_copy, 100),
+    KERNEL(recursion, 15),
+    KERNEL(large_switch, 1000),
+    KERNEL(native_calls, 1000),
+  };
+#undef KERNEL
+
+  template <typename Cell>
+  void build(const kernel& k, assembler<Cell>& a)
+  {
+    if constexpr (sizeof(Cell) == 2)
+      k.build16(a);
+    else if constexpr (sizeof(Cell) == 4)
+      k.build32(a);
+    else
+      k.build64(a);
+  }
+
+  // Both segments are this big and aligned to it, which is what the partial address space backing needs.
+  constexpr size_t segment_bytes = 1 << 16;
+
+  struct segment
+  {
+    void* p = ::operator new(segment_bytes, std::align_val_t{ segment_bytes });
+    segment() { memset(p, 0, segment_bytes); }
+    ~segment() { ::operator delete(p, std::align_val_t{ segment_bytes }); }
+    segment(const segment&) = delete;
+    segment& operator=(const segment&) = delete;
+  };
+
+  enum class engine { interpreter, verified, decoded, jit };
+  const char* const engine_names[]{ "interpreter", "verified", "decoded", "jit" };
+
+  struct options
+  {
+    bool quick{};
+    std::string filter;
+  };
+
+  template <typename Cell, typename Backing>
+  class machine
+  {
+    using amx_t = amx::amx<Cell, amx::memory_manager_harvard<Backing, Backing>>;
+    using cell = typename amx_t::cell;
+
+    amx_t _amx{ &callback, this };
+    segment _code_segment;
+    segment _data_segment;
+    std::vector<typename amx_t::decoded_t> _decoded;
+    std::vector<uint8_t> _starts;
+    amx::jit<amx_t> _jit;
+    uint64_t _instructions{};
+    size_t _code_cells{};
+
+    static amx::error callback(amx_t* amx, void* user, cell index, cell stk, cell& pri)
+    {
+      if (index == amx_t::cbid_single_step)
+      {
+        ++((machine*)user)->_instructions;
+        return amx::error::success;
+      }
+      if (index != 0)
+        return amx::error::invalid_operand;
+      const auto arg = amx->data_v2p(stk + (cell)sizeof(cell));
+      if (!arg)
+        return amx::error::access_violation;
+      pri = (cell)(*arg * 2);
+      return amx::error::success;
+    }
+
+    cell* code() const { return (cell*)_code_segment.p; }
+    cell* data() const { return (cell*)_data_segment.p; }
+
+  public:
+    bool load(const std::vector<cell>& code)
+    {
+      constexpr auto cells = segment_bytes / sizeof(cell);
+      if (code.size() > cells)
+        return false;
+      std::copy(code.begin(), code.end(), this->code());
+      _code_cells = code.size();
+      cell code_base{}, data_base{};
+      if (!_amx.mem.code().map(this->code(), cells, code_base) || !_amx.mem.data().map(data(), cells, data_base))
+        return false;
+      _amx.COD = code_base;
+      _amx.DAT = data_base;
+      _amx.HEA = (cell)(copy_dst + copy_cells) * (cell)sizeof(cell);
+      _amx.STK = _amx.STP = (cell)((cells - 1) * sizeof(cell));
+      for (size_t i = 0; i < copy_cells; ++i)
+        data()[copy_src + i] = (cell)('a' + i % 26);
+      return true;
+    }
+
+    bool use(engine e)
+    {
+      _amx.detach_decoded();
+      _amx.detach_verified();
+      amx::jit<amx_t>::detach(_amx);
+      _amx.set_single_step(false);
+      switch (e)
+      {
+      case engine::interpreter:
+        return true;
+      case engine::verified:
+      {
+        _starts.resize(_code_cells);
+        cell cip{};
+        if (amx_t::verify(code(), _code_cells, 1, _starts.data(), cip) != amx::error::success)
+          return false;
+        _amx.attach_verified(code(), _starts.data(), _code_cells);
+        return true;
+      }
+      case engine::decoded:
+        _decoded.resize(_code_cells + 1);
+        amx_t::decode(code(), _code_cells, _decoded.data());
+        _amx.attach_decoded(_decoded.data(), _code_cells);
+        return true;
+      case engine::jit:
+        if (!_jit.compile(code(), _code_cells))
+          return false;
+        _jit.attach(_amx);
+        return true;
+      }
+      return false;
+    }
+
+    bool call(cell n, cell& retval)
+    {
+      return _amx.call(2 * sizeof(cell), retval, { n }) == amx::error::success;
+    }
+
+    // Instructions run by one call, counted by single stepping it. Single stepping bypasses the engine.
+    uint64_t count(cell n, cell& retval)
+    {
+      _instructions = 0;
+      _amx.set_single_step(true);
+      const auto result = _amx.call(2 * sizeof(cell), retval, { n });
+      _amx.set_single_step(false);
+      return result == amx::error::success ? _instructions : 0;
+    }
+
+    // Calls until `seconds` passed, returning ns per call.
+    double time(cell n, double seconds, cell& retval)
+    {
+      using clock = std::chrono::steady_clock;
+      const auto start = clock::now();
+      const auto until = start + std::chrono::duration<double>(seconds);
+      uint64_t calls{};
+      auto now = start;
+      do
+      {
+        for (int i = 0; i < 16; ++i)
+          if (_amx.call(2 * sizeof(cell), retval, { n }) != amx::error::success)
+            return -1;
+        calls += 16;
+        now = clock::now();
+      } while (now < until);
+      return std::chrono::duration<double, std::nano>(now - start).count() / (double)calls;
+    }
+  };
+
+  // Returns false if anything failed or an engine disagreed with the first one.
+  template <typename Cell, typename Backing>
+  bool run(const options& opts, const char* backing)
+  {
+    auto ok = true;
+    for (const auto& k : kernels)
+    {
+      assembler<Cell> a;
+      build(k, a);
+      const auto code = a.finish();
+      bool have_expected{};
+      Cell expected{};
+      for (auto e : { engine::interpreter, engine::verified, engine::decoded, engine::jit })
+      {
+        const auto label = std::string(k.name) + "/" + std::to_string(sizeof(Cell) * 8) + "/" + backing + "/" +
+          engine_names[(int)e];
+        if (!opts.filter.empty() && label.find(opts.filter) == std::string::npos)
+          continue;
+
+        // fresh memory for each run, so the array kernel starts from the same contents
+        auto m = std::make_unique<machine<Cell, Backing>>();
+        if (!m->load(code))
+        {
+          printf("%-48s failed to map\n", label.c_str());
+          ok = false;
+          continue;
+        }
+        if (!m->use(e))
+          continue;
+        // the first call sees the same memory on every engine, later ones may not
+        Cell retval{};
+        const auto first_ok = m->call((Cell)k.n, retval);
+        if (!have_expected)
+        {
+          have_expected = true;
+          expected = retval;
+        }
+        const auto matches = retval == expected;
+        const auto instructions = m->count((Cell)k.n, retval);
+        const auto ns = m->time((Cell)k.n, opts.quick ? 0.02 : 0.2, retval);
+        if (!first_ok || ns < 0 || instructions == 0)
+        {
+          printf("%-48s failed\n", label.c_str());
+          ok = false;
+          continue;
+        }
+        printf(
+          "%-48s %12.1f ns/call %10.1f Minstr/s%s\n",
+          label.c_str(),
+          ns,
+          (double)instructions / ns * 1000.,
+          matches ? "" : "  RESULT MISMATCH"
+        );
+        ok = ok && matches;
+      }
+    }
+    return ok;
+  }
+
+  template <typename Cell>
+  bool run_all(const options& opts)
+  {
+    auto ok = run<Cell, amx::memory_backing_paged_buffers<5>>(opts, "paged_buffers");
+    ok = run<Cell, amx::memory_backing_contignous_buffer>(opts, "contignous_buffer") && ok;
+    ok = run<Cell, amx::memory_backing_partial_address_space<16>>(opts, "partial_address_space") && ok;
+    return ok;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  options opts;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--quick") == 0)
+      opts.quick = true;
+    else
+      opts.filter = argv[i];
+  }
+
+  auto ok = run_all<uint16_t>(opts);
+  ok = run_all<uint32_t>(opts) && ok;
+  ok = run_all<uint64_t>(opts) && ok;
+  return ok ? 0 : 1;
+}
@@ -23,7 +23,6 @@
 //  
 //  For more information, please refer to <http://unlicense.org/>
 #include <cstdio>
-#include <fstream>
 #include <cinttypes>
 
 #include "../amx.h"
@@ -41,20 +40,10 @@ static amx::error five(amx32* amx, amx32_loader* loader, void* user, amx32::cell
     printf("get_two not found!!\n");
     return amx::error::callback_abort;
   }
+  // two goes onto the heap for the call, and is copied back once it returns
   amx32::cell two{};
-  amx32::cell two_ref{};
-  const auto success = amx->mem.data().map(&two, 1, two_ref);
-  if(!success)
-  {
-    printf("failed mapping in two!!\n");
-    return amx::error::callback_abort;
-  }
-  printf("mapped va for two: %X\n", (uint32_t)two_ref);
-  const auto two_ref_segment_relative = (amx32::cell)(two_ref - amx->DAT);
-
   amx32::cell useless{};
-  auto result = amx->call(get_two, useless, { two_ref_segment_relative });
-  amx->mem.data().unmap(two_ref, 1);
+  auto result = amx->call(get_two, useless, { { &two, 1 } });
   if (result != amx::error::success)
   {
     printf("calling get_two failed with %d!!\n", (int)result);
@@ -85,7 +74,8 @@ constexpr static const char* OPCODE_NAME[] = {
   "RET", "RETN", "CALL", "JUMP", "JZER", "JNZ", "SHL", "SHR", "SSHR", "SHL_C_PRI", "SHL_C_ALT", "SMUL", "SDIV", "ADD",
   "SUB", "AND", "OR", "XOR", "NOT", "NEG", "INVERT", "EQ", "NEQ", "SLESS", "SLEQ", "SGRTR", "SGEQ", "INC_PRI",
   "INC_ALT", "INC_I", "DEC_PRI", "DEC_ALT", "DEC_I", "MOVS", "CMPS", "FILL", "HALT", "BOUNDS", "SYSREQ", "SWITCH",
-  "SWAP_PRI", "SWAP_ALT", "BREAK", "CASETBL"
+  "SWAP_PRI", "SWAP_ALT", "BREAK", "CASETBL", "SYSREQ_D", "SYSREQ_ND", "CALL_OVL", "RETN_OVL", "SWITCH_OVL",
+  "CASETBL_OVL"
 };
 
 constexpr static bool OPCODE_HAS_OPERAND[] = {
@@ -93,7 +83,8 @@ constexpr static bool OPCODE_HAS_OPERAND[] = {
   0, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 0, 0,
   0, 1, 1, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0,
   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-  1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0
+  1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1, 0, 1,
+  0
 };
 
 constexpr static const char* FORMAT_BY_SIZE[] = {
@@ -145,17 +136,10 @@ static constexpr amx32_loader::callbacks_arg CALLBACKS{
   nullptr
 };
 
-static std::vector<uint8_t> readall(const char* path)
+// the file is streamed in, the loader reads only what it keeps
+static size_t read_file(void* user, uint8_t* dst, size_t size)
 {
-  std::ifstream is(path, std::ios::binary);
-  if (is.bad() || !is.is_open())
-    return {};
-  is.seekg(0, std::ifstream::end);
-  std::vector<uint8_t> data;
-  data.resize((size_t)is.tellg());
-  is.seekg(0, std::ifstream::beg);
-  is.read(reinterpret_cast<char*>(data.data()), (std::streamsize)data.size());
-  return data;
+  return fread(dst, 1, size, (FILE*)user);
 }
 
 static amx32_loader ldr;
@@ -168,9 +152,15 @@ int main(int argc, char** argv)
     return -1;
   }
 
-  const auto file = readall(argv[1]);
+  const auto file = fopen(argv[1], "rb");
+  if (!file)
+  {
+    fprintf(stderr, "Can't open %s\n", argv[1]);
+    return -1;
+  }
 
-  const auto result = ldr.init(file.data(), file.size(), CALLBACKS);
+  const auto result = ldr.init(&read_file, file, CALLBACKS);
+  fclose(file);
 
   if (result != amx::loader_error::success)
   {
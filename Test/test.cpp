@@ -1,12 +1,20 @@
 //  This Source Code Form is subject to the terms of the Mozilla Public
 //  License, v. 2.0. If a copy of the MPL was not distributed with this
 //  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include <algorithm>
+#include <numeric>
 #include <fstream>
 #include <vector>
 #include "gtest/gtest.h"
 
 #include "../amx.h"
 #include "../amx_loader.h"
+#include "../amx_jit.h"
+#include "../amx_guarded.h"
+#include "../amx_pool.h"
+#if AMX_PROFILE
+#include "../amx_profile.h"
+#endif
 
 static std::vector<uint8_t> readall(const char* path)
 {
@@ -21,11 +29,15 @@ static std::vector<uint8_t> readall(const char* path)
   return data;
 }
 
-template <typename T>
+template <
+  typename T,
+  bool Predecode = false,
+  typename MemoryManager = amx::memory_manager_neumann<amx::memory_backing_paged_buffers<5>>
+>
 class AmxTest : public ::testing::Test
 {
 protected:
-  using my_amx = amx::amx<T, amx::memory_manager_neumann<amx::memory_backing_paged_buffers<5>>>;
+  using my_amx = amx::amx<T, MemoryManager>;
   using my_amx_loader = amx::loader<my_amx>;
   using cell = typename my_amx::cell;
 
@@ -33,15 +45,17 @@ protected:
 
   static amx::error opaque(my_amx* amx, my_amx_loader* loader, void* user, cell argc, cell argv, cell& retval)
   {
-    if (argc != 1)
-      return amx::error::invalid_operand;
-    const auto p = amx->data_v2p(argv);
-    if (!p)
+    const auto& args = loader->args();
+    if (!args)
       return amx::error::access_violation;
-    retval = *p;
+    if (args.size() != 1)
+      return amx::error::invalid_operand;
+    retval = args[0];
     return amx::error::success;
   }
 
+  static cell identity(cell v) { return v; }
+
   static constexpr typename my_amx_loader::native_arg NATIVES[]{
     { "opaque", &opaque }
   };
@@ -54,9 +68,13 @@ protected:
     nullptr
   };
   
-  void SetUp() override {
+  amx::loader_error load(const typename my_amx_loader::options_arg& options) {
     const auto file = readall(("test" + std::to_string(std::numeric_limits<T>::digits) + ".amx").c_str());
-    _ldr.init(file.data(), file.size(), CALLBACKS);
+    return _ldr.init(file.data(), file.size(), CALLBACKS, options);
+  }
+
+  void SetUp() override {
+    load({ Predecode });
   }
 };
 
@@ -64,26 +82,62 @@ using Amx16Test = AmxTest<uint16_t>;
 using Amx32Test = AmxTest<uint32_t>;
 using Amx64Test = AmxTest<uint64_t>;
 
-#define TEST_PAWN(name, expected_result, expected_retval) \
-  TEST_F(Amx16Test, name) {\
-    const auto fn = _ldr.get_public("test_" #name);\
-    EXPECT_NE(fn, 0);\
-    my_amx::cell retval{(my_amx::cell)0xCCCCCCCCCCCCCCCC};\
-    const auto result = _ldr.amx.call(fn, retval);\
-    EXPECT_EQ(result, expected_result);\
-    if (result == amx::error::success)\
-      EXPECT_EQ(retval, expected_retval);\
-  }\
-  TEST_F(Amx32Test, name) {\
-    const auto fn = _ldr.get_public("test_" #name);\
-    EXPECT_NE(fn, 0);\
-    my_amx::cell retval{(my_amx::cell)0xCCCCCCCCCCCCCCCC};\
-    const auto result = _ldr.amx.call(fn, retval);\
-    EXPECT_EQ(result, expected_result);\
-    if (result == amx::error::success)\
-      EXPECT_EQ(retval, expected_retval);\
-  }\
-  TEST_F(Amx64Test, name) {\
+using Amx16DecodedTest = AmxTest<uint16_t, true>;
+using Amx32DecodedTest = AmxTest<uint32_t, true>;
+using Amx64DecodedTest = AmxTest<uint64_t, true>;
+
+template <typename T, bool Predecode>
+class AmxVerifiedTest : public AmxTest<T, Predecode>
+{
+protected:
+  void SetUp() override {
+    ASSERT_EQ(this->load({ Predecode, false, false, false, true }), amx::loader_error::success);
+    ASSERT_TRUE(this->_ldr.get_program()->is_verified());
+  }
+};
+
+using Amx16VerifiedTest = AmxVerifiedTest<uint16_t, false>;
+using Amx32VerifiedTest = AmxVerifiedTest<uint32_t, false>;
+using Amx64VerifiedTest = AmxVerifiedTest<uint64_t, false>;
+using Amx32DecodedVerifiedTest = AmxVerifiedTest<uint32_t, true>;
+
+template <typename T>
+using AmxGuardedTest = AmxTest<
+  T,
+  false,
+  amx::memory_manager_harvard<amx::memory_backing_contignous_buffer, amx::memory_backing_guarded_reservation<>>
+>;
+
+using Amx16GuardedTest = AmxGuardedTest<uint16_t>;
+using Amx32GuardedTest = AmxGuardedTest<uint32_t>;
+using Amx64GuardedTest = AmxGuardedTest<uint64_t>;
+
+// falls back to the interpreter where the jit isn't supported
+template <typename T, typename DataBacking = amx::memory_backing_contignous_buffer>
+class AmxJitTest : public AmxTest<
+  T,
+  false,
+  amx::memory_manager_harvard<amx::memory_backing_contignous_buffer, DataBacking>
+>
+{
+protected:
+  amx::jit<typename AmxJitTest::my_amx> _jit;
+
+  void SetUp() override {
+    AmxJitTest::AmxTest::SetUp();
+    const auto program = this->_ldr.get_program();
+    if (_jit.compile(program->get_code(), program->get_code_size()))
+      _jit.attach(this->_ldr.amx);
+  }
+};
+
+using Amx32JitTest = AmxJitTest<uint32_t>;
+using Amx64JitTest = AmxJitTest<uint64_t>;
+using Amx32GuardedJitTest = AmxJitTest<uint32_t, amx::memory_backing_guarded_reservation<>>;
+using Amx64GuardedJitTest = AmxJitTest<uint64_t, amx::memory_backing_guarded_reservation<>>;
+
+#define TEST_PAWN_FIXTURE(fixture, name, expected_result, expected_retval) \
+  TEST_F(fixture, name) {\
     const auto fn = _ldr.get_public("test_" #name);\
     EXPECT_NE(fn, 0);\
     my_amx::cell retval{(my_amx::cell)0xCCCCCCCCCCCCCCCC};\
@@ -93,6 +147,24 @@ using Amx64Test = AmxTest<uint64_t>;
       EXPECT_EQ(retval, expected_retval);\
   }\
 
+#define TEST_PAWN(name, expected_result, expected_retval) \
+  TEST_PAWN_FIXTURE(Amx16Test, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx32Test, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx64Test, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx16DecodedTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx32DecodedTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx64DecodedTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx32JitTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx64JitTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx16GuardedTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx32GuardedTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx64GuardedTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx32GuardedJitTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx16VerifiedTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx32VerifiedTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx64VerifiedTest, name, expected_result, expected_retval)\
+  TEST_PAWN_FIXTURE(Amx32DecodedVerifiedTest, name, expected_result, expected_retval)\
+
 
 TEST_PAWN(Arithmetic, amx::error::success, 1);
 TEST_PAWN(Indirect, amx::error::success, 1);
@@ -109,3 +181,1302 @@ TEST_PAWN(Statics, amx::error::success, 12);
 TEST_PAWN(Packed, amx::error::success, 1);
 TEST_PAWN(GotoStackFixup, amx::error::success, 4105);
 TEST_PAWN(Bounds, amx::error::success, 6);
+
+#define TEST_DECODED_MATCHES_STEP(fixture) \
+  TEST_F(fixture, DecodedMatchesStep) {\
+    const auto file = readall(("test" + std::to_string(my_amx::cell_bits) + ".amx").c_str());\
+    my_amx_loader stepped;\
+    stepped.init(file.data(), file.size(), CALLBACKS);\
+    for (const auto name : { "test_Arithmetic", "test_Array", "test_ArrayOverindex", "test_DivZero", "test_Packed" })\
+    {\
+      my_amx::cell retval{}, stepped_retval{};\
+      EXPECT_EQ(_ldr.amx.call(_ldr.get_public(name), retval), stepped.amx.call(stepped.get_public(name), stepped_retval));\
+      EXPECT_EQ(retval, stepped_retval);\
+      EXPECT_EQ(_ldr.amx.PRI, stepped.amx.PRI);\
+      EXPECT_EQ(_ldr.amx.ALT, stepped.amx.ALT);\
+      EXPECT_EQ(_ldr.amx.FRM, stepped.amx.FRM);\
+      EXPECT_EQ(_ldr.amx.CIP, stepped.amx.CIP);\
+      EXPECT_EQ(_ldr.amx.STK, stepped.amx.STK);\
+      EXPECT_EQ(_ldr.amx.HEA, stepped.amx.HEA);\
+    }\
+  }\
+
+TEST_DECODED_MATCHES_STEP(Amx16DecodedTest);
+TEST_DECODED_MATCHES_STEP(Amx32DecodedTest);
+TEST_DECODED_MATCHES_STEP(Amx64DecodedTest);
+
+TEST_F(Amx32Test, SingleStepHook) {
+  const auto file = readall("test32.amx");
+  const auto on_single_step = [](my_amx*, my_amx_loader*, void* user) { ++*(size_t*)user; return amx::error::success; };
+  size_t steps{};
+  const my_amx_loader::callbacks_arg callbacks{ NATIVES, std::size(NATIVES), on_single_step, nullptr, &steps };
+  my_amx_loader traced;
+  traced.init(file.data(), file.size(), callbacks, { true });
+  my_amx::cell retval{};
+  EXPECT_EQ(traced.amx.call(traced.get_public("test_Switch"), retval), amx::error::success);
+  EXPECT_EQ(retval, 1);
+  EXPECT_NE(steps, 0);
+}
+
+#define TEST_BUDGET_RESUME(fixture) \
+  TEST_F(fixture, BudgetResume) {\
+    const auto fn = _ldr.get_public("test_GotoStackFixup");\
+    my_amx::cell retval{};\
+    auto result = _ldr.amx.call(fn, retval, {}, 10);\
+    size_t yields{};\
+    while (result == amx::error::yield)\
+    {\
+      ++yields;\
+      result = _ldr.amx.resume(retval, 10);\
+    }\
+    EXPECT_EQ(result, amx::error::success);\
+    EXPECT_EQ(retval, 4105);\
+    EXPECT_GT(yields, 1);\
+    EXPECT_EQ(_ldr.amx.CIP, 0);\
+  }\
+
+TEST_BUDGET_RESUME(Amx16Test);
+TEST_BUDGET_RESUME(Amx32Test);
+TEST_BUDGET_RESUME(Amx64Test);
+TEST_BUDGET_RESUME(Amx16DecodedTest);
+TEST_BUDGET_RESUME(Amx32DecodedTest);
+TEST_BUDGET_RESUME(Amx64DecodedTest);
+
+#define TEST_SLEEP_RESUME(fixture) \
+  TEST_F(fixture, SleepResume) {\
+    const auto file = readall(("test" + std::to_string(my_amx::cell_bits) + ".amx").c_str());\
+    constexpr auto sleeping_opaque = [](my_amx* amx, my_amx_loader*, void* user, cell argc, cell argv, cell&)\
+    {\
+      const auto p = amx->data_v2p(argv);\
+      if (argc != 1 || !p)\
+        return amx::error::invalid_operand;\
+      *(cell*)user = *p;\
+      return amx::error::sleep;\
+    };\
+    static constexpr typename my_amx_loader::native_arg natives[]{ { "opaque", sleeping_opaque } };\
+    cell pending{};\
+    const my_amx_loader::callbacks_arg callbacks{ natives, std::size(natives), nullptr, nullptr, &pending };\
+    my_amx_loader sleeping;\
+    sleeping.init(file.data(), file.size(), callbacks, { true });\
+    my_amx::cell retval{};\
+    auto result = sleeping.amx.call(sleeping.get_public("test_Arithmetic"), retval);\
+    size_t sleeps{};\
+    while (result == amx::error::sleep)\
+    {\
+      ++sleeps;\
+      result = sleeping.amx.resume_with(pending, retval);\
+    }\
+    EXPECT_EQ(result, amx::error::success);\
+    EXPECT_EQ(retval, 1);\
+    EXPECT_GT(sleeps, 1);\
+  }\
+
+TEST_SLEEP_RESUME(Amx16Test);
+TEST_SLEEP_RESUME(Amx32Test);
+TEST_SLEEP_RESUME(Amx64Test);
+
+#define TEST_DIRECT_NATIVES(fixture) \
+  TEST_F(fixture, DirectNatives) {\
+    const auto file = readall(("test" + std::to_string(my_amx::cell_bits) + ".amx").c_str());\
+    static constexpr typename my_amx_loader::native_arg inlined[]{\
+      amx::make_native<my_amx, &identity>("opaque")\
+    };\
+    my_amx_loader direct;\
+    ASSERT_EQ(direct.init(file.data(), file.size(), { inlined, std::size(inlined) }), amx::loader_error::success);\
+    my_amx::cell retval{};\
+    EXPECT_EQ(direct.amx.call(direct.get_public("test_Arithmetic"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 1);\
+    constexpr auto counting = [](my_amx*, void* user, cell argc, cell* argv, cell& retval)\
+    {\
+      if (argc != 1)\
+        return amx::error::invalid_operand;\
+      ++*(size_t*)user;\
+      retval = argv[0];\
+      return amx::error::success;\
+    };\
+    static constexpr typename my_amx_loader::native_arg natives[]{ { "opaque", nullptr, counting } };\
+    size_t calls{};\
+    const my_amx_loader::callbacks_arg callbacks{ natives, std::size(natives), nullptr, nullptr, &calls };\
+    my_amx_loader lazy;\
+    ASSERT_EQ(lazy.init(file.data(), file.size(), callbacks, { true, false, true }), amx::loader_error::success);\
+    EXPECT_EQ(lazy.amx.call(lazy.get_public("test_Arithmetic"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 1);\
+    EXPECT_GT(calls, 1);\
+  }\
+
+TEST_DIRECT_NATIVES(Amx16Test);
+TEST_DIRECT_NATIVES(Amx32Test);
+TEST_DIRECT_NATIVES(Amx64DecodedTest);
+TEST_DIRECT_NATIVES(Amx32GuardedTest);
+
+#define TEST_TELEMETRY(fixture) \
+  TEST_F(fixture, Telemetry) {\
+    std::atomic<uint64_t> natives[1]{};\
+    my_amx::telemetry counters{};\
+    counters.native_calls = natives;\
+    counters.native_count = std::size(natives);\
+    _ldr.amx.attach_telemetry(&counters);\
+    my_amx::cell retval{};\
+    ASSERT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::success);\
+    EXPECT_EQ(counters.calls, 1u);\
+    EXPECT_EQ(std::accumulate(std::begin(counters.latency), std::end(counters.latency), (uint64_t)0), 1u);\
+    /* what test_Arithmetic executes, the same on every engine */\
+    EXPECT_EQ(counters.instructions, 809u);\
+    EXPECT_GT(natives[0], 10u);\
+    EXPECT_LT(counters.stk_low, _ldr.amx.STP);\
+    EXPECT_GE(counters.hea_high, _ldr.amx.HEA);\
+    const auto instructions = counters.instructions.load();\
+    const my_amx::cell rows[2]{};\
+    my_amx::cell results[2]{};\
+    size_t completed{};\
+    ASSERT_EQ(_ldr.amx.call_batch(_ldr.get_public("test_Arithmetic"), rows, 0, results, 2, completed), amx::error::success);\
+    EXPECT_EQ(counters.calls, 3u);\
+    EXPECT_EQ(counters.instructions, 3 * instructions);\
+    _ldr.amx.detach_telemetry();\
+    ASSERT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::success);\
+    EXPECT_EQ(counters.calls, 3u);\
+  }\
+
+TEST_TELEMETRY(Amx16Test);
+TEST_TELEMETRY(Amx32Test);
+TEST_TELEMETRY(Amx64DecodedTest);
+TEST_TELEMETRY(Amx32JitTest);
+
+#define TEST_SHARED_PROGRAM(fixture) \
+  TEST_F(fixture, SharedProgram) {\
+    const auto file = readall(("test" + std::to_string(my_amx::cell_bits) + ".amx").c_str());\
+    const auto program = std::make_shared<typename my_amx_loader::program_t>();\
+    ASSERT_EQ(program->init(file.data(), file.size(), NATIVES, std::size(NATIVES), { true }), amx::loader_error::success);\
+    my_amx_loader instances[3];\
+    for (auto& instance : instances)\
+      ASSERT_EQ(instance.init(program, CALLBACKS), amx::loader_error::success);\
+    for (auto& instance : instances)\
+    {\
+      my_amx::cell retval{};\
+      EXPECT_EQ(instance.amx.call(instance.get_public("test_Statics"), retval), amx::error::success);\
+      EXPECT_EQ(retval, 12);\
+    }\
+    EXPECT_EQ(program.use_count(), 4);\
+  }\
+
+TEST_SHARED_PROGRAM(Amx32Test);
+TEST_SHARED_PROGRAM(Amx64Test);
+
+#define TEST_DISPATCHER(fixture) \
+  TEST_F(fixture, Dispatcher) {\
+    struct counts\
+    {\
+      std::atomic<int> ok{};\
+      std::atomic<int> wrong{};\
+    } results;\
+    const auto done = [](void* user, amx::error result, my_amx::cell retval)\
+    {\
+      auto& c = *(counts*)user;\
+      ++(result == amx::error::success && retval == 12 ? c.ok : c.wrong);\
+    };\
+    amx::dispatcher<my_amx> pool;\
+    ASSERT_EQ(pool.init(_ldr.get_program(), CALLBACKS, { 4, true }), amx::loader_error::success);\
+    EXPECT_EQ(pool.thread_count(), 4);\
+    const auto fn = _ldr.find_public("test_Statics");\
+    for (int i = 0; i < 500; ++i)\
+      ASSERT_TRUE(pool.submit(fn, {}, done, &results));\
+    pool.wait();\
+    EXPECT_EQ(results.ok, 500);\
+    EXPECT_EQ(results.wrong, 0);\
+    EXPECT_TRUE(pool.submit({}, {}, done, &results));\
+    pool.wait();\
+    EXPECT_EQ(results.wrong, 1);\
+    std::atomic<size_t> completed{};\
+    const auto chunk_done = [](void* user, amx::error result, my_amx::cell rows)\
+    {\
+      if (result == amx::error::success)\
+        *(std::atomic<size_t>*)user += rows;\
+    };\
+    std::vector<my_amx::cell> retvals(1000);\
+    const auto arithmetic = _ldr.find_public("test_Arithmetic");\
+    ASSERT_TRUE(pool.submit_batch(arithmetic, nullptr, 0, retvals.data(), retvals.size(), chunk_done, &completed, 100));\
+    pool.wait();\
+    EXPECT_EQ(completed, retvals.size());\
+    EXPECT_EQ(std::count(retvals.begin(), retvals.end(), 1), 1000);\
+  }\
+
+TEST_DISPATCHER(Amx32Test);
+TEST_DISPATCHER(Amx64Test);
+
+// wait() has to cover every call submitted before it, even while other threads keep submitting
+TEST_F(Amx32Test, DispatcherConcurrentWait) {
+  amx::dispatcher<my_amx> pool;
+  ASSERT_EQ(pool.init(_ldr.get_program(), CALLBACKS, { 4, false }), amx::loader_error::success);
+  const auto fn = _ldr.find_public("test_Arithmetic");
+  std::atomic<size_t> submitted{};
+  std::atomic<size_t> completed{};
+  std::atomic<int> producing{ 2 };
+  const auto done = [](void* user, amx::error, my_amx::cell) { ++*(std::atomic<size_t>*)user; };
+  const auto produce = [&]
+  {
+    for (int i = 0; i < 2000; ++i)
+    {
+      EXPECT_TRUE(pool.submit(fn, {}, done, &completed));
+      ++submitted;
+    }
+    --producing;
+  };
+  std::thread producers[]{ std::thread(produce), std::thread(produce) };
+  size_t early{};
+  while (producing)
+  {
+    const auto before = submitted.load();
+    pool.wait();
+    early += completed.load() < before;
+  }
+  for (auto& t : producers)
+    t.join();
+  pool.wait();
+  EXPECT_EQ(early, 0u);
+  EXPECT_EQ(completed, 4000u);
+}
+
+#if AMX_PROFILE
+#define TEST_PROFILER(fixture) \
+  TEST_F(fixture, Profiler) {\
+    amx::profiler<my_amx> profiler;\
+    profiler.attach(_ldr);\
+    const auto fn = _ldr.get_public("test_Arithmetic");\
+    my_amx::cell retval{};\
+    EXPECT_EQ(_ldr.amx.call(fn, retval), amx::error::success);\
+    EXPECT_EQ(retval, 1);\
+    EXPECT_EQ(profiler.functions().at(fn).calls, 1);\
+    EXPECT_EQ(profiler.functions().at(fn).inclusive_instructions, profiler.instructions());\
+    EXPECT_GT(profiler.natives().at(0).calls, 0);\
+    EXPECT_EQ(profiler.folded().find("test_Arithmetic "), 0);\
+    /* natives don't execute instructions, so they only show up by time */\
+    EXPECT_NE(profiler.folded(amx::profile_weight::nanoseconds).find("test_Arithmetic;opaque "), std::string::npos);\
+    /* the frames of a failed call are closed */\
+    const auto div = _ldr.get_public("test_DivZero");\
+    EXPECT_EQ(_ldr.amx.call(div, retval), amx::error::division_with_zero);\
+    EXPECT_EQ(profiler.functions().at(div).calls, 1);\
+    profiler.detach();\
+  }\
+
+TEST_PROFILER(Amx16Test);
+TEST_PROFILER(Amx32Test);
+TEST_PROFILER(Amx64DecodedTest);
+TEST_PROFILER(Amx32JitTest);
+#endif
+
+#define TEST_SNAPSHOT_RESTORE(fixture) \
+  TEST_F(fixture, SnapshotRestore) {\
+    const auto fn = _ldr.get_public("test_Statics");\
+    const auto snap = _ldr.snapshot();\
+    my_amx::cell retval{};\
+    EXPECT_EQ(_ldr.amx.call(fn, retval), amx::error::success);\
+    EXPECT_EQ(retval, 12);\
+    EXPECT_TRUE(_ldr.restore(snap));\
+    EXPECT_EQ(_ldr.amx.call(fn, retval), amx::error::success);\
+    EXPECT_EQ(retval, 12);\
+    _ldr.reset();\
+    EXPECT_EQ(_ldr.amx.call(fn, retval), amx::error::success);\
+    EXPECT_EQ(retval, 12);\
+  }\
+
+TEST_SNAPSHOT_RESTORE(Amx16Test);
+TEST_SNAPSHOT_RESTORE(Amx32Test);
+TEST_SNAPSHOT_RESTORE(Amx64Test);
+
+#define TEST_BORROWED_CODE(fixture) \
+  TEST_F(fixture, BorrowedCode) {\
+    const auto file = readall(("test" + std::to_string(my_amx::cell_bits) + ".amx").c_str());\
+    const auto program = std::make_shared<typename my_amx_loader::program_t>();\
+    ASSERT_EQ(program->init(file.data(), file.size(), NATIVES, std::size(NATIVES), { true, true }), amx::loader_error::success);\
+    /* a von Neumann instance could write the borrowed buffer through data, so it's copied there */\
+    const auto code = (const cell*)(file.data() + amx::detail::read_le<uint32_t>(file.data() + 12));\
+    EXPECT_EQ(program->get_code() == code, !amx::detail::shares_backing<typename my_amx::memory_manager_t>::value);\
+    my_amx_loader instance;\
+    ASSERT_EQ(instance.init(program, CALLBACKS), amx::loader_error::success);\
+    my_amx::cell retval{};\
+    EXPECT_EQ(instance.amx.call(instance.get_public("test_Arithmetic"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 1);\
+  }\
+
+TEST_BORROWED_CODE(Amx16Test);
+TEST_BORROWED_CODE(Amx32Test);
+TEST_BORROWED_CODE(Amx64Test);
+TEST_BORROWED_CODE(Amx32GuardedTest);
+
+#define TEST_SHARED_PROGRAM_CODE(fixture) \
+  TEST_F(fixture, SharedProgramCode) {\
+    const auto program = _ldr.get_program();\
+    my_amx_loader instance;\
+    ASSERT_EQ(instance.init(program, CALLBACKS), amx::loader_error::success);\
+    /* a von Neumann instance could write the shared code through data, so it gets its own */\
+    const auto shares = amx::detail::shares_backing<typename my_amx::memory_manager_t>::value;\
+    EXPECT_EQ(instance.amx.code_v2p(0) == program->get_code(), !shares);\
+    EXPECT_TRUE(std::equal(program->get_code(), program->get_code() + program->get_code_size(), instance.amx.code_v2p(0)));\
+    my_amx::cell retval{};\
+    EXPECT_EQ(instance.amx.call(instance.get_public("test_Arithmetic"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 1);\
+  }\
+
+TEST_SHARED_PROGRAM_CODE(Amx32Test);
+TEST_SHARED_PROGRAM_CODE(Amx32GuardedTest);
+
+// Hands out the file a few bytes at a time, like a socket would.
+struct chunked_reader
+{
+  const std::vector<uint8_t>& file;
+  size_t end;
+  size_t pos;
+
+  static size_t read(void* user, uint8_t* dst, size_t size)
+  {
+    const auto self = (chunked_reader*)user;
+    const auto n = std::min({ size, (size_t)7, self->end - self->pos });
+    memcpy(dst, self->file.data() + self->pos, n);
+    self->pos += n;
+    return n;
+  }
+};
+
+#define TEST_STREAMED_LOAD(fixture) \
+  TEST_F(fixture, StreamedLoad) {\
+    const auto file = readall(("test" + std::to_string(my_amx::cell_bits) + ".amx").c_str());\
+    chunked_reader reader{ file, file.size(), 0 };\
+    my_amx_loader instance;\
+    ASSERT_EQ(instance.init(&chunked_reader::read, &reader, CALLBACKS, { true }), amx::loader_error::success);\
+    EXPECT_EQ(instance.get_program()->get_code_size(), _ldr.get_program()->get_code_size());\
+    EXPECT_TRUE(std::equal(\
+      instance.get_program()->get_code(),\
+      instance.get_program()->get_code() + instance.get_program()->get_code_size(),\
+      _ldr.get_program()->get_code()\
+    ));\
+    my_amx::cell retval{};\
+    EXPECT_EQ(instance.amx.call(instance.get_public("test_Arithmetic"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 1);\
+    EXPECT_EQ(instance.amx.call(instance.get_public("test_Statics"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 12);\
+    /* cut off before the end of the segments */\
+    chunked_reader truncated{ file, file.size() - 64, 0 };\
+    EXPECT_EQ(instance.init(&chunked_reader::read, &truncated, CALLBACKS), amx::loader_error::invalid_file);\
+  }\
+
+TEST_STREAMED_LOAD(Amx16Test);
+TEST_STREAMED_LOAD(Amx32Test);
+TEST_STREAMED_LOAD(Amx64Test);
+
+#define TEST_CACHE_FILE(fixture) \
+  TEST_F(fixture, CacheFile) {\
+    std::vector<uint8_t> cache;\
+    _ldr.get_program()->write_cache(cache);\
+    const auto program = std::make_shared<typename my_amx_loader::program_t>();\
+    ASSERT_EQ(program->init_cached(cache.data(), cache.size(), NATIVES, std::size(NATIVES), { true, true }), amx::loader_error::success);\
+    const auto borrowed = !amx::detail::shares_backing<typename my_amx::memory_manager_t>::value;\
+    EXPECT_EQ(program->get_code() == (const cell*)(cache.data() + 80), borrowed);\
+    EXPECT_EQ(program->get_publics().size(), _ldr.get_program()->get_publics().size());\
+    std::vector<uint8_t> again;\
+    program->write_cache(again);\
+    EXPECT_EQ(again, cache);\
+    my_amx_loader instance;\
+    ASSERT_EQ(instance.init(program, CALLBACKS), amx::loader_error::success);\
+    my_amx::cell retval{};\
+    EXPECT_EQ(instance.amx.call(instance.get_public("test_Arithmetic"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 1);\
+    EXPECT_EQ(instance.amx.call(instance.get_public("test_Statics"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 12);\
+    EXPECT_EQ(program->init_cached(cache.data(), cache.size() - 1, NATIVES, std::size(NATIVES)), amx::loader_error::invalid_file);\
+    cache[4] += 1;\
+    EXPECT_EQ(program->init_cached(cache.data(), cache.size(), NATIVES, std::size(NATIVES)), amx::loader_error::unsupported_file_version);\
+    cache[4] -= 1;\
+    cache[6] = cache[6] == 32 ? 64 : 32;\
+    EXPECT_EQ(program->init_cached(cache.data(), cache.size(), NATIVES, std::size(NATIVES)), amx::loader_error::wrong_cell_size);\
+  }\
+
+TEST_CACHE_FILE(Amx16Test);
+TEST_CACHE_FILE(Amx32Test);
+TEST_CACHE_FILE(Amx64Test);
+TEST_CACHE_FILE(Amx32GuardedTest);
+
+// Runs a file with overlays built by hand, stepped or predecoded depending on the parameter.
+class OverlayTest : public ::testing::TestWithParam<bool>
+{
+protected:
+  using my_amx = amx::amx<uint32_t, amx::memory_manager_neumann<amx::memory_backing_paged_buffers<5>>>;
+  using my_amx_loader = amx::loader<my_amx>;
+  using cell = my_amx::cell;
+
+  enum : cell {
+    CONST_PRI = 9, CONST_ALT = 10, LOAD_S_PRI = 3, LOAD_S_ALT = 4, PUSH_PRI = 22, STACK = 28, PROC = 30, ADD = 44,
+    HALT = 67, SYSREQ = 69, CALL_OVL = 77, RETN_OVL = 78, SWITCH_OVL = 79, CASETBL_OVL = 80
+  };
+
+  // g(x) called from inside a native, so the overlay of the caller has to come back afterwards
+  static amx::error nested(my_amx* amx, my_amx_loader* loader, void*, cell, cell, cell& retval)
+  {
+    return amx->call(loader->get_public("g"), retval, { loader->args()[0] });
+  }
+
+  static constexpr my_amx_loader::native_arg NATIVES[]{ { "nested", &nested } };
+
+  // overlay 0 is the HALT, then f() returns g(5) + 1, g(x) returns 2 * x, h() returns nested(7) + 100 and s() is a
+  // state function picking f() for state 2
+  static std::vector<uint8_t> build()
+  {
+    const std::vector<std::vector<cell>> overlays{
+      { HALT, 0 },
+      { PROC, CONST_PRI, 5, PUSH_PRI, CONST_PRI, 4, PUSH_PRI, CALL_OVL, 2, CONST_ALT, 1, ADD, RETN_OVL },
+      { PROC, LOAD_S_PRI, 12, LOAD_S_ALT, 12, ADD, RETN_OVL },
+      { PROC, CONST_PRI, 7, PUSH_PRI, CONST_PRI, 4, PUSH_PRI, SYSREQ, 0, STACK, 8, CONST_ALT, 100, ADD, RETN_OVL },
+      { CONST_PRI, 2, SWITCH_OVL, 8, CASETBL_OVL, 2, 2, 1, 2, 2, 1 },
+    };
+    const char names[] = "f\0g\0h\0s\0nested";
+    const uint32_t publics = 60, natives = publics + 4 * 8, overlay_table = natives + 8;
+    const uint32_t nametable = overlay_table + (uint32_t)overlays.size() * 8;
+    const uint32_t cod = (nametable + 2 + (uint32_t)sizeof(names) + 3) & ~3u;
+    std::vector<uint8_t> file(cod);
+    const auto put = [&](uint32_t offset, uint32_t v) { memcpy(file.data() + offset, &v, 4); };
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+      put(publics + i * 8, i + 1);
+      put(publics + i * 8 + 4, nametable + 2 + i * 2);
+    }
+    put(natives + 4, nametable + 2 + 8);
+    memcpy(file.data() + nametable + 2, names, sizeof(names));
+    uint32_t offset{};
+    for (size_t i = 0; i < overlays.size(); ++i)
+    {
+      put(overlay_table + (uint32_t)i * 8, offset);
+      put(overlay_table + (uint32_t)i * 8 + 4, (uint32_t)overlays[i].size() * 4);
+      file.insert(file.end(), (const uint8_t*)overlays[i].data(), (const uint8_t*)(overlays[i].data() + overlays[i].size()));
+      offset += (uint32_t)overlays[i].size() * 4;
+    }
+    const auto dat = (uint32_t)file.size();
+    put(0, dat);
+    put(4, 0xF1E0 | 11 << 16 | 11 << 24);
+    put(8, 1 | 8 << 16);
+    put(12, cod);
+    put(16, dat);
+    put(20, dat);
+    put(24, dat + 1024);
+    put(28, (uint32_t)-1);
+    put(32, publics);
+    put(36, natives);
+    for (uint32_t i = 40; i <= 48; i += 4)
+      put(i, overlay_table);
+    put(52, nametable);
+    put(56, overlay_table);
+    return file;
+  }
+
+  std::vector<uint8_t> _file = build();
+  my_amx_loader _ldr;
+
+  amx::loader_error load(size_t cache_size)
+  {
+    my_amx_loader::options_arg options{};
+    options.predecode = GetParam();
+    options.overlay_cache_size = cache_size;
+    return _ldr.init(_file.data(), _file.size(), { NATIVES, std::size(NATIVES), nullptr, nullptr, nullptr }, options);
+  }
+
+  cell call(const char* name)
+  {
+    cell retval{};
+    EXPECT_EQ(_ldr.amx.call(_ldr.get_public(name), retval), amx::error::success) << name;
+    EXPECT_EQ(_ldr.amx.get_overlay(), 0u);
+    return retval;
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(Engines, OverlayTest, ::testing::Values(false, true));
+
+TEST_P(OverlayTest, CallsAcrossOverlays) {
+  ASSERT_EQ(load(0), amx::loader_error::success);
+  EXPECT_EQ(_ldr.get_program()->get_overlay_count(), 5u);
+  EXPECT_EQ(call("f"), 11u);
+  EXPECT_EQ(call("h"), 114u);
+  EXPECT_EQ(call("s"), 11u);
+  const auto stats = _ldr.get_program()->get_overlay_stats();
+  EXPECT_EQ(stats.evictions, 0u);
+  EXPECT_EQ(stats.misses, GetParam() ? 5u : 0u);
+  EXPECT_EQ(stats.resident, GetParam() ? 5u : 0u);
+
+  // without a handler there are no overlays to switch to
+  my_amx bare;
+  EXPECT_EQ(bare.switch_overlay(1), amx::error::invalid_instruction);
+
+  // engines run flat code only, they are kept away while a handler is installed
+  const auto engine = [](my_amx*, void*) { return amx::error::invalid_instruction; };
+  EXPECT_FALSE(_ldr.amx.attach_engine(engine, nullptr));
+  EXPECT_FALSE(_ldr.amx.has_engine());
+  EXPECT_EQ(call("f"), 11u);
+  EXPECT_TRUE(bare.attach_engine(engine, nullptr));
+  bare.set_overlay_handler([](my_amx*, void*, cell) { return amx::error::success; }, nullptr);
+  EXPECT_FALSE(bare.has_engine());
+}
+
+TEST_P(OverlayTest, CacheFile) {
+  ASSERT_EQ(load(0), amx::loader_error::success);
+  std::vector<uint8_t> cache;
+  _ldr.get_program()->write_cache(cache);
+  const auto program = std::make_shared<my_amx_loader::program_t>();
+  my_amx_loader::options_arg options{};
+  options.predecode = GetParam();
+  ASSERT_EQ(program->init_cached(cache.data(), cache.size(), NATIVES, std::size(NATIVES), options), amx::loader_error::success);
+  EXPECT_EQ(program->get_overlay_count(), 5u);
+  ASSERT_EQ(_ldr.init(program, { NATIVES, std::size(NATIVES), nullptr, nullptr, nullptr }), amx::loader_error::success);
+  EXPECT_EQ(call("h"), 114u);
+}
+
+TEST_P(OverlayTest, CacheEvictsLeastRecentlyUsed) {
+  ASSERT_EQ(load(2), amx::loader_error::success);
+  EXPECT_EQ(call("f"), 11u);
+  EXPECT_EQ(call("h"), 114u);
+  EXPECT_EQ(call("s"), 11u);
+  const auto stats = _ldr.get_program()->get_overlay_stats();
+  if (GetParam())
+  {
+    EXPECT_GT(stats.evictions, 0u);
+    EXPECT_LE(stats.resident, 2u);
+    EXPECT_EQ(stats.misses - stats.evictions, stats.resident);
+  }
+  // verification doesn't cover overlays
+  my_amx_loader::options_arg options{};
+  options.verify = true;
+  EXPECT_EQ(_ldr.init(_file.data(), _file.size(), { NATIVES, std::size(NATIVES), nullptr, nullptr, nullptr }, options),
+    amx::loader_error::feature_not_supported);
+}
+
+// public get() returns the variable at `address`, the initial data is `data` and `names` are the public variables of
+// its cells, "" for none
+static std::vector<uint8_t> build_pubvar_file(
+  const std::vector<std::string>& names,
+  const std::vector<uint32_t>& data,
+  uint32_t address
+)
+{
+  enum : uint32_t { LOAD_PRI = 1, PROC = 30, RETN = 32, HALT = 67 };
+  const std::vector<uint32_t> code{ HALT, 0, PROC, LOAD_PRI, address, RETN };
+  std::string pool{ "get" };
+  pool.push_back('\0');
+  std::vector<std::pair<uint32_t, uint32_t>> pubvars;
+  for (uint32_t i = 0; i < names.size(); ++i)
+  {
+    if (names[i].empty())
+      continue;
+    pubvars.emplace_back(i * 4, (uint32_t)pool.size());
+    pool += names[i];
+    pool.push_back('\0');
+  }
+  const uint32_t publics = 60, pubvar_table = publics + 8, nametable = pubvar_table + (uint32_t)pubvars.size() * 8;
+  const uint32_t cod = (nametable + 2 + (uint32_t)pool.size() + 3) & ~3u;
+  const uint32_t dat = cod + (uint32_t)code.size() * 4;
+  const uint32_t hea = dat + (uint32_t)data.size() * 4;
+  std::vector<uint8_t> file(hea);
+  const auto put = [&](uint32_t offset, uint32_t v) { memcpy(file.data() + offset, &v, 4); };
+  put(publics, 8);
+  put(publics + 4, nametable + 2);
+  for (size_t i = 0; i < pubvars.size(); ++i)
+  {
+    put(pubvar_table + (uint32_t)i * 8, pubvars[i].first);
+    put(pubvar_table + (uint32_t)i * 8 + 4, nametable + 2 + pubvars[i].second);
+  }
+  memcpy(file.data() + nametable + 2, pool.data(), pool.size());
+  memcpy(file.data() + cod, code.data(), code.size() * 4);
+  memcpy(file.data() + dat, data.data(), data.size() * 4);
+  put(0, hea);
+  put(4, 0xF1E0 | 11 << 16 | 11 << 24);
+  put(8, 8 << 16);
+  put(12, cod);
+  put(16, dat);
+  put(20, hea);
+  put(24, hea + 1024);
+  put(28, (uint32_t)-1);
+  put(32, publics);
+  for (uint32_t i = 36; i <= 44; i += 4)
+    put(i, pubvar_table);
+  put(48, nametable);
+  put(52, nametable);
+  put(56, nametable);
+  return file;
+}
+
+TEST(Reload, KeepsPublicVariables) {
+  using my_amx = amx::amx<uint32_t, amx::memory_manager_neumann<amx::memory_backing_paged_buffers<5>>>;
+  using my_amx_loader = amx::loader<my_amx>;
+  const my_amx_loader::callbacks_arg callbacks{};
+  const auto v1 = build_pubvar_file({ "a", "b", "" }, { 1, 2, 3 }, 4);
+  my_amx_loader instance;
+  ASSERT_EQ(instance.init(v1.data(), v1.size(), callbacks), amx::loader_error::success);
+  *instance.amx.data_v2p(instance.get_pubvar("b")) = 7;
+  uint32_t retval{};
+  EXPECT_EQ(instance.amx.call(instance.get_public("get"), retval), amx::error::success);
+  EXPECT_EQ(retval, 7u);
+
+  // b moves to address 0, c is new and a is gone
+  const auto v2 = build_pubvar_file({ "b", "c" }, { 20, 30 }, 0);
+  const auto program = std::make_shared<my_amx_loader::program_t>();
+  std::thread([&] { EXPECT_EQ(program->init(v2.data(), v2.size(), nullptr, 0, { true }), amx::loader_error::success); }).join();
+  ASSERT_EQ(instance.reload(program), amx::loader_error::success);
+  EXPECT_EQ(instance.get_program(), program);
+  EXPECT_EQ(instance.amx.call(instance.get_public("get"), retval), amx::error::success);
+  EXPECT_EQ(retval, 7u);
+  EXPECT_EQ(*instance.amx.data_v2p(instance.get_pubvar("c")), 30u);
+  EXPECT_EQ(instance.reload(nullptr), amx::loader_error::unknown);
+}
+
+#define TEST_STACK_HEAP_COLLISION(fixture) \
+  TEST_F(fixture, StackHeapCollision) {\
+    my_amx::cell retval{};\
+    _ldr.reset();\
+    _ldr.amx.HEA = (my_amx::cell)(_ldr.amx.STK - 8 * sizeof(my_amx::cell));\
+    EXPECT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::stack_heap_collision);\
+    _ldr.reset();\
+    EXPECT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::success);\
+  }\
+
+TEST_STACK_HEAP_COLLISION(Amx16Test);
+TEST_STACK_HEAP_COLLISION(Amx32Test);
+TEST_STACK_HEAP_COLLISION(Amx64Test);
+TEST_STACK_HEAP_COLLISION(Amx32DecodedTest);
+TEST_STACK_HEAP_COLLISION(Amx32JitTest);
+TEST_STACK_HEAP_COLLISION(Amx64JitTest);
+
+// the compiled code belongs to the program it was compiled from
+TEST_F(Amx32JitTest, InitDetachesEngine) {
+  if (!_ldr.amx.has_engine())
+    GTEST_SKIP();
+  ASSERT_EQ(load({}), amx::loader_error::success);
+  EXPECT_FALSE(_ldr.amx.has_engine());
+  cell retval{};
+  EXPECT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::success);
+  EXPECT_EQ(retval, 1u);
+}
+
+TEST_F(Amx32Test, StackHeapSize) {
+  my_amx_loader::options_arg options{};
+  options.stack_heap_size = 16 * sizeof(cell);
+  ASSERT_EQ(load(options), amx::loader_error::success);
+  cell retval{};
+  EXPECT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::stack_heap_collision);
+  options.stack_heap_size = 4096;
+  ASSERT_EQ(load(options), amx::loader_error::success);
+  EXPECT_EQ(_ldr.amx.STP - _ldr.amx.HEA, 4096 - sizeof(cell));
+  EXPECT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::success);
+  EXPECT_EQ(retval, 1u);
+}
+
+#define TEST_LAZY_NATIVES(fixture) \
+  TEST_F(fixture, LazyNatives) {\
+    const auto file = readall(("test" + std::to_string(my_amx::cell_bits) + ".amx").c_str());\
+    const typename my_amx_loader::program_t::registry_t registry{ NATIVES, std::size(NATIVES) };\
+    const typename my_amx_loader::program_t::registry_t empty{};\
+    const auto program = std::make_shared<typename my_amx_loader::program_t>();\
+    ASSERT_EQ(program->init(file.data(), file.size(), empty), amx::loader_error::native_not_resolved);\
+    ASSERT_EQ(program->init(file.data(), file.size(), empty, { false, false, true }), amx::loader_error::success);\
+    my_amx_loader unresolved;\
+    ASSERT_EQ(unresolved.init(program, CALLBACKS), amx::loader_error::success);\
+    my_amx::cell retval{};\
+    EXPECT_EQ(unresolved.amx.call(unresolved.get_public("test_Arithmetic"), retval), amx::error::invalid_operand);\
+    EXPECT_EQ(unresolved.amx.call(unresolved.get_public("test_Statics"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 12);\
+    const auto lazy = std::make_shared<typename my_amx_loader::program_t>();\
+    ASSERT_EQ(lazy->init(file.data(), file.size(), registry, { false, false, true }), amx::loader_error::success);\
+    my_amx_loader instance;\
+    ASSERT_EQ(instance.init(lazy, CALLBACKS), amx::loader_error::success);\
+    EXPECT_EQ(instance.amx.call(instance.get_public("test_Arithmetic"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 1);\
+  }\
+
+TEST_LAZY_NATIVES(Amx32Test);
+TEST_LAZY_NATIVES(Amx64Test);
+
+#define TEST_PUBLIC_HANDLE(fixture) \
+  TEST_F(fixture, PublicHandle) {\
+    EXPECT_FALSE(_ldr.find_public("test_DoesNotExist"));\
+    const std::string_view name{ "test_Arithmetic_" };\
+    const auto fn = _ldr.find_public(name.substr(0, name.size() - 1));\
+    ASSERT_TRUE(fn);\
+    EXPECT_EQ(fn.get(), _ldr.get_public("test_Arithmetic"));\
+    for (int i = 0; i < 3; ++i)\
+    {\
+      my_amx::cell retval{};\
+      EXPECT_EQ(_ldr.call(fn, retval), amx::error::success);\
+      EXPECT_EQ(retval, 1);\
+    }\
+    my_amx::cell retval{};\
+    EXPECT_EQ(_ldr.call({}, retval), amx::error::invalid_operand);\
+  }\
+
+TEST_PUBLIC_HANDLE(Amx16Test);
+TEST_PUBLIC_HANDLE(Amx32Test);
+TEST_PUBLIC_HANDLE(Amx64Test);
+
+// 16 byte pages, so the bulk memory opcodes have to cross several mappings
+using small_pages_amx = amx::amx<uint16_t, amx::memory_manager_harvard<
+  amx::memory_backing_paged_buffers<12>,
+  amx::memory_backing_paged_buffers<12>
+>>;
+
+// Runs hand assembled code, stepped or decoded depending on the parameter.
+class AssembledTest : public ::testing::TestWithParam<bool>
+{
+protected:
+  using cell = small_pages_amx::cell;
+
+  enum : cell {
+    LOAD_S_PRI = 3, LOAD_S_ALT = 4, LREF_S_PRI = 5, CONST_PRI = 9, CONST_ALT = 10, SREF_S = 15, PUSH_PRI = 22, PROC = 30,
+    RET = 31, RETN = 32, CALL = 33, JUMP = 34, ADD = 44, MOVS = 64, CMPS = 65, FILL = 66, HALT = 67, SYSREQ = 69,
+    SWITCH = 70, CASETBL = 74, STACK = 28, HEAP = 29
+  };
+
+  small_pages_amx _amx;
+  std::vector<cell> _code;
+  std::vector<small_pages_amx::decoded_t> _decoded;
+  cell _data[40]{};
+  cell _retval{};
+
+  cell _code_base{};
+  cell _data_base{};
+
+  // `code` is called at cell 2, after a HALT for the return address to point at
+  void load(const std::vector<cell>& code)
+  {
+    _code = { HALT, 0 };
+    _code.insert(_code.end(), code.begin(), code.end());
+    EXPECT_TRUE(_amx.mem.code().map(_code.data(), _code.size(), _code_base));
+    EXPECT_TRUE(_amx.mem.data().map(_data, std::size(_data), _data_base));
+    _amx.COD = _code_base;
+    _amx.DAT = _data_base;
+    _amx.STK = _amx.STP = (cell)sizeof(_data);
+    _amx.set_single_step(false);
+    _amx.detach_decoded();
+    if (GetParam())
+    {
+      _decoded.resize(_code.size() + 1);
+      small_pages_amx::decode(_code.data(), _code.size(), _decoded.data());
+      _amx.attach_decoded(_decoded.data(), _code.size());
+    }
+  }
+
+  void unload()
+  {
+    _amx.mem.data().unmap(_data_base, std::size(_data));
+    _amx.mem.code().unmap(_code_base, _code.size());
+  }
+
+  amx::error run(const std::vector<cell>& code, small_pages_amx::argument_span args = {})
+  {
+    load(code);
+    const auto result = _amx.call(2 * sizeof(cell), _retval, args);
+    unload();
+    return result;
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(Engines, AssembledTest, ::testing::Values(false, true));
+
+class BulkMemoryTest : public AssembledTest
+{
+protected:
+  // runs `opcode` with PRI and ALT set, returning what call() does
+  amx::error run(cell pri, cell alt, cell opcode, cell bytes)
+  {
+    return AssembledTest::run({ PROC, CONST_PRI, pri, CONST_ALT, alt, opcode, bytes, RETN });
+  }
+};
+
+TEST_P(BulkMemoryTest, OverlappingMove) {
+  for (cell i = 0; i < 30; ++i)
+    _data[i] = i;
+  EXPECT_EQ(run(0, 2 * sizeof(cell), MOVS, 20 * sizeof(cell)), amx::error::success);
+  for (cell i = 0; i < 22; ++i)
+    EXPECT_EQ(_data[i], i % 2);
+  EXPECT_EQ(_data[22], 22);
+}
+
+TEST_P(BulkMemoryTest, MoveFaultsAtFirstUnmappedCell) {
+  for (cell i = 0; i < 40; ++i)
+    _data[i] = i;
+  EXPECT_EQ(run(0, 30 * sizeof(cell), MOVS, 20 * sizeof(cell)), amx::error::access_violation);
+  for (cell i = 30; i < 40; ++i)
+    EXPECT_EQ(_data[i], i - 30);
+  EXPECT_EQ(_amx.CIP, 9 * sizeof(cell));
+}
+
+TEST_P(BulkMemoryTest, Compare) {
+  for (cell i = 0; i < 15; ++i)
+    _data[i] = _data[i + 15] = i;
+  _data[15 + 13] = 20;
+  EXPECT_EQ(run(0, 15 * sizeof(cell), CMPS, 15 * sizeof(cell)), amx::error::success);
+  EXPECT_EQ(_retval, 20 - 13);
+  EXPECT_EQ(run(0, 15 * sizeof(cell), CMPS, 13 * sizeof(cell)), amx::error::success);
+  EXPECT_EQ(_retval, 0);
+}
+
+TEST_P(BulkMemoryTest, FillFaultsAtFirstUnmappedCell) {
+  EXPECT_EQ(run(7, 3 * sizeof(cell), FILL, 40 * sizeof(cell)), amx::error::access_violation);
+  for (cell i = 0; i < 40; ++i)
+    EXPECT_EQ(_data[i], i < 3 ? 0 : 7);
+}
+
+INSTANTIATE_TEST_SUITE_P(Engines, BulkMemoryTest, ::testing::Values(false, true));
+
+// a[0] += b, returning the sum
+#define ADD_TO_FIRST { PROC, LOAD_S_ALT, 4 * sizeof(cell), LREF_S_PRI, 3 * sizeof(cell), ADD, SREF_S, 3 * sizeof(cell), RETN }
+
+TEST_P(AssembledTest, ArrayArgumentsGoOnTheHeap) {
+  cell arr[]{ 10, 20 };
+  EXPECT_EQ(run(ADD_TO_FIRST, { { arr, 2 }, 5 }), amx::error::success);
+  EXPECT_EQ(_retval, 15);
+  EXPECT_EQ(arr[0], 15);
+  EXPECT_EQ(arr[1], 20);
+  // the copy was at the start of the heap, which is released again
+  EXPECT_EQ(_data[0], 15);
+  EXPECT_EQ(_data[1], 20);
+  EXPECT_EQ(_amx.HEA, 0);
+  EXPECT_EQ(_amx.STK, sizeof(_data));
+
+  const cell constant[]{ 1 };
+  EXPECT_EQ(run(ADD_TO_FIRST, { { constant, 1 }, 2 }), amx::error::success);
+  EXPECT_EQ(_retval, 3);
+
+  const small_pages_amx::argument args[]{ small_pages_amx::argument::unpacked("AB"), 2 };
+  EXPECT_EQ(run(ADD_TO_FIRST, args), amx::error::success);
+  EXPECT_EQ(_retval, 'A' + 2);
+  EXPECT_EQ(_data[1], 'B');
+  EXPECT_EQ(_data[2], 0);
+}
+
+TEST_P(AssembledTest, Batch) {
+  // a + b, with a frame that crosses a page for some STK
+  const std::vector<cell> code{ PROC, LOAD_S_PRI, 3 * sizeof(cell), LOAD_S_ALT, 4 * sizeof(cell), ADD, RETN };
+  const cell rows[]{ 1, 2, 30, 40, 500, 600 };
+  for (cell stk : { sizeof(_data), 26 * sizeof(cell) })
+  {
+    load(code);
+    _amx.STK = stk;
+    cell results[3]{};
+    size_t completed{};
+    EXPECT_EQ(_amx.call_batch(2 * sizeof(cell), rows, 2, results, 3, completed), amx::error::success);
+    EXPECT_EQ(completed, 3);
+    EXPECT_EQ(results[0], 3);
+    EXPECT_EQ(results[1], 70);
+    EXPECT_EQ(results[2], 1100);
+    EXPECT_EQ(_amx.STK, stk);
+    EXPECT_EQ(_amx.HEA, 0);
+
+    // the frame doesn't fit below STK
+    _amx.STK = 2 * sizeof(cell);
+    EXPECT_EQ(_amx.call_batch(2 * sizeof(cell), rows, 2, results, 3, completed), amx::error::access_violation);
+    EXPECT_EQ(completed, 0);
+    EXPECT_EQ(_amx.STK, 2 * sizeof(cell));
+    unload();
+  }
+}
+
+TEST_P(AssembledTest, ArgumentsThatDontFitChangeNothing) {
+  cell big[38]{};
+  EXPECT_EQ(run(ADD_TO_FIRST, { { big, 38 }, 1 }), amx::error::stack_heap_collision);
+  EXPECT_EQ(_amx.HEA, 0);
+  EXPECT_EQ(_amx.STK, sizeof(_data));
+}
+
+#undef ADD_TO_FIRST
+
+TEST_P(AssembledTest, StackHeapCollision) {
+  // endless recursion stops short of the heap instead of running into it
+  EXPECT_EQ(run({ PROC, CALL, (cell)-(cell)sizeof(cell) }), amx::error::stack_heap_collision);
+  EXPECT_GE(_amx.STK, _amx.HEA);
+  EXPECT_EQ(run({ PROC, HEAP, 30 * sizeof(cell), RETN }), amx::error::stack_heap_collision);
+  EXPECT_EQ(run({ PROC, STACK, (cell)-(cell)(30 * sizeof(cell)), RETN }), amx::error::stack_heap_collision);
+  const auto block = (cell)(10 * sizeof(cell));
+  EXPECT_EQ(run({ PROC, HEAP, block, STACK, (cell)-block, STACK, block, HEAP, (cell)-block, RETN }), amx::error::success);
+}
+
+#if AMX_PROFILE
+TEST_P(AssembledTest, Profiler) {
+  amx::profiler<small_pages_amx> profiler;
+  const std::vector<cell> code{
+    PROC, CONST_PRI, 0, PUSH_PRI, CALL, 3 * sizeof(cell), RETN,
+    PROC, CONST_PRI, 7, RETN
+  };
+  load(code);
+  profiler.attach(_amx, _code.data(), _code.size());
+  EXPECT_EQ(_amx.call(2 * sizeof(cell), _retval), amx::error::success);
+  EXPECT_EQ(_retval, 7);
+  EXPECT_EQ(profiler.instructions(), 8);
+  const auto opcodes = profiler.opcode_counts();
+  EXPECT_EQ(opcodes[PROC], 2);
+  EXPECT_EQ(opcodes[CONST_PRI], 2);
+  EXPECT_EQ(opcodes[PUSH_PRI], 1);
+  EXPECT_EQ(opcodes[CALL], 1);
+  EXPECT_EQ(opcodes[RETN], 2);
+  const auto& outer = profiler.functions().at(2 * sizeof(cell));
+  EXPECT_EQ(outer.calls, 1);
+  EXPECT_EQ(outer.inclusive_instructions, 8);
+  EXPECT_EQ(outer.exclusive_instructions, 5);
+  EXPECT_EQ(profiler.functions().at(9 * sizeof(cell)).exclusive_instructions, 3);
+  EXPECT_EQ(profiler.folded(), "0x4 5\n0x4;0x12 3\n");
+  profiler.detach();
+  unload();
+}
+#endif
+
+// Switches on `value` over (value, result) cases, returning 100 by default
+static std::vector<uint16_t> switch_code(uint16_t value, std::initializer_list<std::pair<uint16_t, uint16_t>> cases)
+{
+  constexpr uint16_t cb = sizeof(uint16_t);
+  constexpr uint16_t table = 8;
+  const auto first_case = (uint16_t)(table + 3 + 2 * cases.size());
+  std::vector<uint16_t> code{
+    30, // PROC
+    9, value, // CONST_PRI
+    70, (uint16_t)((table - 3) * cb), // SWITCH
+    9, 100, // CONST_PRI
+    32, // RETN
+    74, (uint16_t)cases.size(), (uint16_t)((5 - (table + 1)) * cb) // CASETBL
+  };
+  uint16_t target = first_case;
+  for (const auto& c : cases)
+  {
+    code.push_back(c.first);
+    code.push_back((uint16_t)((target - (code.size() - 1)) * cb));
+    target += 3;
+  }
+  for (const auto& c : cases)
+    code.insert(code.end(), { 9, c.second, 32 });
+  return code;
+}
+
+TEST_P(AssembledTest, SparseSwitch) {
+  const std::initializer_list<std::pair<uint16_t, uint16_t>> cases{ { 50, 1 }, { (uint16_t)-7, 2 }, { 50, 3 }, { 1000, 4 } };
+  for (const auto& expected : std::initializer_list<std::pair<uint16_t, uint16_t>>{
+    { 50, 1 }, { (uint16_t)-7, 2 }, { 1000, 4 }, { 51, 100 }, { 0, 100 }, { (uint16_t)-1, 100 }
+  })
+  {
+    EXPECT_EQ(run(switch_code(expected.first, cases)), amx::error::success);
+    EXPECT_EQ(_retval, expected.second);
+  }
+}
+
+TEST_P(AssembledTest, DenseSwitch) {
+  const std::initializer_list<std::pair<uint16_t, uint16_t>> cases{ { 5, 1 }, { 3, 2 }, { 4, 3 } };
+  for (const auto& expected : std::initializer_list<std::pair<uint16_t, uint16_t>>{
+    { 3, 2 }, { 4, 3 }, { 5, 1 }, { 6, 100 }, { 2, 100 }, { 0, 100 }
+  })
+  {
+    EXPECT_EQ(run(switch_code(expected.first, cases)), amx::error::success);
+    EXPECT_EQ(_retval, expected.second);
+  }
+}
+
+TEST_P(AssembledTest, Verify) {
+  const auto verify = [](const std::vector<cell>& code, cell& cip)
+  {
+    std::vector<uint8_t> starts(code.size());
+    return small_pages_amx::verify(code.data(), code.size(), 1, starts.data(), cip);
+  };
+  cell cip{};
+  EXPECT_EQ(verify({ HALT, 0, PROC, CONST_PRI, 7, RETN }, cip), amx::error::success);
+  auto with_table = switch_code(4, { { 4, 1 }, { 5, 2 } });
+  with_table.insert(with_table.begin(), { HALT, 0 });
+  EXPECT_EQ(verify(with_table, cip), amx::error::success);
+
+  EXPECT_EQ(verify({ HALT, 0, PROC, 200 }, cip), amx::error::invalid_instruction);
+  EXPECT_EQ(cip, 3 * sizeof(cell));
+  EXPECT_EQ(verify({ HALT, 0, PROC, CONST_PRI }, cip), amx::error::access_violation_code);
+  EXPECT_EQ(cip, 3 * sizeof(cell));
+  EXPECT_EQ(verify({ HALT, 0, SYSREQ, 1 }, cip), amx::error::invalid_operand);
+  // into the operand of the CONST_PRI
+  EXPECT_EQ(verify({ HALT, 0, CONST_PRI, 7, JUMP, (cell)-(cell)sizeof(cell) }, cip), amx::error::invalid_operand);
+  EXPECT_EQ(cip, 4 * sizeof(cell));
+  EXPECT_EQ(verify({ HALT, 0, SWITCH, 2 * sizeof(cell), RETN }, cip), amx::error::invalid_operand);
+  // the default of the table, two cells after the CASETBL, points past the end
+  with_table[2 + 8 + 2] = 100 * sizeof(cell);
+  EXPECT_EQ(verify(with_table, cip), amx::error::invalid_operand);
+}
+
+TEST_P(AssembledTest, VerifiedReturnIntoOperandFaults) {
+  // returns to the operand of the CONST_PRI, which an unverified amx would run as an instruction
+  load({ CONST_PRI, 3 * sizeof(cell), PUSH_PRI, PUSH_PRI, RET });
+  std::vector<uint8_t> starts(_code.size());
+  cell cip{};
+  ASSERT_EQ(small_pages_amx::verify(_code.data(), _code.size(), 0, starts.data(), cip), amx::error::success);
+  _amx.attach_verified(_code.data(), starts.data(), _code.size());
+  if (GetParam())
+  {
+    small_pages_amx::decode(_code.data(), _code.size(), _decoded.data(), true, starts.data());
+    _amx.attach_decoded(_decoded.data(), _code.size());
+  }
+  EXPECT_EQ(_amx.call(2 * sizeof(cell), _retval), amx::error::access_violation_code);
+  EXPECT_EQ(_amx.CIP, 3 * sizeof(cell));
+  _amx.detach_verified();
+  unload();
+}
+
+TEST_P(AssembledTest, VerifiedCaseTableOutOfCodeFaults) {
+  // the decoded stream keeps the table it was decoded with, so only the stepping engine reads it again
+  if (GetParam())
+    GTEST_SKIP();
+  load(switch_code(99, { { 4, 1 }, { 5, 2 } }));
+  std::vector<uint8_t> starts(_code.size());
+  cell cip{};
+  ASSERT_EQ(small_pages_amx::verify(_code.data(), _code.size(), 0, starts.data(), cip), amx::error::success);
+  _amx.attach_verified(_code.data(), starts.data(), _code.size());
+  // the record count of the CASETBL, as a store through data would change it under von Neumann
+  _code[2 + 8 + 1] = 1000;
+  EXPECT_EQ(_amx.call(2 * sizeof(cell), _retval), amx::error::invalid_operand);
+  _amx.detach_verified();
+  unload();
+}
+
+TEST_P(AssembledTest, NestedYieldKeepsOuterBudget) {
+  struct nested_state
+  {
+    amx::error result;
+    int64_t before;
+    int64_t after;
+  } state{};
+  // calls the endless loop at cell 14 with a budget of one, which has to yield
+  const small_pages_amx::native_binding natives[]{ { [](small_pages_amx* amx, void* user, cell, cell*, cell& retval)
+  {
+    const auto state = (nested_state*)user;
+    cell inner{};
+    state->before = amx->get_budget();
+    state->result = amx->call(14 * sizeof(cell), inner, {}, 1);
+    state->after = amx->get_budget();
+    retval = 41;
+    return amx::error::success;
+  }, &state } };
+  _amx.attach_natives(natives, std::size(natives));
+  // the outer function returns the native's result plus one
+  EXPECT_EQ(run({
+    PROC, CONST_PRI, 0, PUSH_PRI, SYSREQ, 0, STACK, sizeof(cell), CONST_ALT, 1, ADD, RETN,
+    PROC, JUMP, (cell)-(cell)sizeof(cell)
+  }), amx::error::success);
+  _amx.detach_natives();
+  EXPECT_EQ(_retval, 42);
+  EXPECT_EQ(state.result, amx::error::yield);
+  EXPECT_EQ(state.after, state.before);
+}
+
+#define TEST_FUSED_MATCHES_UNFUSED(fixture) \
+  TEST_F(fixture, FusedMatchesUnfused) {\
+    const auto file = readall(("test" + std::to_string(my_amx::cell_bits) + ".amx").c_str());\
+    my_amx_loader unfused;\
+    unfused.init(file.data(), file.size(), CALLBACKS, { true, false, false, true });\
+    for (const auto name : { "test_Arithmetic", "test_Array", "test_GotoStackFixup", "test_Switch", "test_VarArgs" })\
+    {\
+      my_amx::cell retval{}, unfused_retval{};\
+      EXPECT_EQ(_ldr.amx.call(_ldr.get_public(name), retval, {}, 1000000),\
+        unfused.amx.call(unfused.get_public(name), unfused_retval, {}, 1000000));\
+      EXPECT_EQ(retval, unfused_retval);\
+      EXPECT_EQ(_ldr.amx.get_budget(), unfused.amx.get_budget());\
+      EXPECT_EQ(_ldr.amx.STK, unfused.amx.STK);\
+      EXPECT_EQ(_ldr.amx.FRM, unfused.amx.FRM);\
+    }\
+  }\
+
+TEST_FUSED_MATCHES_UNFUSED(Amx32DecodedTest);
+TEST_FUSED_MATCHES_UNFUSED(Amx64DecodedTest);
+
+#define TEST_JIT_MATCHES_STEP(fixture) \
+  TEST_F(fixture, JitMatchesStep) {\
+    EXPECT_EQ(_jit.valid(), amx::jit<my_amx>::supported);\
+    const auto file = readall(("test" + std::to_string(my_amx::cell_bits) + ".amx").c_str());\
+    my_amx_loader stepped;\
+    stepped.init(file.data(), file.size(), CALLBACKS);\
+    for (const auto name : { "test_Arithmetic", "test_Array", "test_ArrayOverindex", "test_Div", "test_DivZero",\
+      "test_GotoStackFixup", "test_Switch", "test_VarArgs", "test_Bounds" })\
+    {\
+      my_amx::cell retval{}, stepped_retval{};\
+      EXPECT_EQ(_ldr.amx.call(_ldr.get_public(name), retval, {}, 1000000),\
+        stepped.amx.call(stepped.get_public(name), stepped_retval, {}, 1000000));\
+      EXPECT_EQ(retval, stepped_retval);\
+      EXPECT_EQ(_ldr.amx.get_budget(), stepped.amx.get_budget());\
+      EXPECT_EQ(_ldr.amx.CIP, stepped.amx.CIP);\
+      EXPECT_EQ(_ldr.amx.STK, stepped.amx.STK);\
+      EXPECT_EQ(_ldr.amx.FRM, stepped.amx.FRM);\
+      EXPECT_EQ(_ldr.amx.HEA, stepped.amx.HEA);\
+    }\
+  }\
+
+TEST_JIT_MATCHES_STEP(Amx32JitTest);
+TEST_JIT_MATCHES_STEP(Amx64JitTest);
+
+#define TEST_GUARDED_FAULT(fixture) \
+  TEST_F(fixture, FaultIsAccessViolation) {\
+    for (int i = 0; i < 2; ++i)\
+    {\
+      _ldr.reset();\
+      _ldr.amx.STK = (my_amx::cell)0x10000000; /* far past the mapped data */\
+      my_amx::cell retval{};\
+      EXPECT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::access_violation);\
+      EXPECT_TRUE(_ldr.amx.has_faulted());\
+    }\
+    /* the fault skipped restoring state, so nothing runs until a reset */\
+    my_amx::cell retval{};\
+    EXPECT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::access_violation);\
+    _ldr.reset();\
+    EXPECT_FALSE(_ldr.amx.has_faulted());\
+    EXPECT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::success);\
+    EXPECT_EQ(retval, 1);\
+    /* wide cells have bits above the reservation, which must not wrap around into it */\
+    _ldr.amx.STK = (my_amx::cell)((my_amx::cell)1 << (my_amx::cell_bits - 1));\
+    EXPECT_EQ(_ldr.amx.call(_ldr.get_public("test_Arithmetic"), retval), amx::error::access_violation);\
+  }\
+
+TEST_GUARDED_FAULT(Amx32GuardedTest);
+TEST_GUARDED_FAULT(Amx64GuardedTest);
+TEST_GUARDED_FAULT(Amx32GuardedJitTest);
+TEST_GUARDED_FAULT(Amx64GuardedJitTest);
+
+TEST(GuardedReservation, WideCellsDontWrapAround)
+{
+  amx::detail::memory_backing_guarded_reservation<uint64_t, 32> reservation;
+  uint64_t va{};
+  ASSERT_TRUE(reservation.map(4, va));
+  EXPECT_EQ(reservation.translate(8), reservation.storage() + 1);
+  EXPECT_EQ(reservation.translate(((uint64_t)1 << 32) + 8), nullptr);
+  size_t cells{};
+  EXPECT_EQ(reservation.translate_span((uint64_t)1 << 63, cells), nullptr);
+}
+
+// 16 byte pages, 8 cells each
+using small_pages = amx::detail::memory_backing_paged_buffers<uint16_t, 12>;
+
+TEST(PagedBuffers, RunsAreFirstFitAndDontOverlap)
+{
+  small_pages pages;
+  uint16_t a[20]{}, b[10]{}, c[8]{};
+  uint16_t va_a{}, va_b{}, va_c{};
+  ASSERT_TRUE(pages.map(a, std::size(a), va_a));
+  ASSERT_TRUE(pages.map(b, std::size(b), va_b));
+  EXPECT_EQ(va_b, va_a + 3 * 16);
+  EXPECT_EQ(pages.translate(va_a + 19 * 2), &a[19]);
+  EXPECT_EQ(pages.translate(va_b), &b[0]);
+  EXPECT_EQ(pages.translate(va_b + 9 * 2), &b[9]);
+  EXPECT_EQ(pages.translate(va_b + 10 * 2), nullptr);
+
+  pages.unmap(va_a, std::size(a));
+  EXPECT_EQ(pages.translate(va_a), nullptr);
+  ASSERT_TRUE(pages.map(c, std::size(c), va_c));
+  EXPECT_EQ(va_c, va_a);
+  EXPECT_EQ(pages.translate(va_b), &b[0]);
+}
+
+TEST(PagedBuffers, ScratchWindow)
+{
+  small_pages pages;
+  uint16_t data[8]{}, x[8]{}, y[12]{};
+  uint16_t va_data{}, va_x{}, va_y{}, va{};
+  EXPECT_FALSE(pages.map_scratch(x, std::size(x), va_x));
+  ASSERT_TRUE(pages.reserve_scratch(3));
+  ASSERT_TRUE(pages.map(data, std::size(data), va_data));
+
+  ASSERT_TRUE(pages.map_scratch(x, std::size(x), va_x));
+  ASSERT_TRUE(pages.map_scratch(y, std::size(y), va_y));
+  EXPECT_NE(va_x, va_data);
+  EXPECT_EQ(va_y, va_x + 16);
+  EXPECT_EQ(pages.translate(va_x), &x[0]);
+  EXPECT_EQ(pages.translate(va_y + 11 * 2), &y[11]);
+  EXPECT_FALSE(pages.map_scratch(x, 1, va));
+
+  pages.unmap(va_y, std::size(y));
+  pages.unmap_scratch(va_x, std::size(x));
+  EXPECT_EQ(pages.translate(va_x), nullptr);
+  ASSERT_TRUE(pages.map_scratch(y, std::size(y), va));
+  EXPECT_EQ(va, va_x);
+  EXPECT_EQ(pages.translate(va_data), &data[0]);
+}
+
+TEST(NativeArgs, SpansAndStrings)
+{
+  using small_pages_native_args = amx::native_args<small_pages_amx>;
+  small_pages_amx amx;
+  // "hi" packed at 0, "abc" unpacked at 4 cells, a reference target over two pages from 8 cells
+  uint16_t data[24]{ 0x6869, 0,   0, 0,   'a', 'b', 'c', 0 };
+  std::vector<uint16_t> other(8);
+  uint16_t va{}, other_va{};
+  ASSERT_TRUE(amx.mem.data().map(data, std::size(data), va));
+  ASSERT_TRUE(amx.mem.data().map(other.data(), other.size(), other_va));
+  ASSERT_EQ(other_va, va + sizeof(data));
+  amx.DAT = va;
+
+  uint16_t argv_cells[4]{ 0, 4 * 2, 8 * 2, 20 * 2 };
+  std::copy(std::begin(argv_cells), std::end(argv_cells), data + 16);
+  const small_pages_native_args args{ amx, 4, 16 * 2 };
+  ASSERT_TRUE(args);
+  EXPECT_EQ(args.size(), 4u);
+  EXPECT_EQ(args.data(), data + 16);
+  EXPECT_EQ(args[2], 8 * 2);
+  EXPECT_EQ(args[4], 0);
+
+  const auto hi = args.string(0);
+  ASSERT_TRUE(hi);
+  EXPECT_TRUE(hi.packed);
+  EXPECT_EQ(hi.length, 2u);
+  EXPECT_EQ(hi[0], 'h');
+  EXPECT_EQ(hi[1], 'i');
+
+  const auto abc = args.string(1);
+  ASSERT_TRUE(abc);
+  EXPECT_FALSE(abc.packed);
+  EXPECT_EQ(abc.length, 3u);
+  EXPECT_EQ(abc[2], 'c');
+
+  EXPECT_EQ(args.ref(2, 16), data + 8);
+  // runs into the separately mapped buffer, which isn't contiguous with it in host memory
+  EXPECT_EQ(args.ref(3, 8), nullptr);
+  EXPECT_EQ(args.ref(4), nullptr);
+
+  EXPECT_FALSE((small_pages_native_args{ amx, 4, 30 * 2 }));
+}
+
+TEST(NativeArgs, StringHelpers)
+{
+  using args32 = amx::native_args<amx::amx<uint32_t, amx::memory_manager_neumann<amx::memory_backing_paged_buffers<5>>>>;
+  using args16 = amx::native_args<small_pages_amx>;
+  const std::string hello = "h\xC3\xA9llo \xE2\x82\xAC";
+  uint32_t buf[8]{};
+
+  EXPECT_EQ(args32::store_string(hello, buf, std::size(buf), true), hello.size());
+  EXPECT_EQ(buf[0], 0x68C3A96Cu);
+  const args32::string_arg packed{ buf, hello.size(), true };
+  EXPECT_EQ(packed.utf8(), hello);
+
+  uint32_t wide[8]{};
+  EXPECT_EQ(args32::store_string(hello, wide, std::size(wide), false), 7u);
+  EXPECT_EQ(wide[1], 0xE9u);
+  EXPECT_EQ(wide[6], 0x20ACu);
+  EXPECT_EQ(wide[7], 0u);
+  const args32::string_arg unpacked{ wide, 7, false };
+  EXPECT_EQ(unpacked.utf8(), hello);
+  EXPECT_EQ(packed.compare(packed), 0);
+
+  // truncated to whole characters, with the terminator
+  uint32_t small[2]{ 0xCCCCCCCC, 0xCCCCCCCC };
+  EXPECT_EQ(args32::store_string("abcdef\xC3\xA9", small, std::size(small), true), 6u);
+  EXPECT_EQ(small[1], 0x65660000u);
+  EXPECT_EQ(args32::copy_string(packed, small, std::size(small), true), 7u);
+  EXPECT_EQ(small[1], 0x6C6F2000u);
+  EXPECT_EQ(args32::copy_string(packed, wide, 3, false), 2u);
+  EXPECT_EQ(wide[1], 0xC3u);
+  EXPECT_EQ(wide[2], 0u);
+
+  const args32::string_arg shorter{ small, 7, true };
+  EXPECT_LT(shorter.compare(packed), 0);
+  EXPECT_GT(packed.compare(shorter), 0);
+  uint32_t other[2]{};
+  args32::store_string("h\xC3\xA9llo!", other, std::size(other), true);
+  EXPECT_LT(shorter.compare({ other, 7, true }), 0);
+
+  // unpacked characters of 16 bit cells stop at 0xFF, invalid sequences become U+FFFD
+  uint16_t narrow[4]{};
+  EXPECT_EQ(args16::store_string("\xC3\xA9\xE2\x82\xAC\xFF", narrow, std::size(narrow), false), 3u);
+  EXPECT_EQ(narrow[0], 0xE9u);
+  EXPECT_EQ(narrow[1], '?');
+  EXPECT_EQ(narrow[2], '?');
+  EXPECT_EQ(args32::store_string("\xFF\xC0\x80", wide, 4, false), 3u);
+  EXPECT_EQ(wide[0], 0xFFFDu);
+  EXPECT_EQ(wide[1], 0xFFFDu);
+}
@@ -8,8 +8,25 @@
 #include <type_traits>
 #include <cstddef>
 #include <initializer_list>
+#include <cstring>
+#include <atomic>
+#include <chrono>
 #define AMX_ASSERT(cond) assert(cond)
 
+// Computed goto is used for dispatching the pre-decoded code stream where available, falls back to a switch otherwise.
+#if !defined(AMX_COMPUTED_GOTO)
+#if defined(__GNUC__) || defined(__clang__)
+#define AMX_COMPUTED_GOTO 1
+#else
+#define AMX_COMPUTED_GOTO 0
+#endif
+#endif
+
+// Profiling hooks in the interpreters, see amx_profile.h. Off by default, since counting each instruction isn't free.
+#if !defined(AMX_PROFILE)
+#define AMX_PROFILE 0
+#endif
+
 namespace amx
 {
   enum class error
@@ -22,9 +39,15 @@ namespace amx
     division_with_zero,
     halt,
     bounds,
-    callback_abort
+    callback_abort,
+    yield,
+    sleep,
+    stack_heap_collision
   };
 
+  // Whether a call that returned this error can be continued with resume() or resume_with().
+  constexpr bool is_resumable(error e) { return e == error::yield || e == error::sleep; }
+
   namespace detail
   {
     template <typename A, typename B>
@@ -98,6 +121,15 @@ namespace amx
 
     };
 
+    template <typename Cell>
+    struct decoded_instruction
+    {
+      // label address with computed goto, handler index otherwise
+      uintptr_t handler;
+      // operand with jump targets already resolved to instruction indices
+      Cell operand;
+    };
+
     template <typename Cell, size_t IndexBits>
     class memory_backing_paged_buffers
     {
@@ -141,6 +173,21 @@ namespace amx
         return m->buf + off / cell_bytes;
       }
 
+      // like translate, and also stores how many cells from va on are contiguous in host memory. Stays within a page
+      cell* translate_span(cell va, size_t& cells) const
+      {
+        cells = 0;
+        const auto p = translate(va);
+        if (p)
+        {
+          const auto off = page_offset(va);
+          const auto in_page = (size_t)(page_size - off);
+          const auto in_mapping = mapping_for_va(va)->size - off;
+          cells = (in_page < in_mapping ? in_page : in_mapping) / cell_bytes;
+        }
+        return p;
+      }
+
       bool map(cell* buf, size_t size, cell& va)
       {
         if (size == 0)
@@ -152,46 +199,160 @@ namespace amx
         if ((longer)size > (longer)~(cell)0)
           return false; // mapping bigger than address space
 
-        size *= cell_bytes;
-        const auto count = page_index((cell)(size + page_size - 1));
-        cell in_a_row = 0;
-        cell index = 0;
-        do
-        {
-          if (_mappings[index].buf)
-            in_a_row = 0;
-          else
-            ++in_a_row;
+        const auto count = pages_for(size);
+        size_t first{};
+        if (!find_free(count, first))
+          return false;
 
-          if (in_a_row == count)
-            goto found;
+        set_used(first, count, true);
+        set_mappings(first, count, buf, size);
+        va = make_va((cell)first, 0);
+        return true;
+      }
 
-          ++index;
-        } while (index != 0 && index != page_count);
+      void unmap(cell va, size_t size)
+      {
+        const auto count = pages_for(size);
+        if (count == 0)
+          return;
+        const auto first = (size_t)page_index(va);
+        if (first >= _scratch_first && first < _scratch_first + _scratch_pages)
+          return unmap_scratch(va, size);
+        set_mappings(first, count, nullptr, 0);
+        set_used(first, count, false);
+      }
 
-        return false;
+      // Reserves `pages` pages once for short lived mappings, which map_scratch() then places in constant time. Meant
+      // for host buffers passed by reference to a script for the duration of a native call.
+      bool reserve_scratch(size_t pages)
+      {
+        size_t first{};
+        if (_scratch_pages || pages == 0 || !find_free(pages, first))
+          return false;
+        set_used(first, pages, true);
+        _scratch_first = first;
+        _scratch_pages = pages;
+        _scratch_top = 0;
+        return true;
+      }
 
-      found:
-        for (cell i = 0; i < count; ++i)
+      // Maps `buf` into the scratch window above the scratch mappings already there. They have to be unmapped in reverse
+      // order, which nested native calls do naturally. Fails if the window is full or was never reserved.
+      bool map_scratch(cell* buf, size_t size, cell& va)
+      {
+        if (size == 0)
         {
-          _mappings[index + i].buf = buf + page_size / (cell)cell_bytes * i;
-          _mappings[index + i].size = size - (size_t)(page_size * i);
+          va = ~(cell)misalign_mask;
+          return true;
         }
 
-        va = make_va(index, 0);
+        if ((longer)size > (longer)~(cell)0)
+          return false;
+
+        const auto count = pages_for(size);
+        if (count > _scratch_pages - _scratch_top)
+          return false;
+
+        const auto first = _scratch_first + _scratch_top;
+        set_mappings(first, count, buf, size);
+        _scratch_top += count;
+        va = make_va((cell)first, 0);
         return true;
       }
 
-      void unmap(cell va, size_t size)
+      // unmap() does this too for addresses in the scratch window
+      void unmap_scratch(cell va, size_t size)
+      {
+        const auto count = pages_for(size);
+        if (count == 0)
+          return;
+        const auto first = (size_t)page_index(va);
+        AMX_ASSERT(first + count == _scratch_first + _scratch_top);
+        set_mappings(first, count, nullptr, 0);
+        _scratch_top -= count;
+      }
+
+    private:
+      constexpr static size_t page_total = (size_t)1 << index_bits;
+      constexpr static size_t word_bits = 64;
+
+      // a set bit for each page that is mapped or in the scratch window
+      uint64_t _used[(page_total + word_bits - 1) / word_bits]{};
+      // every page below this one is in use
+      size_t _first_free{};
+
+      size_t _scratch_first{};
+      size_t _scratch_pages{};
+      size_t _scratch_top{};
+
+      static size_t pages_for(size_t cells)
+      {
+        const auto bytes = (ulonger)cells * cell_bytes;
+        return (size_t)((bytes + page_size - 1) / page_size);
+      }
+
+      bool is_used(size_t page) const { return (_used[page / word_bits] >> (page % word_bits)) & 1; }
+
+      void set_used(size_t first, size_t count, bool used)
+      {
+        for (auto page = first; page < first + count; ++page)
+        {
+          const auto bit = (uint64_t)1 << (page % word_bits);
+          if (used)
+            _used[page / word_bits] |= bit;
+          else
+            _used[page / word_bits] &= ~bit;
+        }
+
+        if (!used && first < _first_free)
+          _first_free = first;
+        else if (used && first == _first_free)
+          find_free(1, _first_free);
+      }
+
+      void set_mappings(size_t first, size_t count, cell* buf, size_t size)
       {
-        const auto m = mapping_for_va(va);
         size *= cell_bytes;
-        const auto count = page_index((cell)(size + page_size - 1));
-        for (cell i = 0; i < count; ++i)
+        for (size_t i = 0; i < count; ++i)
+        {
+          _mappings[first + i].buf = buf ? buf + page_size / (cell)cell_bytes * i : nullptr;
+          _mappings[first + i].size = buf ? size - (size_t)(page_size * i) : 0;
+        }
+      }
+
+      // first run of `count` free pages, skipping whole words of the bitmap where possible
+      bool find_free(size_t count, size_t& first) const
+      {
+        size_t run = 0;
+        for (auto page = _first_free; page < page_total;)
         {
-          m[i].buf = nullptr;
-          m[i].size = 0;
+          const auto word = _used[page / word_bits];
+          const auto rest = page_total - page < word_bits ? page_total - page : word_bits;
+          if (page % word_bits == 0 && word == ~(uint64_t)0)
+          {
+            run = 0;
+            page += rest;
+            continue;
+          }
+          if (page % word_bits == 0 && word == 0)
+          {
+            run += rest;
+            page += rest;
+          }
+          else
+          {
+            run = is_used(page) ? 0 : run + 1;
+            ++page;
+          }
+          if (run >= count)
+          {
+            first = page - run;
+            return true;
+          }
         }
+        if (count == 1)
+          first = page_total;
+        return false;
       }
     };
 
@@ -211,6 +372,19 @@ namespace amx
         return _buf + (va / cell_bytes);
       }
 
+      cell* translate_span(cell va, size_t& cells)
+      {
+        cells = 0;
+        const auto p = translate(va);
+        if (p)
+          cells = (size_t)((_size - va + cell_bytes - 1) / cell_bytes);
+        return p;
+      }
+
+      cell* buffer() const { return _buf; }
+      // in bytes
+      size_t size() const { return _size; }
+
       bool map(cell* buf, size_t size, cell& va)
       {
         if (_buf)
@@ -237,7 +411,7 @@ namespace amx
 
       constexpr static size_t valid_bits = ValidBits;
       constexpr static size_t invalid_bits = cell_bits - valid_bits;
-      constexpr static cell offset_mask = (((~(cell)0) << invalid_bits) >> invalid_bits);
+      constexpr static cell offset_mask = ((cell)((cell)~(cell)0 << invalid_bits) >> invalid_bits);
       constexpr static cell offset_mask_align = offset_mask & ~(cell)misalign_mask;
 
       uintptr_t _backing_bits{};
@@ -254,6 +428,16 @@ namespace amx
         return (cell*)((va & offset_mask_align) | _backing_bits);
       }
 
+      constexpr static cell address_mask() { return offset_mask_align; }
+      uintptr_t backing_bits() const { return _backing_bits; }
+
+      // contiguous up to where the offset wraps around
+      cell* translate_span(cell va, size_t& cells)
+      {
+        cells = (size_t)((offset_mask_align - (va & offset_mask_align)) / cell_bytes) + 1;
+        return translate(va);
+      }
+
       bool map(cell* buf, size_t size, cell& va)
       {
         va = 0;
@@ -264,7 +448,7 @@ namespace amx
         AMX_ASSERT(((uintptr_t)buf & offset_mask) == 0);
         AMX_ASSERT(size * cell_bytes > offset_mask);
 
-        _backing_bits = (uintptr_t)buf & offset_mask_align;
+        _backing_bits = (uintptr_t)buf & ~(uintptr_t)offset_mask;
         return true;
       }
 
@@ -275,6 +459,30 @@ namespace amx
       }
     };
 
+    // Backings that catch out of range accesses in hardware, rather than translate() returning nullptr, run the VM
+    // through their guarded_run().
+    template <typename Backing, typename = void>
+    struct has_guarded_run : std::false_type {};
+
+    template <typename Backing>
+    struct has_guarded_run<Backing, std::void_t<decltype(&Backing::guarded_run)>> : std::true_type {};
+
+    // Backings that allocate the mapped memory themselves, with map(size, va) and storage() instead of a caller buffer.
+    template <typename Backing, typename = void>
+    struct owns_storage : std::false_type {};
+
+    template <typename Backing>
+    struct owns_storage<Backing, std::void_t<decltype(Backing::owns_storage)>> : std::bool_constant<Backing::owns_storage> {};
+
+    // Memory managers whose code and data are one backing, so scripts can write the mapped code through data
+    // addresses. Managers that don't say are taken to share it.
+    template <typename MemoryManager, typename = void>
+    struct shares_backing : std::true_type {};
+
+    template <typename MemoryManager>
+    struct shares_backing<MemoryManager, std::void_t<decltype(MemoryManager::shares_backing)>>
+      : std::bool_constant<MemoryManager::shares_backing> {};
+
     template <typename CodeBacking, typename DataBacking>
     class memory_manager_harvard
     {
@@ -282,6 +490,8 @@ namespace amx
       DataBacking _data;
 
     public:
+      constexpr static bool shares_backing = false;
+
       CodeBacking& code() { return _code; }
       DataBacking& data() { return _data; }
     };
@@ -292,6 +502,8 @@ namespace amx
       Backing _backing;
 
     public:
+      constexpr static bool shares_backing = true;
+
       Backing& code() { return _backing; }
       Backing& data() { return _backing; }
     };
@@ -334,6 +546,9 @@ namespace amx
     using type = detail::memory_manager_neumann<typename Backing::template type<Cell>>;
   };
 
+  template <typename Amx>
+  class jit;
+
   template <typename Cell, typename MemoryManager>
   class amx
   {
@@ -348,157 +563,134 @@ namespace amx
 
     cell* data_v2p(cell v) { return mem.data().translate(DAT + v); }
     cell* code_v2p(cell v) { return mem.code().translate(COD + v); }
+    // also stores how many cells from v on are contiguous in host memory
+    cell* data_v2p_span(cell v, size_t& cells) { return mem.data().translate_span(DAT + v, cells); }
 
-  //private:
-    // primary register (ALU, general purpose).
-    cell PRI{};
-    // alternate register (general purpose).
-    cell ALT{};
-    // stack frame pointer; stack-relative memory reads & writes are relative to the address in this register.
-    cell FRM{};
-    // code instruction pointer.
-    cell CIP{};
-    // offset to the start of the data. (data segment base)
-    cell DAT{};
-    // offset to the start of the code. (code segment base)
-    cell COD{};
-    // stack top.
-    cell STP{};
-    // stack index, indicates the current position in the stack. The stack runs downwards from the STP register towards zero.
-    cell STK{};
-    // heap pointer. Dynamically allocated memory comes from the heapand the HEA register indicates the top of the heap.
-    cell HEA{};
-
-  private:
-    error step();
-
-  public:
-    using callback_t = error(*)(amx* _this, void* user_data, cell index, cell stk, cell& pri);
-    enum : cell
-    {
-      cbid_single_step = (cell)(scell)-1,
-      cbid_break = (cell)(scell)-2
-    };
-
-  private:
-    callback_t _callback{};
-    void* _callback_user_data{};
-
-    error fire_callback(cell index)
-    {
-      // callback shouldnt modify these after return
-      const auto alt = ALT;
-      const auto frm = FRM;
-      const auto cip = CIP;
-      const auto stp = STP;
-      const auto stk = STK;
-      const auto result = _callback(this, _callback_user_data, index, STK, PRI);
-      ALT = alt;
-      FRM = frm;
-      CIP = cip;
-      STP = stp;
-      STK = stk;
-      return result;
-    }
-
-  public:
-    error push(cell v)
+    // Bulk forms of MOVS, CMPS and FILL over data addresses. They work on whole translated spans, but fault at the same
+    // cell and leave memory in the same state as going cell by cell would.
+    error data_move(cell dst, cell src, cell bytes)
     {
-      STK -= cell_bytes;
-      const auto target = data_v2p(STK);
-      if (!target)
-        return error::access_violation;
-      *target = v;
+      const auto total = (size_t)(bytes / cell_bytes) + (bytes % cell_bytes != 0);
+      for (size_t i = 0; i < total;)
+      {
+        size_t src_cells{}, dst_cells{};
+        const auto ps = data_v2p_span(src + (cell)(i * cell_bytes), src_cells);
+        if (!ps)
+          return error::access_violation;
+        const auto pd = data_v2p_span(dst + (cell)(i * cell_bytes), dst_cells);
+        if (!pd)
+          return error::access_violation;
+        auto n = total - i;
+        n = n < src_cells ? n : src_cells;
+        n = n < dst_cells ? n : dst_cells;
+        if (pd <= ps || pd >= ps + n)
+          memmove(pd, ps, n * sizeof(cell));
+        else
+          for (size_t k = 0; k < n; ++k) // overlaps the way a forward copy does
+            pd[k] = ps[k];
+        i += n;
+      }
       return error::success;
     }
 
-    error pop(cell& v)
+    // `result` is [a] - [b] at the first cell that differs, or 0 if none do
+    error data_compare(cell a, cell b, cell bytes, cell& result)
     {
-      const auto target = data_v2p(STK);
-      if (!target)
-        return error::access_violation;
-      v = *target;
-      STK += cell_bytes;
+      result = 0;
+      const auto total = (size_t)(bytes / cell_bytes) + (bytes % cell_bytes != 0);
+      for (size_t i = 0; i < total;)
+      {
+        size_t b_cells{}, a_cells{};
+        const auto pb = data_v2p_span(b + (cell)(i * cell_bytes), b_cells);
+        if (!pb)
+          return error::access_violation;
+        const auto pa = data_v2p_span(a + (cell)(i * cell_bytes), a_cells);
+        if (!pa)
+          return error::access_violation;
+        auto n = total - i;
+        n = n < b_cells ? n : b_cells;
+        n = n < a_cells ? n : a_cells;
+        if (memcmp(pa, pb, n * sizeof(cell)) != 0)
+          for (size_t k = 0; k < n; ++k)
+            if (pa[k] != pb[k])
+            {
+              result = pa[k] - pb[k];
+              return error::success;
+            }
+        i += n;
+      }
       return error::success;
     }
 
-    void pop()
-    {
-      STK += cell_bytes;
-    }
-
-  private:
-    error call_raw(cell cip, cell& pri)
+    error data_fill(cell dst, cell value, cell bytes)
     {
-      // As of version 2.0, the PAWN compiler puts a HALT opcode at the start of the code (so at code address 0). Before
-      // jumping to the entry point (a function), the abstract machine pushes a zero return address onto the stack. When
-      // the entry point returns, it returns to the zero address and sees the HALT instruction.
-      constexpr auto invalid_cip = (cell)0;
-      auto result = push(invalid_cip);
-      CIP = cip;
-      while (result == error::success && CIP != invalid_cip)
+      const auto total = (size_t)(bytes / cell_bytes) + (bytes % cell_bytes != 0);
+      for (size_t i = 0; i < total;)
       {
-        result = fire_callback(cbid_single_step);
-        if (result != error::success)
-          break;
-        result = step();
+        size_t dst_cells{};
+        const auto pd = data_v2p_span(dst + (cell)(i * cell_bytes), dst_cells);
+        if (!pd)
+          return error::access_violation;
+        const auto n = total - i < dst_cells ? total - i : dst_cells;
+        for (size_t k = 0; k < n; ++k)
+          pd[k] = value;
+        i += n;
       }
-      pri = PRI;
-      return result;
+      return error::success;
     }
 
-  public:
-    error call(cell cip, cell& pri, std::initializer_list<cell> args = {})
+    // Copies `cells` cells between host memory and data address `va`, a translated span at a time.
+    error data_write(cell va, const cell* src, size_t cells)
     {
-      cell size{};
-      for (auto it = std::crbegin(args); it != std::crend(args); ++it)
+      for (size_t i = 0; i < cells;)
       {
-        const auto arg = *it;
-        const auto result = push(arg);
-        if (result != error::success)
-          return result;
-        size += cell_bytes;
+        size_t dst_cells{};
+        const auto pd = data_v2p_span(va + (cell)(i * cell_bytes), dst_cells);
+        if (!pd)
+          return error::access_violation;
+        const auto n = cells - i < dst_cells ? cells - i : dst_cells;
+        memcpy(pd, src + i, n * sizeof(cell));
+        i += n;
       }
-
-      const auto result = push(size);
-      if (result != error::success)
-        return result;
-
-      return call_raw(cip, pri);
+      return error::success;
     }
 
-    amx(
-      callback_t callback,
-      void* callback_user
-    )
-      : _callback(callback)
-      , _callback_user_data(callback_user)
-    {}
-
-    constexpr amx() = default;
-
-    void init(
-      callback_t callback,
-      void* callback_user
-    )
+    error data_read(cell va, cell* dst, size_t cells)
     {
-      _callback = callback;
-      _callback_user_data = callback_user;
+      for (size_t i = 0; i < cells;)
+      {
+        size_t src_cells{};
+        const auto ps = data_v2p_span(va + (cell)(i * cell_bytes), src_cells);
+        if (!ps)
+          return error::access_violation;
+        const auto n = cells - i < src_cells ? cells - i : src_cells;
+        memcpy(dst + i, ps, n * sizeof(cell));
+        i += n;
+      }
+      return error::success;
     }
 
-    ~amx() = default;
-
-    amx(const amx&) = delete;
-    amx(amx&&) = delete;
-
-    amx& operator=(const amx&) = delete;
-    amx& operator=(amx&&) = delete;
-  };
-
-  template <typename Cell, typename MemoryManager>
-  error amx<Cell, MemoryManager>::step()
-  {
+  //private:
+    // primary register (ALU, general purpose).
+    cell PRI{};
+    // alternate register (general purpose).
+    cell ALT{};
+    // stack frame pointer; stack-relative memory reads & writes are relative to the address in this register.
+    cell FRM{};
+    // code instruction pointer.
+    cell CIP{};
+    // offset to the start of the data. (data segment base)
+    cell DAT{};
+    // offset to the start of the code. (code segment base)
+    cell COD{};
+    // stack top.
+    cell STP{};
+    // stack index, indicates the current position in the stack. The stack runs downwards from the STP register towards zero.
+    cell STK{};
+    // heap pointer. Dynamically allocated memory comes from the heapand the HEA register indicates the top of the heap.
+    cell HEA{};
 
+  private:
     enum : cell {
       OP_NOP = 0,
       OP_LOAD_PRI,
@@ -575,554 +767,2674 @@ namespace amx
       OP_SWAP_ALT,
       OP_BREAK,
       OP_CASETBL,
+      // patched SYSREQ of other implementations, reserved but never run here
+      OP_SYSREQ_D,
+      OP_SYSREQ_ND,
+      // overlay instructions
+      OP_CALL_OVL,
+      OP_RETN_OVL,
+      OP_SWITCH_OVL,
+      OP_CASETBL_OVL,
+      /* ----- */
+      OP_NUM_OPCODES,
+
+      // internal opcodes of the decoded stream, these never appear in files.
+      IOP_FALLBACK = OP_NUM_OPCODES,
+      IOP_EXIT,
+      IOP_CASETBL,
+      IOP_CASEDATA,
+      IOP_SWITCH_DENSE,
+      // superinstructions, named after what they fuse
+      IOP_LOAD_S_PUSH_PRI,
+      IOP_CONST_PUSH_PRI,
+      IOP_PROC_STACK,
+      IOP_EQ_JZER,
+      IOP_NEQ_JZER,
+      IOP_SLESS_JZER,
+      IOP_SLEQ_JZER,
+      IOP_SGRTR_JZER,
+      IOP_SGEQ_JZER,
       /* ----- */
-      OP_NUM_OPCODES
+      IOP_NUM_OPCODES
     };
 
-    cell* _tmp{};
+    // With Verified the code is read straight from _verified_code, and only the CIP an instruction starts at is checked
+    template <bool Verified>
+    error step_impl();
 
-    const static auto INC = [](cell& v) -> cell& { return (v += cell_bytes); };
-    const static auto DEC = [](cell& v) -> cell& { return (v -= cell_bytes); };
-    const static auto INCP = [](cell& v) -> cell { cell c = v; return (v += cell_bytes), c; };
-    const static auto DECP = [](cell& v) -> cell { cell c = v; return (v -= cell_bytes), c; };
+    error step() { return _verified_code ? step_impl<true>() : step_impl<false>(); }
 
-    _tmp = code_v2p(INCP(CIP));
-    if (!_tmp)
-      return error::access_violation_code;
-    cell opcode{ *_tmp };
-    cell operand{};
+    const cell* _verified_code{};
+    const uint8_t* _verified_starts{};
+    size_t _verified_count{};
 
-#define OPERAND() do { _tmp = code_v2p(INCP(CIP)); if(!_tmp) return error::access_violation_code; operand = *_tmp; } while(0)
+  public:
+    using decoded_t = detail::decoded_instruction<cell>;
 
-#define DATA(v) do { _tmp = data_v2p(v); if(!_tmp) return error::access_violation; } while(0)
-#define CODEDATA(v) do { _tmp = code_v2p(v); if(!_tmp) return error::access_violation; } while(0)
-#define RESULT() (*_tmp)
+  private:
+    const decoded_t* _decoded{};
+    size_t _decoded_count{};
 
-#define PUSH(v) do {\
-    DEC(STK);\
-    cell _push_tmp1 = v;\
-    cell* _push_tmp2 = data_v2p(STK);\
-    if(!_push_tmp2) return error::access_violation;\
-    *_push_tmp2 = _push_tmp1;\
-  } while(0)
+    static error run_decoded(amx* self, const void* const** labels);
+    // decode() with the handlers left as opcodes instead of labels
+    static void decode_opcodes(const cell* code, size_t count, decoded_t* out, bool fuse, const uint8_t* starts);
 
-#define POP(v) do {\
-    cell& _pop_tmp1 = v;\
-    cell* _pop_tmp2 = data_v2p(STK);\
-    if(!_pop_tmp2) return error::access_violation;\
-    _pop_tmp1 = *_pop_tmp2;\
-    INC(STK);\
-  } while(0)
+    template <typename Amx>
+    friend class jit;
 
-    switch (opcode)
+  public:
+    // Decodes `count` cells of code into `out`, which must have room for `count + 1` entries. Every cell is decoded as
+    // if an instruction started there, anything the decoded stream can't represent exactly is left to step().
+    // With `fuse`, common instruction sequences run as one superinstruction from the entry of their first instruction.
+    // Entries stay at the index of their original cell, so CIPs seen by scripts and in errors don't change.
+    // With the `starts` of verified code, cells that don't start an instruction are left to step() too.
+    static void decode(const cell* code, size_t count, decoded_t* out, bool fuse = true, const uint8_t* starts = nullptr);
+
+    // Executes code through a stream made by decode() instead of translating and decoding each instruction in step().
+    // The code segment is assumed to be immutable while attached. Not used while single stepping is enabled.
+    void attach_decoded(const decoded_t* decoded, size_t count)
     {
-    case OP_NOP:
-      break;
+      _decoded = decoded;
+      _decoded_count = count;
+    }
+
+    void detach_decoded()
+    {
+      _decoded = nullptr;
+      _decoded_count = 0;
+    }
+
+    // Checks once what step() would otherwise check on every fetch: that `count` cells of code are a sequence of
+    // instructions with known opcodes and all of their operands, that operands step() rejects are not there, and that
+    // jumps, calls and case tables lead to instructions, and switches to case tables. `starts[i]` is set to whether an
+    // instruction starts at cell i, SYSREQ operands have to be below `natives`. On failure returns the error and the CIP
+    // of the first instruction found wrong.
+    static error verify(const cell* code, size_t count, size_t natives, uint8_t* starts, cell& cip);
+
+    // Executes `count` cells of code that passed verify() by reading them directly, with only the CIP each instruction
+    // starts at checked. Both have to match what is mapped at COD, and stay immutable while attached.
+    void attach_verified(const cell* code, const uint8_t* starts, size_t count)
+    {
+      _verified_code = code;
+      _verified_starts = starts;
+      _verified_count = count;
+    }
+
+    void detach_verified()
+    {
+      _verified_code = nullptr;
+      _verified_starts = nullptr;
+      _verified_count = 0;
+    }
+
+    // An execution engine used instead of the decoded stream. Same contract as the decoded interpreter: it runs from CIP
+    // until it returns an error, returns to CIP 0, or leaves an instruction to step() by returning success.
+    using engine_fn = error(*)(amx* self, void* user);
+
+    // Engines run one flat code segment, so they can't be attached while there is an overlay handler.
+    bool attach_engine(engine_fn engine, void* user)
+    {
+      if (_overlay_fn)
+        return false;
+      _engine = engine;
+      _engine_user = user;
+      return true;
+    }
+
+    void detach_engine()
+    {
+      _engine = nullptr;
+      _engine_user = nullptr;
+    }
+
+    bool has_engine() const { return _engine != nullptr; }
+
+  private:
+    engine_fn _engine{};
+    void* _engine_user{};
+
+  public:
+    // Makes overlay `index` the code being executed: maps its code at COD, and attaches its decoded stream if there is
+    // one. Fails with error::invalid_operand on an index that isn't an overlay.
+    using overlay_fn = error(*)(amx* self, void* user, cell index);
+
+    // Programs compiled with overlays keep each function in an overlay of its own, with code addresses starting at 0
+    // in it. CALL_OVL, RETN_OVL and SWITCH_OVL switch overlays through `fn`, and call() takes the index of the overlay
+    // of the entry point instead of a CIP. Overlay 0 holds the HALT the entry point returns to. Without a handler
+    // these instructions are invalid. Installing a handler detaches the engine, see attach_engine().
+    void set_overlay_handler(overlay_fn fn, void* user)
+    {
+      if (fn)
+        detach_engine();
+      _overlay_fn = fn;
+      _overlay_user = user;
+      _overlay = 0;
+    }
+
+    error switch_overlay(cell index)
+    {
+      if (!_overlay_fn)
+        return error::invalid_instruction;
+      const auto result = _overlay_fn(this, _overlay_user, index);
+      if (result == error::success)
+        _overlay = index;
+      return result;
+    }
+
+    cell get_overlay() const { return _overlay; }
+
+  private:
+    overlay_fn _overlay_fn{};
+    void* _overlay_user{};
+    cell _overlay{};
+
+#if AMX_PROFILE
+  public:
+    // Filled in by a profiler. The counters are updated by step() and the decoded interpreter, the functions are called
+    // on PROC, RET and RETN, and around the callback of a SYSREQ.
+    struct profile_hooks
+    {
+      // executed instructions, and how many of them were at each of the first `hit_count` cells of code
+      uint64_t instructions;
+      uint64_t* hits;
+      size_t hit_count;
+      void* user;
+      // `frm` is the frame made by the PROC, or the one the RET or RETN leaves
+      void (*enter)(void* user, cell cip, cell frm);
+      void (*leave)(void* user, cell frm);
+      void (*native_begin)(void* user, cell index, cell stk);
+      void (*native_end)(void* user, cell index);
+      // a call that started at `stk` failed, its frames are gone
+      void (*unwind)(void* user, cell stk);
+    };
+
+    constexpr static size_t opcode_count = OP_NUM_OPCODES;
+
+    // The attached engine has no hooks, so while profiling calls run on the decoded stream or step() instead.
+    void attach_profiler(profile_hooks* hooks) { _profile = hooks; }
+    void detach_profiler() { _profile = nullptr; }
+
+  private:
+    profile_hooks* _profile{};
+#endif
+
+    bool profiled() const
+    {
+#if AMX_PROFILE
+      return _profile != nullptr;
+#else
+      return false;
+#endif
+    }
+
+  public:
+    constexpr static size_t latency_buckets = 32;
+
+    // Counters of one amx, readable from any thread while it runs. The amx is their only writer, so they are updated
+    // with relaxed loads and stores instead of read-modify-writes. Everything but native calls is added when a call
+    // returns, yields or sleeps, and after each row of a batch.
+    struct telemetry
+    {
+      std::atomic<uint64_t> instructions;
+      // call() and rows of call_batch(), nested ones included. A yield or sleep ends one, resume() doesn't start one.
+      std::atomic<uint64_t> calls;
+      // calls by host time, bucket k holding those of [2^k, 2^(k+1)) nanoseconds, the last one all longer ones too
+      std::atomic<uint64_t> latency[latency_buckets];
+      // by SYSREQ operand, `native_count` of them
+      std::atomic<uint64_t>* native_calls;
+      size_t native_count;
+      // the highest HEA and the lowest STK since attaching, seen at PROC, STACK and HEAP. STP - stk_low is the deepest
+      // the stack went.
+      std::atomic<cell> hea_high;
+      std::atomic<cell> stk_low;
+    };
+
+    // `counters` has to live while attached. The stack and heap marks start over from here.
+    void attach_telemetry(telemetry* counters)
+    {
+      _telemetry = counters;
+      _stk_low = (cell)~(cell)0;
+      _hea_high = 0;
+    }
+
+    void detach_telemetry() { _telemetry = nullptr; }
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    telemetry* _telemetry{};
+    // kept whether telemetry is attached or not, so engines can update them unconditionally
+    cell _stk_low{ (cell)~(cell)0 };
+    cell _hea_high{};
+
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n = 1)
+    {
+      counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // a call that took since `start` and retired `retired` instructions
+    void record_call(clock::time_point start, int64_t retired)
+    {
+      const auto ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+      size_t bucket{};
+      while (bucket + 1 < latency_buckets && ns >> (bucket + 1))
+        ++bucket;
+      bump(_telemetry->calls);
+      bump(_telemetry->latency[bucket]);
+      record_run(retired);
+    }
+
+    void record_run(int64_t retired)
+    {
+      bump(_telemetry->instructions, retired > 0 ? (uint64_t)retired : 0);
+      _telemetry->hea_high.store(_hea_high, std::memory_order_relaxed);
+      _telemetry->stk_low.store(_stk_low, std::memory_order_relaxed);
+    }
+
+    void profile_hit(cell cip)
+    {
+#if AMX_PROFILE
+      if (!_profile)
+        return;
+      ++_profile->instructions;
+      if ((size_t)(cip / cell_bytes) < _profile->hit_count)
+        ++_profile->hits[cip / cell_bytes];
+#else
+      (void)cip;
+#endif
+    }
+
+    // for an instruction the decoded interpreter counted and then left to step()
+    void profile_unhit(cell cip)
+    {
+#if AMX_PROFILE
+      if (!_profile)
+        return;
+      --_profile->instructions;
+      if ((size_t)(cip / cell_bytes) < _profile->hit_count)
+        --_profile->hits[cip / cell_bytes];
+#else
+      (void)cip;
+#endif
+    }
+
+    void profile_enter(cell cip, cell frm)
+    {
+#if AMX_PROFILE
+      if (_profile)
+        _profile->enter(_profile->user, cip, frm);
+#else
+      (void)cip, (void)frm;
+#endif
+    }
+
+    void profile_leave(cell frm)
+    {
+#if AMX_PROFILE
+      if (_profile)
+        _profile->leave(_profile->user, frm);
+#else
+      (void)frm;
+#endif
+    }
+
+    // call_native() for a SYSREQ
+    error fire_native(cell index)
+    {
+#if AMX_PROFILE
+      if (_profile)
+      {
+        _profile->native_begin(_profile->user, index, STK);
+        const auto result = call_native(index);
+        _profile->native_end(_profile->user, index);
+        return result;
+      }
+#endif
+      return call_native(index);
+    }
+
+    void profile_unwind(cell stk)
+    {
+#if AMX_PROFILE
+      if (_profile)
+        _profile->unwind(_profile->user, stk);
+#else
+      (void)stk;
+#endif
+    }
+
+  public:
+    using callback_t = error(*)(amx* _this, void* user_data, cell index, cell stk, cell& pri);
+    enum : cell
+    {
+      cbid_single_step = (cell)(scell)-1,
+      cbid_break = (cell)(scell)-2
+    };
+
+  private:
+    callback_t _callback{};
+    void* _callback_user_data{};
+    bool _single_step{ true };
+    // instructions left before the next backward jump or call yields
+    int64_t _budget{ std::numeric_limits<int64_t>::max() };
+
+    static int64_t clamp_budget(uint64_t budget)
+    {
+      constexpr auto max = (uint64_t)std::numeric_limits<int64_t>::max();
+      return (int64_t)(budget > max ? max : budget);
+    }
+
+    error fire_callback(cell index)
+    {
+      // callback shouldnt modify these after return
+      const auto alt = ALT;
+      const auto frm = FRM;
+      const auto cip = CIP;
+      const auto stp = STP;
+      const auto stk = STK;
+      const auto result = _callback(this, _callback_user_data, index, STK, PRI);
+      ALT = alt;
+      FRM = frm;
+      CIP = cip;
+      STP = stp;
+      STK = stk;
+      return result;
+    }
+
+  public:
+    // A native called straight from SYSREQ instead of through the callback. `argv` are the `argc` argument cells on the
+    // stack, already translated, so writes to them are seen by the script.
+    using native_t = error(*)(amx* self, void* user, cell argc, cell* argv, cell& retval);
+
+    struct native_binding
+    {
+      native_t fn;
+      void* user;
+    };
+
+  private:
+    const native_binding* _bound{};
+    size_t _bound_count{};
+
+    // The bound native of a SYSREQ, or the callback for one without a binding, or arguments that aren't contiguous in
+    // host memory. Registers are kept the same way around both.
+    error call_native(cell index)
+    {
+      if (_telemetry && index < _telemetry->native_count)
+        bump(_telemetry->native_calls[index]);
+      if (index >= _bound_count || !_bound[index].fn)
+        return fire_callback(index);
+      size_t have{};
+      const auto frame = data_v2p_span(STK, have);
+      if (!frame)
+        return error::access_violation;
+      const auto argc = (cell)(frame[0] / cell_bytes);
+      if (have <= (size_t)argc)
+        return fire_callback(index);
+      const auto alt = ALT;
+      const auto frm = FRM;
+      const auto cip = CIP;
+      const auto stp = STP;
+      const auto stk = STK;
+      const auto result = _bound[index].fn(this, _bound[index].user, argc, frame + 1, PRI);
+      ALT = alt;
+      FRM = frm;
+      CIP = cip;
+      STP = stp;
+      STK = stk;
+      return result;
+    }
+
+  public:
+    // SYSREQ operands below `count` with a binding call it directly, the rest still go through the callback. The
+    // table has to live while attached.
+    void attach_natives(const native_binding* natives, size_t count)
+    {
+      _bound = natives;
+      _bound_count = count;
+    }
+
+    void detach_natives()
+    {
+      _bound = nullptr;
+      _bound_count = 0;
+    }
+
+    // Whether cbid_single_step is fired before each instruction. When disabled the run loop has no per-instruction
+    // callback at all. Takes effect on the next call().
+    void set_single_step(bool enabled) { _single_step = enabled; }
+    bool get_single_step() const { return _single_step; }
+
+    error push(cell v)
+    {
+      STK -= cell_bytes;
+      const auto target = data_v2p(STK);
+      if (!target)
+        return error::access_violation;
+      *target = v;
+      return error::success;
+    }
+
+    error pop(cell& v)
+    {
+      const auto target = data_v2p(STK);
+      if (!target)
+        return error::access_violation;
+      v = *target;
+      STK += cell_bytes;
+      return error::success;
+    }
+
+    void pop()
+    {
+      STK += cell_bytes;
+    }
+
+    // An argument of call(). Arrays and strings are copied onto the heap for the duration of the call, and what is
+    // passed is their address there. Arrays given as a non-const pointer are copied back when the call returns.
+    struct argument
+    {
+      cell value{};
+      const cell* array{};
+      cell* out{};
+      const char* string{};
+      size_t cells{};
+
+      constexpr argument(cell v) : value(v) {}
+      constexpr argument(const cell* data, size_t count) : array(data), cells(count) {}
+      constexpr argument(cell* data, size_t count) : array(data), out(data), cells(count) {}
+
+      // As an unpacked string, one character per cell with the terminator.
+      static argument unpacked(const char* str)
+      {
+        argument arg{ cell{} };
+        arg.string = str;
+        arg.cells = strlen(str) + 1;
+        return arg;
+      }
+
+      constexpr bool is_copied() const { return array || string; }
+    };
+
+    // Arguments of call(), viewing storage the caller owns.
+    class argument_span
+    {
+      const argument* _data{};
+      size_t _size{};
+
+    public:
+      constexpr argument_span() = default;
+      constexpr argument_span(const argument* data, size_t size) : _data(data), _size(size) {}
+      template <size_t N>
+      constexpr argument_span(const argument(&data)[N]) : _data(data), _size(N) {}
+      constexpr argument_span(std::initializer_list<argument> list) : _data(std::begin(list)), _size(list.size()) {}
+
+      constexpr const argument* data() const { return _data; }
+      constexpr size_t size() const { return _size; }
+    };
+
+  private:
+    // As of version 2.0, the PAWN compiler puts a HALT opcode at the start of the code (so at code address 0). Before
+    // jumping to the entry point (a function), the abstract machine pushes a zero return address onto the stack. When
+    // the entry point returns, it returns to the zero address and sees the HALT instruction.
+    constexpr static auto invalid_cip = (cell)0;
+
+    // With overlays every function starts at CIP 0 of its own overlay, only CIP 0 of overlay 0 is the return address.
+    bool running() const { return CIP != invalid_cip || _overlay != 0; }
+
+    // Bytes that have to stay free between the heap and the stack. Checked only where a function or an instruction takes
+    // a block of either, at PROC, STACK and HEAP, so the pushes in between must fit in it.
+    constexpr static cell stack_margin = (cell)(16 * cell_bytes);
+
+    // Also where the stack and heap marks of telemetry are taken.
+    bool collides(cell stk, cell hea)
+    {
+      _stk_low = stk < _stk_low ? stk : _stk_low;
+      _hea_high = hea > _hea_high ? hea : _hea_high;
+      return stk < hea || (cell)(stk - hea) < stack_margin;
+    }
+
+    // HALT operand the compiler emits for the sleep statement, with PRI holding the value of its expression.
+    constexpr static auto halt_sleep = (cell)12;
+
+    error run(cell& pri)
+    {
+      auto result = error::success;
+      if (_single_step)
+      {
+        while (result == error::success && running())
+        {
+          result = fire_callback(cbid_single_step);
+          if (result != error::success)
+            break;
+          --_budget;
+          result = step();
+        }
+      }
+      else if ((_engine && !profiled()) || _decoded)
+      {
+        const auto engine = profiled() ? nullptr : _engine;
+        while (result == error::success && running())
+        {
+          // runs until it reaches something only step() can handle
+          result = engine ? engine(this, _engine_user) : run_decoded(this, nullptr);
+          if (result == error::success && running())
+          {
+            --_budget;
+            result = step();
+          }
+        }
+      }
+      else
+      {
+        while (result == error::success && running())
+        {
+          --_budget;
+          result = step();
+        }
+      }
+      pri = PRI;
+      return result;
+    }
+
+    // set by guarded() when the data backing caught a fault, see has_faulted()
+    bool _faulted{};
+
+    // Runs `fn` under the fault handling of the data backing, if it has any. A fault that is caught there returns
+    // error::access_violation, with the registers as the engine last wrote them back, so CIP may be short of the fault.
+    template <typename Fn>
+    error guarded(Fn&& fn)
+    {
+      using data_backing_t = std::remove_reference_t<decltype(mem.data())>;
+      if constexpr (detail::has_guarded_run<data_backing_t>::value)
+      {
+        if (_faulted)
+          return error::access_violation;
+        // a fault never gets back here
+        auto returned = false;
+        const auto body = [&]
+        {
+          const auto result = fn();
+          returned = true;
+          return result;
+        };
+        const auto result = mem.data().guarded_run([](void* p) { return (*(decltype(body)*)p)(); }, (void*)&body);
+        _faulted = _faulted || !returned;
+        return result;
+      }
+      else
+        return fn();
+    }
+
+    error call_raw(cell cip, cell& pri)
+    {
+      auto result = push(invalid_cip);
+      CIP = cip;
+      if (result == error::success && _overlay_fn)
+      {
+        // the entry point is the index of its overlay
+        CIP = invalid_cip;
+        result = switch_overlay(cip);
+      }
+      if (result != error::success)
+      {
+        pri = PRI;
+        return result;
+      }
+      return run(pri);
+    }
+
+    // Lays out the frame of a call below STK, with arrays and strings copied onto the heap above HEA. Nothing is
+    // changed if any of it faults.
+    error push_arguments(const argument* args, size_t count)
+    {
+      constexpr auto max_cells = (size_t)(cell)~(cell)0 / cell_bytes;
+      size_t heap_cells{};
+      for (size_t i = 0; i < count; ++i)
+        if (args[i].is_copied())
+        {
+          if (args[i].cells > max_cells - heap_cells)
+            return error::access_violation;
+          heap_cells += args[i].cells;
+        }
+      if (count >= max_cells)
+        return error::access_violation;
+
+      const auto stk = (cell)(STK - (cell)((count + 1) * cell_bytes));
+      if (heap_cells && (stk < HEA || (size_t)(stk - HEA) / cell_bytes < heap_cells))
+        return error::stack_heap_collision;
+
+      auto addr = HEA;
+      for (size_t i = 0; i < count; ++i)
+      {
+        const auto& arg = args[i];
+        if (!arg.is_copied())
+          continue;
+        if (arg.array)
+        {
+          const auto result = data_write(addr, arg.array, arg.cells);
+          if (result != error::success)
+            return result;
+        }
+        else
+        {
+          for (size_t k = 0; k < arg.cells;)
+          {
+            size_t span{};
+            const auto target = data_v2p_span(addr + (cell)(k * cell_bytes), span);
+            if (!target)
+              return error::access_violation;
+            const auto n = arg.cells - k < span ? arg.cells - k : span;
+            for (size_t j = 0; j < n; ++j)
+              target[j] = (cell)(unsigned char)arg.string[k + j];
+            k += n;
+          }
+        }
+        addr += (cell)(arg.cells * cell_bytes);
+      }
+
+      size_t have{};
+      const auto frame = data_v2p_span(stk, have);
+      addr = HEA;
+      for (size_t k = 0; k <= count; ++k)
+      {
+        // the frame is usually one span, past it each cell is translated on its own
+        const auto target = frame && k < have ? frame + k : data_v2p(stk + (cell)(k * cell_bytes));
+        if (!target)
+          return error::access_violation;
+        if (k == 0)
+        {
+          *target = (cell)(count * cell_bytes);
+          continue;
+        }
+        const auto& arg = args[k - 1];
+        if (arg.is_copied())
+        {
+          *target = addr;
+          addr += (cell)(arg.cells * cell_bytes);
+        }
+        else
+        {
+          *target = arg.value;
+        }
+      }
+
+      HEA = addr;
+      STK = stk;
+      return error::success;
+    }
+
+    // Copies the heap copies of writable arrays laid out by push_arguments() from `hea` back to the host.
+    error copy_back(const argument* args, size_t count, cell hea)
+    {
+      for (size_t i = 0; i < count; ++i)
+        if (args[i].is_copied())
+        {
+          if (args[i].out)
+          {
+            const auto result = data_read(hea, args[i].out, args[i].cells);
+            if (result != error::success)
+              return result;
+          }
+          hea += (cell)(args[i].cells * cell_bytes);
+        }
+      return error::success;
+    }
+
+    // HEA to restore once a resumed call returns, if its arguments took heap
+    cell _call_hea{};
+    bool _call_heap{};
+    // calls, batches and resumes in progress, more than one when natives call back into the script
+    size_t _depth{};
+
+  public:
+    constexpr static uint64_t unlimited_budget = ~(uint64_t)0;
+
+    // Once `budget` instructions have been executed, the next backward jump or call returns error::yield, with all
+    // registers preserved so that resume() can continue it. Only the outermost call can be resumed, a nested one from
+    // a native that yields or sleeps is unwound like a failed one, so the native's caller goes on with its own budget.
+    // Heap taken by the arguments is released when the call returns, including through resume(). Writable arrays are
+    // copied back only if the call returns error::success from here, as `args` may be gone by the time a resume does.
+    error call(cell cip, cell& pri, argument_span args = {}, uint64_t budget = unlimited_budget)
+    {
+      const auto outer_budget = _budget;
+      const auto overlay = _overlay;
+      const auto stk = STK;
+      const auto hea = HEA;
+      const auto start = _telemetry ? clock::now() : clock::time_point{};
+      auto granted = _budget;
+      const auto nested = _depth != 0;
+      ++_depth;
+      const auto call_result = guarded([&]
+      {
+        const auto result = push_arguments(args.data(), args.size());
+        if (result != error::success)
+          return result;
+
+        _budget = granted = clamp_budget(budget);
+        return call_raw(cip, pri);
+      });
+      --_depth;
+      if (_telemetry)
+        record_call(start, granted - _budget);
+      if (is_resumable(call_result) && !nested)
+      {
+        _call_hea = hea;
+        _call_heap = false;
+        for (size_t i = 0; i < args.size(); ++i)
+          _call_heap = _call_heap || args.data()[i].is_copied();
+        return call_result;
+      }
+      _budget = outer_budget;
+      auto result = call_result;
+      if (result == error::success)
+        result = guarded([&] { return copy_back(args.data(), args.size(), hea); });
+      else
+        profile_unwind(stk);
+      HEA = hea;
+      // a nested call returns into overlay 0, so the one of whatever called the native is switched back to
+      if (_overlay != overlay)
+      {
+        const auto restored = switch_overlay(overlay);
+        result = result == error::success ? restored : result;
+      }
+      return result;
+    }
+
+    // Calls `cip` once for each of `count` rows of `arity` cells in `args`, storing what each call returned in
+    // `results`. The frame is translated once and rewritten in place for every row, and STK and HEA are reset in
+    // between. Stops at the first call that doesn't succeed, with `completed` as its row. A yielded or sleeping call
+    // can be finished with resume(), after which the batch can go on from the next row, unless the batch is nested like
+    // in call().
+    error call_batch(
+      cell cip,
+      const cell* args,
+      size_t arity,
+      cell* results,
+      size_t count,
+      size_t& completed,
+      uint64_t budget = unlimited_budget
+    )
+    {
+      completed = 0;
+      constexpr auto max_cells = (size_t)(cell)~(cell)0 / cell_bytes;
+      if (arity >= max_cells - 2)
+        return error::access_violation;
+
+      const auto outer_budget = _budget;
+      const auto overlay = _overlay;
+      const auto stk = STK;
+      const auto hea = HEA;
+      // return address, argument bytes and the arguments
+      const auto frame_cells = arity + 2;
+      const auto frame_va = (cell)(stk - (cell)(frame_cells * cell_bytes));
+      const auto nested = _depth != 0;
+      ++_depth;
+      const auto call_result = guarded([&]
+      {
+        size_t have{};
+        const auto frame = data_v2p_span(frame_va, have);
+        for (; completed < count; ++completed)
+        {
+          const auto row = args + completed * arity;
+          if (frame && have >= frame_cells)
+          {
+            frame[0] = invalid_cip;
+            frame[1] = (cell)(arity * cell_bytes);
+            memcpy(frame + 2, row, arity * sizeof(cell));
+          }
+          else
+          {
+            // the frame crosses a mapping
+            for (size_t k = 0; k < frame_cells; ++k)
+            {
+              const auto target = data_v2p(frame_va + (cell)(k * cell_bytes));
+              if (!target)
+                return error::access_violation;
+              *target = k == 0 ? invalid_cip : k == 1 ? (cell)(arity * cell_bytes) : row[k - 2];
+            }
+          }
+          STK = frame_va;
+          HEA = hea;
+          CIP = cip;
+          if (_overlay_fn)
+          {
+            CIP = invalid_cip;
+            const auto result = switch_overlay(cip);
+            if (result != error::success)
+              return result;
+          }
+          _budget = clamp_budget(budget);
+          cell pri{};
+          const auto start = _telemetry ? clock::now() : clock::time_point{};
+          const auto result = run(pri);
+          if (_telemetry)
+            record_call(start, clamp_budget(budget) - _budget);
+          if (result != error::success)
+            return result;
+          results[completed] = pri;
+        }
+        return error::success;
+      });
+      --_depth;
+      if (is_resumable(call_result) && !nested)
+      {
+        _call_heap = false;
+        return call_result;
+      }
+      if (call_result != error::success)
+        profile_unwind(stk);
+      _budget = outer_budget;
+      STK = stk;
+      HEA = hea;
+      if (_overlay != overlay)
+      {
+        const auto restored = switch_overlay(overlay);
+        return call_result == error::success ? restored : call_result;
+      }
+      return call_result;
+    }
+
+    // Continues a call that returned error::yield or error::sleep.
+    error resume(cell& pri, uint64_t budget = unlimited_budget)
+    {
+      _budget = clamp_budget(budget);
+      ++_depth;
+      const auto result = guarded([&] { return run(pri); });
+      --_depth;
+      if (_telemetry)
+        record_run(clamp_budget(budget) - _budget);
+      // only the outermost call is resumed, so nothing is left above it
+      if (result != error::success && !is_resumable(result))
+        profile_unwind((cell)~(cell)0);
+      if (!is_resumable(result) && _call_heap)
+      {
+        HEA = _call_hea;
+        _call_heap = false;
+      }
+      return result;
+    }
+
+    // Continues a call that returned error::sleep because of a native, with `retval` as what the native returned.
+    error resume_with(cell retval, cell& pri, uint64_t budget = unlimited_budget)
+    {
+      PRI = retval;
+      return resume(pri, budget);
+    }
+
+    int64_t get_budget() const { return _budget; }
+
+    // Whether the data backing caught a fault in a call. It unwinds past whatever was left to restore, like the
+    // registers saved around natives, so calls fail with error::access_violation until the state has been reset and
+    // clear_fault() is called. loader::reset() does both.
+    bool has_faulted() const { return _faulted; }
+    void clear_fault() { _faulted = false; }
+
+    amx(
+      callback_t callback,
+      void* callback_user
+    )
+      : _callback(callback)
+      , _callback_user_data(callback_user)
+    {}
+
+    constexpr amx() = default;
+
+    void init(
+      callback_t callback,
+      void* callback_user
+    )
+    {
+      _callback = callback;
+      _callback_user_data = callback_user;
+    }
+
+    ~amx() = default;
+
+    amx(const amx&) = delete;
+    amx(amx&&) = delete;
+
+    amx& operator=(const amx&) = delete;
+    amx& operator=(amx&&) = delete;
+  };
+
+  template <typename Cell, typename MemoryManager>
+  template <bool Verified>
+  error amx<Cell, MemoryManager>::step_impl()
+  {
+
+    cell* _tmp{};
+    const cell* _code_tmp{};
+
+    const static auto INC = [](cell& v) -> cell& { return (v += cell_bytes); };
+    const static auto DEC = [](cell& v) -> cell& { return (v -= cell_bytes); };
+    const static auto INCP = [](cell& v) -> cell { cell c = v; return (v += cell_bytes), c; };
+    const static auto DECP = [](cell& v) -> cell { cell c = v; return (v -= cell_bytes), c; };
+
+    profile_hit(CIP);
+    if constexpr (Verified)
+    {
+      // the operands of a verified instruction are all in the code
+      const auto index = (size_t)(CIP / cell_bytes);
+      if (CIP % cell_bytes != 0 || index >= _verified_count || !_verified_starts[index])
+        return error::access_violation_code;
+      _code_tmp = _verified_code + index;
+      CIP += cell_bytes;
+    }
+    else
+    {
+      _code_tmp = code_v2p(INCP(CIP));
+      if (!_code_tmp)
+        return error::access_violation_code;
+    }
+    cell opcode{ *_code_tmp };
+    cell operand{};
+
+#define OPERAND() do {\
+    if constexpr (Verified) { operand = _verified_code[CIP / cell_bytes]; CIP += cell_bytes; }\
+    else { _code_tmp = code_v2p(INCP(CIP)); if(!_code_tmp) return error::access_violation_code; operand = *_code_tmp; }\
+  } while(0)
+
+#define DATA(v) do { _tmp = data_v2p(v); if(!_tmp) return error::access_violation; } while(0)
+#define CODEDATA(v) do {\
+    if constexpr (Verified) {\
+      /* the code may have been written through data since it was verified */\
+      const auto _cd = (ucell)(v);\
+      if (_cd % cell_bytes != 0 || _cd / cell_bytes >= _verified_count) return error::invalid_operand;\
+      _code_tmp = _verified_code + _cd / cell_bytes;\
+    }\
+    else { _code_tmp = code_v2p(v); if(!_code_tmp) return error::access_violation; }\
+  } while(0)
+#define RESULT() (*_tmp)
+#define CODE_RESULT() (*_code_tmp)
+
+#define PUSH(v) do {\
+    DEC(STK);\
+    cell _push_tmp1 = v;\
+    cell* _push_tmp2 = data_v2p(STK);\
+    if(!_push_tmp2) return error::access_violation;\
+    *_push_tmp2 = _push_tmp1;\
+  } while(0)
+
+#define POP(v) do {\
+    cell& _pop_tmp1 = v;\
+    cell* _pop_tmp2 = data_v2p(STK);\
+    if(!_pop_tmp2) return error::access_violation;\
+    _pop_tmp1 = *_pop_tmp2;\
+    INC(STK);\
+  } while(0)
+
+#define BRANCH() do {\
+    const cell _branch_from = CIP - 2 * cell_bytes;\
+    CIP = _branch_from + operand;\
+    if (CIP <= _branch_from && _budget <= 0) return error::yield;\
+  } while(0)
+
+    switch (opcode)
+    {
+    case OP_NOP:
+      break;
+
+    case OP_LOAD_PRI:
+      OPERAND();
+      DATA(operand);
+      PRI = RESULT();
+      break;
+    case OP_LOAD_ALT:
+      OPERAND();
+      DATA(operand);
+      ALT = RESULT();
+      break;
+
+    case OP_LOAD_S_PRI:
+      OPERAND();
+      DATA(FRM + operand);
+      PRI = RESULT();
+      break;
+    case OP_LOAD_S_ALT:
+      OPERAND();
+      DATA(FRM + operand);
+      ALT = RESULT();
+      break;
+
+    case OP_LREF_S_PRI:
+      OPERAND();
+      DATA(FRM + operand);
+      DATA(RESULT());
+      PRI = RESULT();
+      break;
+    case OP_LREF_S_ALT:
+      OPERAND();
+      DATA(FRM + operand);
+      DATA(RESULT());
+      ALT = RESULT();
+      break;
+
+    case OP_LOAD_I:
+      DATA(PRI);
+      PRI = RESULT();
+      break;
+
+    case OP_LODB_I:
+      OPERAND();
+      {
+        constexpr static auto subcell_mask = (cell)misalign_mask;
+        const auto aligned = (cell)(PRI & ~subcell_mask);
+        const auto subcell_bits = (cell)((PRI & subcell_mask) * 8);
+        if (aligned != ((PRI + operand - 1) & ~subcell_mask))
+          return error::invalid_operand; // access spans across cells
+        DATA(aligned);
+        switch (operand)
+        {
+        case 1:
+          PRI = (RESULT() >> subcell_bits) & 0xFF;
+          break;
+        case 2:
+          PRI = (RESULT() >> subcell_bits) & 0xFFFF;
+          break;
+        case 4:
+          PRI = (RESULT() >> subcell_bits) & 0xFFFFFFFF;
+          break;
+        default:
+          return error::invalid_operand;
+        }
+        break;
+      }
+
+    case OP_CONST_PRI:
+      OPERAND();
+      PRI = operand;
+      break;
+    case OP_CONST_ALT:
+      OPERAND();
+      ALT = operand;
+      break;
+
+    case OP_ADDR_PRI:
+      OPERAND();
+      PRI = FRM + operand;
+      break;
+    case OP_ADDR_ALT:
+      OPERAND();
+      ALT = FRM + operand;
+      break;
+
+    case OP_STOR:
+      OPERAND();
+      DATA(operand);
+      RESULT() = PRI;
+      break;
+
+    case OP_STOR_S:
+      OPERAND();
+      DATA(FRM + operand);
+      RESULT() = PRI;
+      break;
+
+    case OP_SREF_S:
+      OPERAND();
+      DATA(FRM + operand);
+      DATA(RESULT());
+      RESULT() = PRI;
+      break;
+
+    case OP_STOR_I:
+      DATA(ALT);
+      RESULT() = PRI;
+      break;
+
+    case OP_STRB_I:
+      OPERAND();
+      {
+        constexpr static auto subcell_mask = (cell)misalign_mask;
+        const auto aligned = (cell)(ALT & ~subcell_mask);
+        const auto subcell_bits = (cell)((ALT & subcell_mask) * 8);
+        if (aligned != ((ALT + operand - 1) & ~subcell_mask))
+          return error::invalid_operand; // access spans across cells
+        DATA(aligned);
+        switch (operand)
+        {
+        case 1:
+          RESULT() = (cell)((RESULT() & ~((cell)0xFF << subcell_bits)) | ((PRI & 0xFF) << subcell_bits));
+          break;
+        case 2:
+          RESULT() = (cell)((RESULT() & ~((cell)0xFFFF << subcell_bits)) | ((PRI & 0xFFFF) << subcell_bits));
+          break;
+        case 4:
+          RESULT() = (cell)((RESULT() & ~((cell)0xFFFFFFFF << subcell_bits)) | ((PRI & 0xFFFFFFFF) << subcell_bits));
+          break;
+        default:
+          return error::invalid_operand;
+        }
+        break;
+      }
+
+    case OP_ALIGN_PRI:
+      OPERAND();
+      if (operand < cell_bytes)
+        PRI ^= (cell)(cell_bytes - operand);
+      break;
+
+    case OP_LCTRL:
+      OPERAND();
+      switch (operand)
+      {
+      case 0:
+        PRI = COD;
+        break;
+      case 1:
+        PRI = DAT;
+        break;
+      case 2:
+        PRI = HEA;
+        break;
+      case 3:
+        PRI = STP;
+        break;
+      case 4:
+        PRI = STK;
+        break;
+      case 5:
+        PRI = FRM;
+        break;
+      case 6:
+        PRI = CIP;
+        break;
+      default:
+        return error::invalid_operand;
+      }
+      break;
+
+    case OP_SCTRL:
+      OPERAND();
+      switch (operand)
+      {
+      case 2:
+        HEA = PRI;
+        break;
+      case 4:
+        STK = PRI;
+        break;
+      case 5:
+        FRM = PRI;
+        break;
+      case 6:
+        CIP = PRI;
+        break;
+      default:
+        return error::invalid_operand;
+      }
+      break;
+
+    case OP_XCHG:
+      operand = ALT;
+      ALT = PRI;
+      PRI = operand;
+      break;
+
+    case OP_PUSH_PRI:
+      PUSH(PRI);
+      break;
+    case OP_PUSH_ALT:
+      PUSH(ALT);
+      break;
+
+    case OP_PUSHR_PRI:
+      PUSH(PRI + DAT);
+      break;
+
+    case OP_POP_PRI:
+      POP(PRI);
+      break;
+    case OP_POP_ALT:
+      POP(ALT);
+      break;
 
-    case OP_LOAD_PRI:
+    case OP_PICK:
       OPERAND();
-      DATA(operand);
+      DATA(STK + operand);
       PRI = RESULT();
       break;
-    case OP_LOAD_ALT:
+
+    case OP_STACK:
       OPERAND();
-      DATA(operand);
-      ALT = RESULT();
+      STK += operand;
+      ALT = STK;
+      if (collides(STK, HEA))
+        return error::stack_heap_collision;
       break;
 
-    case OP_LOAD_S_PRI:
+    case OP_HEAP:
       OPERAND();
-      DATA(FRM + operand);
-      PRI = RESULT();
+      ALT = HEA;
+      HEA += operand;
+      if (collides(STK, HEA))
+        return error::stack_heap_collision;
       break;
-    case OP_LOAD_S_ALT:
+
+    case OP_PROC:
+      if (collides(STK, HEA))
+        return error::stack_heap_collision;
+      PUSH(FRM);
+      FRM = STK;
+      profile_enter(CIP - cell_bytes, FRM);
+      break;
+
+    case OP_RET:
+      profile_leave(FRM);
+      POP(FRM);
+      POP(CIP);
+      break;
+
+    case OP_RETN:
+      profile_leave(FRM);
+      POP(FRM);
+      POP(CIP);
+      DATA(STK);
+      STK += RESULT() + cell_bytes;
+      break;
+
+    case OP_CALL:
       OPERAND();
-      DATA(FRM + operand);
-      ALT = RESULT();
+      PUSH(CIP);
+      CIP = CIP - 2 * cell_bytes + operand;
+      if (_budget <= 0)
+        return error::yield;
       break;
 
-    case OP_LREF_S_PRI:
+    case OP_JUMP:
       OPERAND();
-      DATA(FRM + operand);
-      DATA(RESULT());
-      PRI = RESULT();
+      BRANCH();
       break;
-    case OP_LREF_S_ALT:
+
+    case OP_JZER:
       OPERAND();
-      DATA(FRM + operand);
-      DATA(RESULT());
-      ALT = RESULT();
+      if (PRI == 0)
+        BRANCH();
       break;
 
-    case OP_LOAD_I:
+    case OP_JNZ:
+      OPERAND();
+      if (PRI != 0)
+        BRANCH();
+      break;
+
+    case OP_SHL:
+      PRI <<= ALT;
+      break;
+
+    case OP_SHR:
+      PRI >>= ALT;
+      break;
+
+    case OP_SSHR:
+      PRI = (cell)((scell)PRI >> ALT); // not implementation defined since C++20.
+      break;
+
+    case OP_SHL_C_PRI:
+      OPERAND();
+      PRI <<= operand;
+      break;
+
+    case OP_SHL_C_ALT:
+      OPERAND();
+      ALT <<= operand;
+      break;
+
+    case OP_SMUL:
+      PRI = (cell)((scell)PRI * (scell)ALT);
+      break;
+
+    case OP_SDIV:
+      if (PRI == 0)
+        return error::division_with_zero;
+      operand = PRI;
+      PRI = (cell)((scell)ALT / (scell)operand);
+      ALT = (cell)((scell)ALT % (scell)operand);
+      if (ALT != 0 && (scell)(ALT ^ operand) < 0) {
+        --PRI;
+        ALT += operand;
+      }
+      break;
+
+    case OP_ADD:
+      PRI += ALT;
+      break;
+
+    case OP_SUB:
+      PRI = ALT - PRI;
+      break;
+
+    case OP_AND:
+      PRI &= ALT;
+      break;
+
+    case OP_OR:
+      PRI |= ALT;
+      break;
+
+    case OP_XOR:
+      PRI ^= ALT;
+      break;
+
+    case OP_NOT:
+      PRI = !PRI;
+      break;
+
+    case OP_NEG:
+      PRI = (cell)-(scell)PRI;
+      break;
+
+    case OP_INVERT:
+      PRI = ~PRI;
+      break;
+
+    case OP_EQ:
+      PRI = (cell)(PRI == ALT);
+      break;
+
+    case OP_NEQ:
+      PRI = (cell)(PRI != ALT);
+      break;
+
+    case OP_SLESS:
+      PRI = (cell)((scell)PRI < (scell)ALT);
+      break;
+
+    case OP_SLEQ:
+      PRI = (cell)((scell)PRI <= (scell)ALT);
+      break;
+
+    case OP_SGRTR:
+      PRI = (cell)((scell)PRI > (scell)ALT);
+      break;
+
+    case OP_SGEQ:
+      PRI = (cell)((scell)PRI >= (scell)ALT);
+      break;
+
+    case OP_INC_PRI:
+      ++PRI;
+      break;
+    case OP_INC_ALT:
+      ++ALT;
+      break;
+
+    case OP_INC_I:
       DATA(PRI);
-      PRI = RESULT();
+      ++RESULT();
       break;
 
-    case OP_LODB_I:
+    case OP_DEC_PRI:
+      --PRI;
+      break;
+    case OP_DEC_ALT:
+      --ALT;
+      break;
+
+    case OP_DEC_I:
+      DATA(PRI);
+      --RESULT();
+      break;
+
+    case OP_MOVS:
       OPERAND();
       {
-        constexpr static auto subcell_mask = (cell)misalign_mask;
-        const auto aligned = (cell)(PRI & ~subcell_mask);
-        const auto subcell_bits = (cell)((PRI & subcell_mask) * 8);
-        if (aligned != ((PRI + operand - 1) & ~subcell_mask))
-          return error::invalid_operand; // access spans across cells
-        DATA(aligned);
-        switch (operand)
-        {
-        case 1:
-          PRI = (RESULT() >> subcell_bits) & 0xFF;
-          break;
-        case 2:
-          PRI = (RESULT() >> subcell_bits) & 0xFFFF;
-          break;
-        case 4:
-          PRI = (RESULT() >> subcell_bits) & 0xFFFFFFFF;
-          break;
-        default:
-          return error::invalid_operand;
-        }
+        const auto result = data_move(ALT, PRI, operand);
+        if (result != error::success)
+          return result;
         break;
       }
 
-    case OP_CONST_PRI:
+    case OP_CMPS:
       OPERAND();
-      PRI = operand;
-      break;
-    case OP_CONST_ALT:
+      {
+        cell difference{};
+        const auto result = data_compare(ALT, PRI, operand, difference);
+        PRI = difference;
+        if (result != error::success)
+          return result;
+        break;
+      }
+
+    case OP_FILL:
       OPERAND();
-      ALT = operand;
-      break;
+      {
+        const auto result = data_fill(ALT, PRI, operand);
+        if (result != error::success)
+          return result;
+        break;
+      }
 
-    case OP_ADDR_PRI:
+    case OP_HALT:
       OPERAND();
-      PRI = FRM + operand;
-      break;
-    case OP_ADDR_ALT:
+      if (operand == halt_sleep)
+        return error::sleep;
+      PRI = operand;
+      return error::halt;
+
+    case OP_BOUNDS:
       OPERAND();
-      ALT = FRM + operand;
+      if (PRI > operand)
+        return error::bounds;
       break;
 
-    case OP_STOR:
+    case OP_SYSREQ:
       OPERAND();
-      DATA(operand);
-      RESULT() = PRI;
-      break;
+      {
+        const auto result = fire_native(operand);
+        if (result != error::success)
+          return result;
+        break;
+      }
+
+    case OP_SWITCH:
+      OPERAND();
+      {
+        cell casetbl = CIP - 2 * cell_bytes + operand;
+        CODEDATA(INCP(casetbl));
+        if (CODE_RESULT() != OP_CASETBL)
+          return error::invalid_operand;
+        CODEDATA(INCP(casetbl));
+        cell record_count = CODE_RESULT();
+        CODEDATA(INCP(casetbl));
+        CIP = casetbl - cell_bytes * 2 + CODE_RESULT(); // no match cip
+        while (record_count)
+        {
+          CODEDATA(INCP(casetbl));
+          const cell test_val = CODE_RESULT();
+          CODEDATA(INCP(casetbl));
+          cell match_cip = CODE_RESULT();
+          if (PRI == test_val)
+          {
+            CIP = casetbl - cell_bytes * 2 + match_cip;
+            break;
+          }
+          --record_count;
+        }
+        break;
+      }
 
-    case OP_STOR_S:
-      OPERAND();
-      DATA(FRM + operand);
+    case OP_SWAP_PRI:
+      DATA(STK);
+      operand = RESULT();
       RESULT() = PRI;
+      PRI = operand;
       break;
 
-    case OP_SREF_S:
-      OPERAND();
-      DATA(FRM + operand);
-      DATA(RESULT());
-      RESULT() = PRI;
+    case OP_SWAP_ALT:
+      DATA(STK);
+      operand = RESULT();
+      RESULT() = ALT;
+      ALT = operand;
       break;
 
-    case OP_STOR_I:
-      DATA(ALT);
-      RESULT() = PRI;
+    case OP_BREAK:
+    {
+      const auto result = fire_callback(cbid_break);
+      if (result != error::success)
+        return result;
       break;
+    }
 
-    case OP_STRB_I:
+    // Return addresses of overlay calls hold the offset into the calling overlay in their upper half, and its index in
+    // the lower one.
+    case OP_CALL_OVL:
       OPERAND();
       {
-        constexpr static auto subcell_mask = (cell)misalign_mask;
-        const auto aligned = (cell)(ALT & ~subcell_mask);
-        const auto subcell_bits = (cell)((ALT & subcell_mask) * 8);
-        if (aligned != ((ALT + operand - 1) & ~subcell_mask))
-          return error::invalid_operand; // access spans across cells
-        DATA(aligned);
-        switch (operand)
-        {
-        case 1:
-          RESULT() = (cell)((RESULT() & ~((cell)0xFF << subcell_bits)) | ((PRI & 0xFF) << subcell_bits));
-          break;
-        case 2:
-          RESULT() = (cell)((RESULT() & ~((cell)0xFFFF << subcell_bits)) | ((PRI & 0xFFFF) << subcell_bits));
-          break;
-        case 4:
-          RESULT() = (cell)((RESULT() & ~((cell)0xFFFFFFFF << subcell_bits)) | ((PRI & 0xFFFFFFFF) << subcell_bits));
-          break;
-        default:
+        constexpr auto half = sizeof(cell) * 4;
+        if (CIP >> half)
           return error::invalid_operand;
-        }
+        PUSH((cell)(CIP << half) | _overlay);
+        const auto result = switch_overlay(operand);
+        if (result != error::success)
+          return result;
+        CIP = 0;
+        if (_budget <= 0)
+          return error::yield;
         break;
       }
 
-    case OP_ALIGN_PRI:
-      OPERAND();
-      if (operand < cell_bytes)
-        PRI ^= (cell)(cell_bytes - operand);
-      break;
+    case OP_RETN_OVL:
+      profile_leave(FRM);
+      POP(FRM);
+      POP(operand);
+      DATA(STK);
+      STK += RESULT() + cell_bytes;
+      {
+        constexpr auto half = sizeof(cell) * 4;
+        const auto result = switch_overlay((cell)(operand & (cell)(((cell)1 << half) - 1)));
+        if (result != error::success)
+          return result;
+        CIP = (cell)(operand >> half);
+        break;
+      }
 
-    case OP_LCTRL:
+    // Jumps to the start of an overlay picked by PRI, from a table of overlay indexes. Used for state functions, the
+    // return address is still the one of the CALL_OVL.
+    case OP_SWITCH_OVL:
       OPERAND();
-      switch (operand)
       {
-      case 0:
-        PRI = COD;
+        cell casetbl = CIP - 2 * cell_bytes + operand;
+        CODEDATA(INCP(casetbl));
+        if (CODE_RESULT() != OP_CASETBL_OVL)
+          return error::invalid_operand;
+        CODEDATA(INCP(casetbl));
+        cell record_count = CODE_RESULT();
+        CODEDATA(INCP(casetbl));
+        cell index = CODE_RESULT(); // no match overlay
+        while (record_count)
+        {
+          CODEDATA(INCP(casetbl));
+          const cell test_val = CODE_RESULT();
+          CODEDATA(INCP(casetbl));
+          if (PRI == test_val)
+          {
+            index = CODE_RESULT();
+            break;
+          }
+          --record_count;
+        }
+        const auto result = switch_overlay(index);
+        if (result != error::success)
+          return result;
+        CIP = 0;
         break;
-      case 1:
-        PRI = DAT;
+      }
+
+    default:
+      return error::invalid_instruction;
+    }
+
+#undef DATA
+#undef CODEDATA
+#undef RESULT
+#undef CODE_RESULT
+#undef OPERAND
+#undef PUSH
+#undef POP
+#undef BRANCH
+
+    return error::success;
+  }
+
+  template <typename Cell, typename MemoryManager>
+  error amx<Cell, MemoryManager>::verify(const cell* code, size_t count, size_t natives, uint8_t* starts, cell& cip)
+  {
+    AMX_ASSERT(count <= (size_t)(~(cell)0) / cell_bytes);
+
+    for (size_t i = 0; i < count; ++i)
+      starts[i] = 0;
+
+    // instructions in order, each with the cells it takes
+    size_t size{};
+    for (size_t i = 0; i < count; i += size)
+    {
+      cip = (cell)(i * cell_bytes);
+      starts[i] = 1;
+      const auto opcode = code[i];
+      const auto operand = i + 1 < count ? code[i + 1] : (cell)0;
+      switch (opcode)
+      {
+      case OP_NOP:
+      case OP_LOAD_I:
+      case OP_STOR_I:
+      case OP_XCHG:
+      case OP_PUSH_PRI:
+      case OP_PUSH_ALT:
+      case OP_PUSHR_PRI:
+      case OP_POP_PRI:
+      case OP_POP_ALT:
+      case OP_PROC:
+      case OP_RET:
+      case OP_RETN:
+      case OP_SHL:
+      case OP_SHR:
+      case OP_SSHR:
+      case OP_SMUL:
+      case OP_SDIV:
+      case OP_ADD:
+      case OP_SUB:
+      case OP_AND:
+      case OP_OR:
+      case OP_XOR:
+      case OP_NOT:
+      case OP_NEG:
+      case OP_INVERT:
+      case OP_EQ:
+      case OP_NEQ:
+      case OP_SLESS:
+      case OP_SLEQ:
+      case OP_SGRTR:
+      case OP_SGEQ:
+      case OP_INC_PRI:
+      case OP_INC_ALT:
+      case OP_INC_I:
+      case OP_DEC_PRI:
+      case OP_DEC_ALT:
+      case OP_DEC_I:
+      case OP_SWAP_PRI:
+      case OP_SWAP_ALT:
+      case OP_BREAK:
+        size = 1;
         break;
-      case 2:
-        PRI = HEA;
+
+      case OP_CASETBL:
+        // record count, default address, then records of value and address
+        if (count - i < 3 || operand > (count - i - 3) / 2)
+          return error::access_violation_code;
+        size = 3 + 2 * (size_t)operand;
         break;
-      case 3:
-        PRI = STP;
+
+      case OP_LODB_I:
+      case OP_STRB_I:
+        if (i + 1 < count && operand != 1 && operand != 2 && operand != 4)
+          return error::invalid_operand;
+        size = 2;
         break;
-      case 4:
-        PRI = STK;
+
+      case OP_LCTRL:
+        if (i + 1 < count && operand > 6)
+          return error::invalid_operand;
+        size = 2;
         break;
-      case 5:
-        PRI = FRM;
+
+      case OP_SCTRL:
+        if (i + 1 < count && operand != 2 && operand != 4 && operand != 5 && operand != 6)
+          return error::invalid_operand;
+        size = 2;
         break;
-      case 6:
-        PRI = CIP;
+
+      case OP_SYSREQ:
+        if (i + 1 < count && (size_t)operand >= natives)
+          return error::invalid_operand;
+        size = 2;
         break;
+
       default:
-        return error::invalid_operand;
+        // code with overlays isn't verified
+        if (opcode > OP_CASETBL)
+          return error::invalid_instruction;
+        size = 2;
+        break;
       }
-      break;
+      if (size > count - i)
+        return error::access_violation_code;
+    }
 
-    case OP_SCTRL:
-      OPERAND();
-      switch (operand)
+    // targets, now that every instruction start is known
+    const auto lands = [&](size_t base, cell offset, bool table)
+    {
+      const auto target = (cell)((cell)(base * cell_bytes) + offset);
+      const auto index = (size_t)(target / cell_bytes);
+      return target % cell_bytes == 0 && index < count && starts[index] && (code[index] == OP_CASETBL) == table;
+    };
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (!starts[i])
+        continue;
+      cip = (cell)(i * cell_bytes);
+      switch (code[i])
       {
-      case 2:
-        HEA = PRI;
-        break;
-      case 4:
-        STK = PRI;
+      case OP_CALL:
+      case OP_JUMP:
+      case OP_JZER:
+      case OP_JNZ:
+        if (!lands(i, code[i + 1], false))
+          return error::invalid_operand;
         break;
-      case 5:
-        FRM = PRI;
+
+      case OP_SWITCH:
+        if (!lands(i, code[i + 1], true))
+          return error::invalid_operand;
         break;
-      case 6:
-        CIP = PRI;
+
+      case OP_CASETBL:
+        if (!lands(i + 1, code[i + 2], false))
+          return error::invalid_operand;
+        for (size_t k = 0; k < (size_t)code[i + 1]; ++k)
+          if (!lands(i + 3 + 2 * k, code[i + 4 + 2 * k], false))
+            return error::invalid_operand;
         break;
+
       default:
-        return error::invalid_operand;
+        break;
       }
-      break;
-
-    case OP_XCHG:
-      operand = ALT;
-      ALT = PRI;
-      PRI = operand;
-      break;
-
-    case OP_PUSH_PRI:
-      PUSH(PRI);
-      break;
-    case OP_PUSH_ALT:
-      PUSH(ALT);
-      break;
-
-    case OP_PUSHR_PRI:
-      PUSH(PRI + DAT);
-      break;
-
-    case OP_POP_PRI:
-      POP(PRI);
-      break;
-    case OP_POP_ALT:
-      POP(ALT);
-      break;
-
-    case OP_PICK:
-      OPERAND();
-      DATA(STK + operand);
-      PRI = RESULT();
-      break;
-
-    case OP_STACK:
-      OPERAND();
-      STK += operand;
-      ALT = STK;
-      break;
-
-    case OP_HEAP:
-      OPERAND();
-      ALT = HEA;
-      HEA += operand;
-      break;
-
-    case OP_PROC:
-      PUSH(FRM);
-      FRM = STK;
-      break;
+    }
+    return error::success;
+  }
 
-    case OP_RET:
-      POP(FRM);
-      POP(CIP);
-      break;
+  template <typename Cell, typename MemoryManager>
+  void amx<Cell, MemoryManager>::decode(const cell* code, size_t count, decoded_t* out, bool fuse, const uint8_t* starts)
+  {
+    decode_opcodes(code, count, out, fuse, starts);
 
-    case OP_RETN:
-      POP(FRM);
-      POP(CIP);
-      DATA(STK);
-      STK += RESULT() + cell_bytes;
-      break;
+    const void* const* labels{};
+    run_decoded(nullptr, &labels);
+    if (labels)
+      for (size_t i = 0; i <= count; ++i)
+        out[i].handler = (uintptr_t)labels[out[i].handler];
+  }
 
-    case OP_CALL:
-      OPERAND();
-      PUSH(CIP);
-      CIP = CIP - 2 * cell_bytes + operand;
-      break;
+  template <typename Cell, typename MemoryManager>
+  void amx<Cell, MemoryManager>::decode_opcodes(
+    const cell* code,
+    size_t count,
+    decoded_t* out,
+    bool fuse,
+    const uint8_t* starts
+  )
+  {
+    AMX_ASSERT(count <= (size_t)(~(cell)0) / cell_bytes);
 
-    case OP_JUMP:
-      OPERAND();
-      CIP = CIP - 2 * cell_bytes + operand;
-      break;
+    // jump target of an operand relative to the instruction at index `base`, as step() calculates it
+    const auto relative = [](size_t base, cell offset) { return (cell)((cell)(base * cell_bytes) + offset); };
+    const auto target_index = [count](cell target, cell& index)
+    {
+      if (target % cell_bytes != 0 || target / cell_bytes >= count)
+        return false;
+      index = (cell)(target / cell_bytes);
+      return true;
+    };
 
-    case OP_JZER:
-      OPERAND();
-      if (PRI == 0)
-        CIP = CIP - 2 * cell_bytes + operand;
-      break;
+    for (size_t i = 0; i < count; ++i)
+    {
+      const auto opcode = code[i];
+      const auto has_operand = i + 1 < count;
+      const auto operand = has_operand ? code[i + 1] : (cell)0;
+      auto& insn = out[i];
+      insn.handler = IOP_FALLBACK;
+      insn.operand = operand;
+      if (starts && !starts[i])
+        continue;
+
+      switch (opcode)
+      {
+      case OP_NOP:
+      case OP_LOAD_I:
+      case OP_STOR_I:
+      case OP_XCHG:
+      case OP_PUSH_PRI:
+      case OP_PUSH_ALT:
+      case OP_PUSHR_PRI:
+      case OP_POP_PRI:
+      case OP_POP_ALT:
+      case OP_PROC:
+      case OP_RET:
+      case OP_RETN:
+      case OP_SHL:
+      case OP_SHR:
+      case OP_SSHR:
+      case OP_SMUL:
+      case OP_SDIV:
+      case OP_ADD:
+      case OP_SUB:
+      case OP_AND:
+      case OP_OR:
+      case OP_XOR:
+      case OP_NOT:
+      case OP_NEG:
+      case OP_INVERT:
+      case OP_EQ:
+      case OP_NEQ:
+      case OP_SLESS:
+      case OP_SLEQ:
+      case OP_SGRTR:
+      case OP_SGEQ:
+      case OP_INC_PRI:
+      case OP_INC_ALT:
+      case OP_INC_I:
+      case OP_DEC_PRI:
+      case OP_DEC_ALT:
+      case OP_DEC_I:
+      case OP_SWAP_PRI:
+      case OP_SWAP_ALT:
+      case OP_BREAK:
+        insn.handler = opcode;
+        insn.operand = 0;
+        break;
 
-    case OP_JNZ:
-      OPERAND();
-      if (PRI != 0)
-        CIP = CIP - 2 * cell_bytes + operand;
-      break;
+      case OP_LOAD_PRI:
+      case OP_LOAD_ALT:
+      case OP_LOAD_S_PRI:
+      case OP_LOAD_S_ALT:
+      case OP_LREF_S_PRI:
+      case OP_LREF_S_ALT:
+      case OP_CONST_PRI:
+      case OP_CONST_ALT:
+      case OP_ADDR_PRI:
+      case OP_ADDR_ALT:
+      case OP_STOR:
+      case OP_STOR_S:
+      case OP_SREF_S:
+      case OP_PICK:
+      case OP_STACK:
+      case OP_HEAP:
+      case OP_SHL_C_PRI:
+      case OP_SHL_C_ALT:
+      case OP_MOVS:
+      case OP_CMPS:
+      case OP_FILL:
+      case OP_HALT:
+      case OP_BOUNDS:
+      case OP_SYSREQ:
+      case OP_SWITCH: // resolved once case tables are known
+        if (has_operand)
+          insn.handler = opcode;
+        break;
 
-    case OP_SHL:
-      PRI <<= ALT;
-      break;
+      case OP_LODB_I:
+      case OP_STRB_I:
+        if (has_operand && (operand == 1 || operand == 2 || operand == 4))
+          insn.handler = opcode;
+        break;
 
-    case OP_SHR:
-      PRI >>= ALT;
-      break;
+      case OP_ALIGN_PRI:
+        if (has_operand)
+        {
+          insn.handler = opcode;
+          insn.operand = operand < cell_bytes ? (cell)(cell_bytes - operand) : (cell)0; // value to xor with
+        }
+        break;
 
-    case OP_SSHR:
-      PRI = (cell)((scell)PRI >> ALT); // not implementation defined since C++20.
-      break;
+      case OP_LCTRL:
+        if (has_operand && operand <= 6)
+          insn.handler = opcode;
+        break;
 
-    case OP_SHL_C_PRI:
-      OPERAND();
-      PRI <<= operand;
-      break;
+      case OP_SCTRL:
+        if (has_operand && (operand == 2 || operand == 4 || operand == 5 || operand == 6))
+          insn.handler = opcode;
+        break;
 
-    case OP_SHL_C_ALT:
-      OPERAND();
-      ALT <<= operand;
-      break;
+      case OP_CALL:
+      case OP_JUMP:
+      case OP_JZER:
+      case OP_JNZ:
+        if (has_operand && target_index(relative(i, operand), insn.operand))
+          insn.handler = opcode;
+        break;
 
-    case OP_SMUL:
-      PRI = (cell)((scell)PRI * (scell)ALT);
-      break;
+      case OP_CASETBL:
+        insn.handler = IOP_CASETBL;
+        break;
 
-    case OP_SDIV:
-      if (PRI == 0)
-        return error::division_with_zero;
-      operand = PRI;
-      PRI = (cell)((scell)ALT / (scell)operand);
-      ALT = (cell)((scell)ALT % (scell)operand);
-      if (ALT != 0 && (scell)(ALT ^ operand) < 0) {
-        --PRI;
-        ALT += operand;
+      default:
+        break;
       }
-      break;
-
-    case OP_ADD:
-      PRI += ALT;
-      break;
+    }
 
-    case OP_SUB:
-      PRI = ALT - PRI;
-      break;
+    // CIP 0 is where the return address pushed by call_raw points
+    out[0] = { IOP_EXIT, 0 };
+    out[count] = { IOP_FALLBACK, 0 };
 
-    case OP_AND:
-      PRI &= ALT;
-      break;
+    // Resolve case tables into the entries of the cells they occupy. Those entries are not executable at their
+    // original address anymore so they get handed to step(). Going in ascending order means a table that is data of
+    // an earlier one is never considered, so the tables can't overlap.
+    for (size_t t = 0; t < count; ++t)
+    {
+      // CASETBL, record count, default address, then records of value and address
+      if (out[t].handler != IOP_CASETBL)
+        continue;
+      out[t].handler = IOP_FALLBACK;
+      if (t + 2 >= count)
+        continue;
+      const auto records = code[t + 1];
+      if (records > (count - t - 3) / 2)
+        continue;
+      cell default_index{};
+      if (!target_index(relative(t + 1, code[t + 2]), default_index))
+        continue;
+      bool valid = true;
+      for (size_t k = 0; valid && k < records; ++k)
+      {
+        cell index{};
+        valid = target_index(relative(t + 3 + 2 * k, code[t + 4 + 2 * k]), index);
+      }
+      if (!valid)
+        continue;
 
-    case OP_OR:
-      PRI |= ALT;
-      break;
+      out[t] = { IOP_CASETBL, records };
+      out[t + 1] = { IOP_CASEDATA, default_index };
+      out[t + 2] = { IOP_CASEDATA, 0 };
+      for (size_t k = 0; k < records; ++k)
+      {
+        cell index{};
+        target_index(relative(t + 3 + 2 * k, code[t + 4 + 2 * k]), index);
+        out[t + 3 + 2 * k] = { IOP_CASEDATA, code[t + 3 + 2 * k] };
+        out[t + 4 + 2 * k] = { IOP_CASEDATA, index };
+      }
 
-    case OP_XOR:
-      PRI ^= ALT;
-      break;
+      // Sort the records by value for binary search, dropping duplicates that could never match. Stable, so the first
+      // record of a value stays like with a linear scan. The compiler already emits them sorted, so this is ~linear.
+      const auto record = out + t + 3;
+      for (size_t k = 1; k < records; ++k)
+      {
+        const auto value = record[2 * k];
+        const auto index = record[2 * k + 1];
+        size_t j = k;
+        for (; j > 0 && record[2 * (j - 1)].operand > value.operand; --j)
+        {
+          record[2 * j] = record[2 * (j - 1)];
+          record[2 * j + 1] = record[2 * (j - 1) + 1];
+        }
+        record[2 * j] = value;
+        record[2 * j + 1] = index;
+      }
+      size_t unique = 0;
+      for (size_t k = 0; k < records; ++k)
+      {
+        if (unique && record[2 * (unique - 1)].operand == record[2 * k].operand)
+          continue;
+        record[2 * unique] = record[2 * k];
+        record[2 * unique + 1] = record[2 * k + 1];
+        ++unique;
+      }
+      out[t].operand = (cell)unique;
+    }
 
-    case OP_NOT:
-      PRI = !PRI;
-      break;
+    for (size_t i = 0; i < count; ++i)
+    {
+      auto& insn = out[i];
+      if (insn.handler != OP_SWITCH)
+        continue;
+      cell table{};
+      if (!target_index(relative(i, code[i + 1]), table) || out[table].handler != IOP_CASETBL)
+      {
+        insn.handler = IOP_FALLBACK;
+        continue;
+      }
+      insn.operand = table;
+      // values without gaps are looked up by their distance from the first one
+      const auto records = (size_t)out[table].operand;
+      const auto record = out + table + 3;
+      if (records && (cell)(record[2 * (records - 1)].operand - record[0].operand) == (cell)(records - 1))
+        insn.handler = IOP_SWITCH_DENSE;
+    }
 
-    case OP_NEG:
-      PRI = (cell)-(scell)PRI;
-      break;
+    // The instructions after the first one keep their own entries, so jumping into the middle of a sequence still works.
+    for (size_t i = 0; fuse && i < count; ++i)
+    {
+      auto& insn = out[i];
+      // out[count] is a fallback, so looking one or two entries ahead is fine
+      switch (insn.handler)
+      {
+      case OP_LOAD_S_PRI:
+        if (out[i + 2].handler == OP_PUSH_PRI)
+          insn.handler = IOP_LOAD_S_PUSH_PRI;
+        break;
+      case OP_CONST_PRI:
+        if (out[i + 2].handler == OP_PUSH_PRI)
+          insn.handler = IOP_CONST_PUSH_PRI;
+        break;
+      case OP_PROC:
+        if (out[i + 1].handler == OP_STACK)
+          insn.handler = IOP_PROC_STACK;
+        break;
+      case OP_EQ:
+      case OP_NEQ:
+      case OP_SLESS:
+      case OP_SLEQ:
+      case OP_SGRTR:
+      case OP_SGEQ:
+        if (out[i + 1].handler == OP_JZER)
+          insn.handler = IOP_EQ_JZER + (insn.handler - OP_EQ);
+        break;
+      default:
+        break;
+      }
+    }
+  }
 
-    case OP_INVERT:
-      PRI = ~PRI;
-      break;
+  template <typename Cell, typename MemoryManager>
+  error amx<Cell, MemoryManager>::run_decoded(amx* self, const void* const** labels_out)
+  {
+#if AMX_COMPUTED_GOTO
+    static const void* const labels[IOP_NUM_OPCODES] = {
+      &&L_OP_NOP, &&L_OP_LOAD_PRI, &&L_OP_LOAD_ALT, &&L_OP_LOAD_S_PRI, &&L_OP_LOAD_S_ALT, &&L_OP_LREF_S_PRI,
+      &&L_OP_LREF_S_ALT, &&L_OP_LOAD_I, &&L_OP_LODB_I, &&L_OP_CONST_PRI, &&L_OP_CONST_ALT, &&L_OP_ADDR_PRI,
+      &&L_OP_ADDR_ALT, &&L_OP_STOR, &&L_OP_STOR_S, &&L_OP_SREF_S, &&L_OP_STOR_I, &&L_OP_STRB_I, &&L_OP_ALIGN_PRI,
+      &&L_OP_LCTRL, &&L_OP_SCTRL, &&L_OP_XCHG, &&L_OP_PUSH_PRI, &&L_OP_PUSH_ALT, &&L_OP_PUSHR_PRI, &&L_OP_POP_PRI,
+      &&L_OP_POP_ALT, &&L_OP_PICK, &&L_OP_STACK, &&L_OP_HEAP, &&L_OP_PROC, &&L_OP_RET, &&L_OP_RETN, &&L_OP_CALL,
+      &&L_OP_JUMP, &&L_OP_JZER, &&L_OP_JNZ, &&L_OP_SHL, &&L_OP_SHR, &&L_OP_SSHR, &&L_OP_SHL_C_PRI, &&L_OP_SHL_C_ALT,
+      &&L_OP_SMUL, &&L_OP_SDIV, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_AND, &&L_OP_OR, &&L_OP_XOR, &&L_OP_NOT, &&L_OP_NEG,
+      &&L_OP_INVERT, &&L_OP_EQ, &&L_OP_NEQ, &&L_OP_SLESS, &&L_OP_SLEQ, &&L_OP_SGRTR, &&L_OP_SGEQ, &&L_OP_INC_PRI,
+      &&L_OP_INC_ALT, &&L_OP_INC_I, &&L_OP_DEC_PRI, &&L_OP_DEC_ALT, &&L_OP_DEC_I, &&L_OP_MOVS,
+      &&L_OP_CMPS, &&L_OP_FILL, &&L_OP_HALT, &&L_OP_BOUNDS, &&L_OP_SYSREQ,
+      &&L_OP_SWITCH, &&L_OP_SWAP_PRI, &&L_OP_SWAP_ALT, &&L_OP_BREAK, &&L_IOP_FALLBACK /* CASETBL */,
+      &&L_IOP_FALLBACK /* SYSREQ_D */, &&L_IOP_FALLBACK /* SYSREQ_ND */, &&L_IOP_FALLBACK /* CALL_OVL */,
+      &&L_IOP_FALLBACK /* RETN_OVL */, &&L_IOP_FALLBACK /* SWITCH_OVL */, &&L_IOP_FALLBACK /* CASETBL_OVL */,
+      &&L_IOP_FALLBACK, &&L_IOP_EXIT, &&L_IOP_CASETBL, &&L_IOP_CASEDATA,
+      &&L_IOP_SWITCH_DENSE, &&L_IOP_LOAD_S_PUSH_PRI, &&L_IOP_CONST_PUSH_PRI, &&L_IOP_PROC_STACK, &&L_IOP_EQ_JZER,
+      &&L_IOP_NEQ_JZER, &&L_IOP_SLESS_JZER, &&L_IOP_SLEQ_JZER, &&L_IOP_SGRTR_JZER, &&L_IOP_SGEQ_JZER
+    };
+    if (labels_out)
+    {
+      *labels_out = labels;
+      return error::success;
+    }
+#define TARGET(op) L_##op
+#define DISPATCH() do { --budget; PROFILE_HIT(0); goto *(const void*)ip->handler; } while(0)
+#else
+    if (labels_out)
+    {
+      *labels_out = nullptr;
+      return error::success;
+    }
+#define TARGET(op) case op
+#define DISPATCH() do { --budget; PROFILE_HIT(0); goto dispatch; } while(0)
+#endif
+#if AMX_PROFILE
+#define PROFILE_HIT(n) self->profile_hit(CIP_AFTER(n))
+#else
+#define PROFILE_HIT(n) (void)0
+#endif
+
+    const auto base = self->_decoded;
+    const auto count = self->_decoded_count;
+
+    if (self->CIP % cell_bytes != 0 || self->CIP / cell_bytes >= count)
+      return error::success;
 
-    case OP_EQ:
-      PRI = (cell)(PRI == ALT);
-      break;
+    const decoded_t* ip = base + self->CIP / cell_bytes;
+    cell pri = self->PRI;
+    cell alt = self->ALT;
+    cell frm = self->FRM;
+    cell stk = self->STK;
+    int64_t budget = self->_budget;
+    cell target{};
+    cell* p{};
+
+    // registers other than CIP are kept in locals, and only written back when something else might look at them
+#define CIP_AFTER(n) ((cell)((size_t)(ip - base + (n)) * cell_bytes))
+#define SYNC_AT(cip) do {\
+    self->PRI = pri; self->ALT = alt; self->FRM = frm; self->STK = stk; self->CIP = (cip); self->_budget = budget;\
+  } while(0)
+#define SYNC(n) SYNC_AT(CIP_AFTER(n))
+#define FAULT_AT(e, cip) do { SYNC_AT(cip); return (e); } while(0)
+#define FAULT(e, n) FAULT_AT(e, CIP_AFTER(n))
+#define NEXT(n) do { ip += (n); DISPATCH(); } while(0)
+#define JUMP_INDEX(i) do { ip = base + (i); DISPATCH(); } while(0)
+#define BRANCH_INDEX(i) do {\
+    const auto _branch_from = ip;\
+    ip = base + (i);\
+    if (ip <= _branch_from && budget <= 0) FAULT(error::yield, 0);\
+    DISPATCH();\
+  } while(0)
+#define JUMP_CIP(cip) do {\
+    const cell _jump_tmp = (cip);\
+    if (_jump_tmp % cell_bytes != 0 || _jump_tmp / cell_bytes >= count) { SYNC_AT(_jump_tmp); return error::success; }\
+    JUMP_INDEX(_jump_tmp / cell_bytes);\
+  } while(0)
 
-    case OP_NEQ:
-      PRI = (cell)(PRI != ALT);
-      break;
+#define DATA(v, n) do { p = self->data_v2p(v); if(!p) FAULT(error::access_violation, n); } while(0)
 
-    case OP_SLESS:
-      PRI = (cell)((scell)PRI < (scell)ALT);
-      break;
+#define PUSH(v, n) do {\
+    stk -= cell_bytes;\
+    cell _push_tmp1 = v;\
+    cell* _push_tmp2 = self->data_v2p(stk);\
+    if(!_push_tmp2) FAULT(error::access_violation, n);\
+    *_push_tmp2 = _push_tmp1;\
+  } while(0)
 
-    case OP_SLEQ:
-      PRI = (cell)((scell)PRI <= (scell)ALT);
-      break;
+#define POP(v, n) do {\
+    cell& _pop_tmp1 = v;\
+    cell* _pop_tmp2 = self->data_v2p(stk);\
+    if(!_pop_tmp2) FAULT(error::access_violation, n);\
+    _pop_tmp1 = *_pop_tmp2;\
+    stk += cell_bytes;\
+  } while(0)
 
-    case OP_SGRTR:
-      PRI = (cell)((scell)PRI > (scell)ALT);
-      break;
+    DISPATCH();
 
-    case OP_SGEQ:
-      PRI = (cell)((scell)PRI >= (scell)ALT);
-      break;
+#if !AMX_COMPUTED_GOTO
+  dispatch:
+    switch (ip->handler)
+    {
+    default:
+#endif
+    TARGET(IOP_FALLBACK):
+    TARGET(IOP_CASETBL):
+    TARGET(IOP_CASEDATA):
+      ++budget; // counted by step()
+      self->profile_unhit(CIP_AFTER(0));
+      SYNC(0);
+      return error::success;
 
-    case OP_INC_PRI:
-      ++PRI;
-      break;
-    case OP_INC_ALT:
-      ++ALT;
-      break;
+    TARGET(IOP_EXIT):
+      ++budget; // not an instruction
+      self->profile_unhit(CIP_AFTER(0));
+      SYNC_AT((cell)0);
+      return error::success;
 
-    case OP_INC_I:
-      DATA(PRI);
-      ++RESULT();
-      break;
+    TARGET(OP_NOP):
+      NEXT(1);
+
+    TARGET(OP_LOAD_PRI):
+      DATA(ip->operand, 2);
+      pri = *p;
+      NEXT(2);
+    TARGET(OP_LOAD_ALT):
+      DATA(ip->operand, 2);
+      alt = *p;
+      NEXT(2);
+
+    TARGET(OP_LOAD_S_PRI):
+      DATA(frm + ip->operand, 2);
+      pri = *p;
+      NEXT(2);
+    TARGET(OP_LOAD_S_ALT):
+      DATA(frm + ip->operand, 2);
+      alt = *p;
+      NEXT(2);
+
+    TARGET(OP_LREF_S_PRI):
+      DATA(frm + ip->operand, 2);
+      DATA(*p, 2);
+      pri = *p;
+      NEXT(2);
+    TARGET(OP_LREF_S_ALT):
+      DATA(frm + ip->operand, 2);
+      DATA(*p, 2);
+      alt = *p;
+      NEXT(2);
+
+    TARGET(OP_LOAD_I):
+      DATA(pri, 1);
+      pri = *p;
+      NEXT(1);
+
+    TARGET(OP_LODB_I):
+    {
+      constexpr static auto subcell_mask = (cell)misalign_mask;
+      const auto aligned = (cell)(pri & ~subcell_mask);
+      const auto subcell_bits = (cell)((pri & subcell_mask) * 8);
+      if (aligned != ((pri + ip->operand - 1) & ~subcell_mask))
+        FAULT(error::invalid_operand, 2);
+      DATA(aligned, 2);
+      if (ip->operand == 1)
+        pri = (*p >> subcell_bits) & 0xFF;
+      else if (ip->operand == 2)
+        pri = (*p >> subcell_bits) & 0xFFFF;
+      else
+        pri = (*p >> subcell_bits) & 0xFFFFFFFF;
+      NEXT(2);
+    }
 
-    case OP_DEC_PRI:
-      --PRI;
-      break;
-    case OP_DEC_ALT:
-      --ALT;
-      break;
+    TARGET(OP_CONST_PRI):
+      pri = ip->operand;
+      NEXT(2);
+    TARGET(OP_CONST_ALT):
+      alt = ip->operand;
+      NEXT(2);
+
+    TARGET(OP_ADDR_PRI):
+      pri = frm + ip->operand;
+      NEXT(2);
+    TARGET(OP_ADDR_ALT):
+      alt = frm + ip->operand;
+      NEXT(2);
+
+    TARGET(OP_STOR):
+      DATA(ip->operand, 2);
+      *p = pri;
+      NEXT(2);
+
+    TARGET(OP_STOR_S):
+      DATA(frm + ip->operand, 2);
+      *p = pri;
+      NEXT(2);
+
+    TARGET(OP_SREF_S):
+      DATA(frm + ip->operand, 2);
+      DATA(*p, 2);
+      *p = pri;
+      NEXT(2);
+
+    TARGET(OP_STOR_I):
+      DATA(alt, 1);
+      *p = pri;
+      NEXT(1);
+
+    TARGET(OP_STRB_I):
+    {
+      constexpr static auto subcell_mask = (cell)misalign_mask;
+      const auto aligned = (cell)(alt & ~subcell_mask);
+      const auto subcell_bits = (cell)((alt & subcell_mask) * 8);
+      if (aligned != ((alt + ip->operand - 1) & ~subcell_mask))
+        FAULT(error::invalid_operand, 2);
+      DATA(aligned, 2);
+      if (ip->operand == 1)
+        *p = (cell)((*p & ~((cell)0xFF << subcell_bits)) | ((pri & 0xFF) << subcell_bits));
+      else if (ip->operand == 2)
+        *p = (cell)((*p & ~((cell)0xFFFF << subcell_bits)) | ((pri & 0xFFFF) << subcell_bits));
+      else
+        *p = (cell)((*p & ~((cell)0xFFFFFFFF << subcell_bits)) | ((pri & 0xFFFFFFFF) << subcell_bits));
+      NEXT(2);
+    }
 
-    case OP_DEC_I:
-      DATA(PRI);
-      --RESULT();
-      break;
+    TARGET(OP_ALIGN_PRI):
+      pri ^= ip->operand;
+      NEXT(2);
 
-    case OP_MOVS:
-      OPERAND();
-      for (cell i = 0; i < operand; i += cell_bytes)
+    TARGET(OP_LCTRL):
+      switch (ip->operand)
       {
-        DATA(PRI + i);
-        cell tmp = RESULT();
-        DATA(ALT + i);
-        RESULT() = tmp;
+      case 0:
+        pri = self->COD;
+        break;
+      case 1:
+        pri = self->DAT;
+        break;
+      case 2:
+        pri = self->HEA;
+        break;
+      case 3:
+        pri = self->STP;
+        break;
+      case 4:
+        pri = stk;
+        break;
+      case 5:
+        pri = frm;
+        break;
+      default:
+        pri = CIP_AFTER(2);
+        break;
       }
-      break;
+      NEXT(2);
 
-    case OP_CMPS:
-      OPERAND();
-      PRI = 0;
-      for (cell i = 0; PRI == 0 && i < operand; i += cell_bytes)
+    TARGET(OP_SCTRL):
+      switch (ip->operand)
       {
-        DATA(PRI + i);
-        cell tmp = RESULT();
-        DATA(ALT + i);
-        PRI = RESULT() - tmp;
+      case 2:
+        self->HEA = pri;
+        break;
+      case 4:
+        stk = pri;
+        break;
+      case 5:
+        frm = pri;
+        break;
+      default:
+        JUMP_CIP(pri);
       }
-      break;
-
-    case OP_FILL:
-      OPERAND();
-      for (cell i = 0; i < operand; i += cell_bytes)
+      NEXT(2);
+
+    TARGET(OP_XCHG):
+      target = alt;
+      alt = pri;
+      pri = target;
+      NEXT(1);
+
+    TARGET(OP_PUSH_PRI):
+      PUSH(pri, 1);
+      NEXT(1);
+    TARGET(OP_PUSH_ALT):
+      PUSH(alt, 1);
+      NEXT(1);
+
+    TARGET(OP_PUSHR_PRI):
+      PUSH(pri + self->DAT, 1);
+      NEXT(1);
+
+    TARGET(OP_POP_PRI):
+      POP(pri, 1);
+      NEXT(1);
+    TARGET(OP_POP_ALT):
+      POP(alt, 1);
+      NEXT(1);
+
+    TARGET(OP_PICK):
+      DATA(stk + ip->operand, 2);
+      pri = *p;
+      NEXT(2);
+
+    TARGET(OP_STACK):
+      stk += ip->operand;
+      alt = stk;
+      if (self->collides(stk, self->HEA))
+        FAULT(error::stack_heap_collision, 2);
+      NEXT(2);
+
+    TARGET(OP_HEAP):
+      alt = self->HEA;
+      self->HEA += ip->operand;
+      if (self->collides(stk, self->HEA))
+        FAULT(error::stack_heap_collision, 2);
+      NEXT(2);
+
+    TARGET(OP_PROC):
+      if (self->collides(stk, self->HEA))
+        FAULT(error::stack_heap_collision, 1);
+      PUSH(frm, 1);
+      frm = stk;
+      self->profile_enter(CIP_AFTER(0), frm);
+      NEXT(1);
+
+    TARGET(OP_RET):
+      self->profile_leave(frm);
+      POP(frm, 1);
+      POP(target, 1);
+      JUMP_CIP(target);
+
+    TARGET(OP_RETN):
+      self->profile_leave(frm);
+      POP(frm, 1);
+      POP(target, 1);
+      p = self->data_v2p(stk);
+      if (!p)
+        FAULT_AT(error::access_violation, target);
+      stk += *p + cell_bytes;
+      JUMP_CIP(target);
+
+    TARGET(OP_CALL):
+      PUSH(CIP_AFTER(2), 2);
+      ip = base + ip->operand;
+      if (budget <= 0)
+        FAULT(error::yield, 0);
+      DISPATCH();
+
+    TARGET(OP_JUMP):
+      BRANCH_INDEX(ip->operand);
+
+    TARGET(OP_JZER):
+      if (pri == 0)
+        BRANCH_INDEX(ip->operand);
+      NEXT(2);
+
+    TARGET(OP_JNZ):
+      if (pri != 0)
+        BRANCH_INDEX(ip->operand);
+      NEXT(2);
+
+    TARGET(OP_SHL):
+      pri <<= alt;
+      NEXT(1);
+
+    TARGET(OP_SHR):
+      pri >>= alt;
+      NEXT(1);
+
+    TARGET(OP_SSHR):
+      pri = (cell)((scell)pri >> alt);
+      NEXT(1);
+
+    TARGET(OP_SHL_C_PRI):
+      pri <<= ip->operand;
+      NEXT(2);
+
+    TARGET(OP_SHL_C_ALT):
+      alt <<= ip->operand;
+      NEXT(2);
+
+    TARGET(OP_SMUL):
+      pri = (cell)((scell)pri * (scell)alt);
+      NEXT(1);
+
+    TARGET(OP_SDIV):
+      if (pri == 0)
+        FAULT(error::division_with_zero, 1);
+      target = pri;
+      pri = (cell)((scell)alt / (scell)target);
+      alt = (cell)((scell)alt % (scell)target);
+      if (alt != 0 && (scell)(alt ^ target) < 0) {
+        --pri;
+        alt += target;
+      }
+      NEXT(1);
+
+    TARGET(OP_ADD):
+      pri += alt;
+      NEXT(1);
+
+    TARGET(OP_SUB):
+      pri = alt - pri;
+      NEXT(1);
+
+    TARGET(OP_AND):
+      pri &= alt;
+      NEXT(1);
+
+    TARGET(OP_OR):
+      pri |= alt;
+      NEXT(1);
+
+    TARGET(OP_XOR):
+      pri ^= alt;
+      NEXT(1);
+
+    TARGET(OP_NOT):
+      pri = !pri;
+      NEXT(1);
+
+    TARGET(OP_NEG):
+      pri = (cell)-(scell)pri;
+      NEXT(1);
+
+    TARGET(OP_INVERT):
+      pri = ~pri;
+      NEXT(1);
+
+    TARGET(OP_EQ):
+      pri = (cell)(pri == alt);
+      NEXT(1);
+
+    TARGET(OP_NEQ):
+      pri = (cell)(pri != alt);
+      NEXT(1);
+
+    TARGET(OP_SLESS):
+      pri = (cell)((scell)pri < (scell)alt);
+      NEXT(1);
+
+    TARGET(OP_SLEQ):
+      pri = (cell)((scell)pri <= (scell)alt);
+      NEXT(1);
+
+    TARGET(OP_SGRTR):
+      pri = (cell)((scell)pri > (scell)alt);
+      NEXT(1);
+
+    TARGET(OP_SGEQ):
+      pri = (cell)((scell)pri >= (scell)alt);
+      NEXT(1);
+
+    TARGET(OP_INC_PRI):
+      ++pri;
+      NEXT(1);
+    TARGET(OP_INC_ALT):
+      ++alt;
+      NEXT(1);
+
+    TARGET(OP_INC_I):
+      DATA(pri, 1);
+      ++*p;
+      NEXT(1);
+
+    TARGET(OP_DEC_PRI):
+      --pri;
+      NEXT(1);
+    TARGET(OP_DEC_ALT):
+      --alt;
+      NEXT(1);
+
+    TARGET(OP_DEC_I):
+      DATA(pri, 1);
+      --*p;
+      NEXT(1);
+
+    TARGET(OP_MOVS):
       {
-        DATA(ALT + i);
-        RESULT() = PRI;
+        const auto result = self->data_move(alt, pri, ip->operand);
+        if (result != error::success)
+          FAULT(result, 2);
       }
-      break;
-
-    case OP_HALT:
-      OPERAND();
-      PRI = operand;
-      return error::halt;
+      NEXT(2);
 
-    case OP_BOUNDS:
-      OPERAND();
-      if (PRI > operand)
-        return error::bounds;
-      break;
-
-    case OP_SYSREQ:
-      OPERAND();
+    TARGET(OP_CMPS):
       {
-        const auto result = fire_callback(operand);
+        const auto result = self->data_compare(alt, pri, ip->operand, pri);
         if (result != error::success)
-          return result;
-        break;
+          FAULT(result, 2);
       }
+      NEXT(2);
 
-    case OP_SWITCH:
-      OPERAND();
+    TARGET(OP_FILL):
       {
-        cell casetbl = CIP - 2 * cell_bytes + operand;
-        CODEDATA(INCP(casetbl));
-        if (RESULT() != OP_CASETBL)
-          return error::invalid_operand;
-        CODEDATA(INCP(casetbl));
-        cell record_count = RESULT();
-        CODEDATA(INCP(casetbl));
-        CIP = casetbl - cell_bytes * 2 + RESULT(); // no match cip
-        while (record_count)
-        {
-          CODEDATA(INCP(casetbl));
-          const cell test_val = RESULT();
-          CODEDATA(INCP(casetbl));
-          cell match_cip = RESULT();
-          if (PRI == test_val)
-          {
-            CIP = casetbl - cell_bytes * 2 + match_cip;
-            break;
-          }
-          --record_count;
-        }
-        break;
+        const auto result = self->data_fill(alt, pri, ip->operand);
+        if (result != error::success)
+          FAULT(result, 2);
       }
+      NEXT(2);
 
-    case OP_SWAP_PRI:
-      DATA(STK);
-      operand = RESULT();
-      RESULT() = PRI;
-      PRI = operand;
-      break;
+    TARGET(OP_HALT):
+      if (ip->operand == halt_sleep)
+        FAULT(error::sleep, 2);
+      pri = ip->operand;
+      FAULT(error::halt, 2);
 
-    case OP_SWAP_ALT:
-      DATA(STK);
-      operand = RESULT();
-      RESULT() = ALT;
-      ALT = operand;
-      break;
+    TARGET(OP_BOUNDS):
+      if (pri > ip->operand)
+        FAULT(error::bounds, 2);
+      NEXT(2);
 
-    case OP_BREAK:
+    TARGET(OP_SYSREQ):
     {
-      const auto result = fire_callback(cbid_break);
+      SYNC(2);
+      const auto result = self->fire_native(ip->operand);
       if (result != error::success)
         return result;
-      break;
+      // a call made by the native may have switched overlays, and with them the stream
+      if (self->_decoded != base)
+        return error::success;
+      pri = self->PRI;
+      budget = self->_budget;
+      NEXT(2);
     }
 
-    default:
-      return error::invalid_instruction;
+    TARGET(OP_SWITCH):
+    {
+      // records are sorted by value
+      const auto table = base + ip->operand;
+      const auto record = table + 3;
+      size_t lo = 0;
+      size_t hi = (size_t)table[0].operand;
+      while (lo < hi)
+      {
+        const auto mid = lo + (hi - lo) / 2;
+        if (record[2 * mid].operand < pri)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      target = lo < (size_t)table[0].operand && record[2 * lo].operand == pri
+        ? record[2 * lo + 1].operand
+        : table[1].operand; // no match
+      JUMP_INDEX(target);
+    }
+
+    // Superinstructions. Each instruction after the first counts against the budget, and faults report the CIP the
+    // unfused instruction would have.
+    TARGET(IOP_LOAD_S_PUSH_PRI):
+      DATA(frm + ip->operand, 2);
+      pri = *p;
+      --budget;
+      PROFILE_HIT(2);
+      PUSH(pri, 3);
+      NEXT(3);
+
+    TARGET(IOP_CONST_PUSH_PRI):
+      pri = ip->operand;
+      --budget;
+      PROFILE_HIT(2);
+      PUSH(pri, 3);
+      NEXT(3);
+
+    TARGET(IOP_PROC_STACK):
+      if (self->collides(stk, self->HEA))
+        FAULT(error::stack_heap_collision, 1);
+      PUSH(frm, 1);
+      frm = stk;
+      self->profile_enter(CIP_AFTER(0), frm);
+      --budget;
+      PROFILE_HIT(1);
+      stk += ip[1].operand;
+      alt = stk;
+      if (self->collides(stk, self->HEA))
+        FAULT(error::stack_heap_collision, 3);
+      NEXT(3);
+
+#define COMPARE_JZER(op, expr) \
+    TARGET(op):\
+      pri = (cell)(expr);\
+      --budget;\
+      PROFILE_HIT(1);\
+      ip += 1;\
+      if (pri == 0)\
+        BRANCH_INDEX(ip->operand);\
+      NEXT(2);
+
+    COMPARE_JZER(IOP_EQ_JZER, pri == alt)
+    COMPARE_JZER(IOP_NEQ_JZER, pri != alt)
+    COMPARE_JZER(IOP_SLESS_JZER, (scell)pri < (scell)alt)
+    COMPARE_JZER(IOP_SLEQ_JZER, (scell)pri <= (scell)alt)
+    COMPARE_JZER(IOP_SGRTR_JZER, (scell)pri > (scell)alt)
+    COMPARE_JZER(IOP_SGEQ_JZER, (scell)pri >= (scell)alt)
+
+#undef COMPARE_JZER
+
+    TARGET(IOP_SWITCH_DENSE):
+    {
+      const auto table = base + ip->operand;
+      const auto record = table + 3;
+      const auto k = (cell)(pri - record[0].operand);
+      target = k < table[0].operand ? record[2 * (size_t)k + 1].operand : table[1].operand;
+      JUMP_INDEX(target);
     }
 
+    TARGET(OP_SWAP_PRI):
+      DATA(stk, 1);
+      target = *p;
+      *p = pri;
+      pri = target;
+      NEXT(1);
+
+    TARGET(OP_SWAP_ALT):
+      DATA(stk, 1);
+      target = *p;
+      *p = alt;
+      alt = target;
+      NEXT(1);
+
+    TARGET(OP_BREAK):
+    {
+      SYNC(1);
+      const auto result = self->fire_callback(cbid_break);
+      if (result != error::success)
+        return result;
+      pri = self->PRI;
+      budget = self->_budget;
+      NEXT(1);
+    }
+#if !AMX_COMPUTED_GOTO
+    }
+#endif
+
+#undef TARGET
+#undef DISPATCH
+#undef PROFILE_HIT
+#undef CIP_AFTER
+#undef SYNC_AT
+#undef SYNC
+#undef FAULT_AT
+#undef FAULT
+#undef NEXT
+#undef JUMP_INDEX
+#undef BRANCH_INDEX
+#undef JUMP_CIP
 #undef DATA
-#undef CODEDATA
-#undef RESULT
-#undef OPERAND
 #undef PUSH
 #undef POP
-
-    return error::success;
   }
 }
-
@@ -0,0 +1,267 @@
+//  This Source Code Form is subject to the terms of the Mozilla Public
+//  License, v. 2.0. If a copy of the MPL was not distributed with this
+//  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#pragma once
+#include "amx.h"
+
+#if defined(_WIN32)
+#if !defined(_MSC_VER)
+#error "the guarded reservation backing needs structured exception handling on Windows"
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <csetjmp>
+#include <csignal>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace amx
+{
+  namespace detail
+  {
+#if !defined(_WIN32)
+    // A guarded_run() in progress on this thread, innermost first.
+    struct fault_guard
+    {
+      uintptr_t lo;
+      uintptr_t hi;
+      sigjmp_buf env;
+      fault_guard* outer;
+    };
+
+    inline fault_guard*& current_fault_guard()
+    {
+      static thread_local fault_guard* guard{};
+      return guard;
+    }
+
+    inline struct sigaction& previous_fault_action(int sig)
+    {
+      static struct sigaction segv{};
+      static struct sigaction bus{};
+      return sig == SIGSEGV ? segv : bus;
+    }
+
+    inline void fault_handler(int sig, siginfo_t* info, void* context)
+    {
+      const auto addr = (uintptr_t)info->si_addr;
+      for (auto guard = current_fault_guard(); guard; guard = guard->outer)
+        if (addr >= guard->lo && addr < guard->hi)
+          siglongjmp(guard->env, 1);
+
+      // not in a reservation, leave it to whoever had the signal before
+      const auto& previous = previous_fault_action(sig);
+      if (previous.sa_flags & SA_SIGINFO)
+      {
+        previous.sa_sigaction(sig, info, context);
+      }
+      else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+      {
+        previous.sa_handler(sig);
+      }
+      else
+      {
+        // the access is retried on return, and kills the process as it would have without us
+        signal(sig, SIG_DFL);
+      }
+    }
+
+    inline void install_fault_handler()
+    {
+      static const bool installed = []
+      {
+        struct sigaction action{};
+        action.sa_sigaction = &fault_handler;
+        // no longjmp out of the handler restores the signal mask, so don't let it block the next fault
+        action.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous_fault_action(SIGSEGV));
+        sigaction(SIGBUS, &action, &previous_fault_action(SIGBUS));
+        return true;
+      }();
+      (void)installed;
+    }
+#endif
+
+    template <typename Cell, size_t ValidBits>
+    class memory_backing_guarded_reservation
+    {
+      DEFINE_CELL_MEMBERS(Cell);
+
+      constexpr static size_t valid_bits = ValidBits < cell_bits ? ValidBits : cell_bits;
+      constexpr static cell offset_mask = (cell)(((uint64_t)1 << valid_bits) - 1);
+      constexpr static cell offset_mask_align = offset_mask & ~(cell)misalign_mask;
+      constexpr static size_t reserved_bytes = (size_t)1 << valid_bits;
+
+      static_assert(valid_bits < std::numeric_limits<uintptr_t>::digits, "reservation bigger than the host address space");
+
+      uint8_t* _base{};
+      // committed bytes
+      size_t _size{};
+
+      static size_t page_size()
+      {
+#if defined(_WIN32)
+        SYSTEM_INFO info{};
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+      }
+
+      void release()
+      {
+        if (!_base)
+          return;
+#if defined(_WIN32)
+        VirtualFree(_base, 0, MEM_RELEASE);
+#else
+        munmap(_base, reserved_bytes);
+#endif
+        _base = nullptr;
+        _size = 0;
+      }
+
+#if defined(_WIN32)
+      static int fault_filter(unsigned long code, EXCEPTION_POINTERS* info, uintptr_t lo, uintptr_t hi)
+      {
+        if (code != EXCEPTION_ACCESS_VIOLATION)
+          return EXCEPTION_CONTINUE_SEARCH;
+        const auto addr = (uintptr_t)info->ExceptionRecord->ExceptionInformation[1];
+        return addr >= lo && addr < hi ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH;
+      }
+#endif
+
+    public:
+      constexpr static bool owns_storage = true;
+
+      // bits above the reservation, which would otherwise wrap around into it
+      constexpr static cell outside_mask() { return (cell)~offset_mask; }
+
+      cell* translate(cell va)
+      {
+        if (va & outside_mask())
+          return nullptr;
+        return (cell*)(_base + (va & offset_mask_align));
+      }
+
+      cell* translate_span(cell va, size_t& cells)
+      {
+        if (va & outside_mask())
+          return nullptr;
+        const auto offset = (size_t)(va & offset_mask_align);
+        // past the committed part it's one cell, which faults once touched
+        cells = offset < _size ? (_size - offset) / cell_bytes : 1;
+        return translate(va);
+      }
+
+      constexpr static cell address_mask() { return offset_mask_align; }
+      cell* storage() const { return (cell*)_base; }
+      // in bytes, rounded up to whole pages
+      size_t size() const { return _size; }
+
+      // Reserves the whole range and commits `size` zeroed cells from va 0.
+      bool map(size_t size, cell& va)
+      {
+        va = 0;
+        if (_base || size > reserved_bytes / cell_bytes)
+          return false;
+
+        const auto page = page_size();
+        const auto bytes = (size * cell_bytes + page - 1) / page * page;
+        if (bytes > reserved_bytes)
+          return false;
+
+#if defined(_WIN32)
+        const auto base = (uint8_t*)VirtualAlloc(nullptr, reserved_bytes, MEM_RESERVE, PAGE_NOACCESS);
+        if (!base)
+          return false;
+        if (bytes && !VirtualAlloc(base, bytes, MEM_COMMIT, PAGE_READWRITE))
+        {
+          VirtualFree(base, 0, MEM_RELEASE);
+          return false;
+        }
+#else
+        const auto p = mmap(nullptr, reserved_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+          return false;
+        const auto base = (uint8_t*)p;
+        if (bytes && mprotect(base, bytes, PROT_READ | PROT_WRITE) != 0)
+        {
+          munmap(base, reserved_bytes);
+          return false;
+        }
+        install_fault_handler();
+#endif
+        _base = base;
+        _size = bytes;
+        return true;
+      }
+
+      void unmap(cell va, size_t)
+      {
+        AMX_ASSERT(va == 0);
+        release();
+      }
+
+      // Faults inside the reservation while `fn` runs return error::access_violation. They unwind without running
+      // destructors, so natives shouldn't hold resources across accesses to script memory they haven't checked. The amx
+      // then stays faulted until reset, see amx::has_faulted().
+      error guarded_run(error(*fn)(void*), void* ctx)
+      {
+        const auto lo = (uintptr_t)_base;
+        const auto hi = lo + reserved_bytes;
+#if defined(_WIN32)
+        __try
+        {
+          return fn(ctx);
+        }
+        __except (fault_filter(GetExceptionCode(), GetExceptionInformation(), lo, hi))
+        {
+          return error::access_violation;
+        }
+#else
+        fault_guard guard;
+        guard.lo = lo;
+        guard.hi = hi;
+        guard.outer = current_fault_guard();
+        if (sigsetjmp(guard.env, 0))
+        {
+          current_fault_guard() = guard.outer;
+          return error::access_violation;
+        }
+        current_fault_guard() = &guard;
+        const auto result = fn(ctx);
+        current_fault_guard() = guard.outer;
+        return result;
+#endif
+      }
+
+      memory_backing_guarded_reservation() = default;
+      memory_backing_guarded_reservation(const memory_backing_guarded_reservation&) = delete;
+      memory_backing_guarded_reservation& operator=(const memory_backing_guarded_reservation&) = delete;
+      ~memory_backing_guarded_reservation() { release(); }
+    };
+  }
+
+  // Reserves all `ValidBits` bits of address space (4 GiB for 32 bit cells by default) behind guard pages, so
+  // translate() is a masked add with no bounds check. Accesses past the mapped size are caught by a SIGSEGV handler or
+  // SEH and turned into error::access_violation. The mapped size is rounded up to whole pages. With cells wider than
+  // `ValidBits`, addresses that have any of the bits above set fail to translate.
+  template <size_t ValidBits = 32>
+  struct memory_backing_guarded_reservation
+  {
+    template <typename Cell>
+    using type = detail::memory_backing_guarded_reservation<Cell, ValidBits>;
+  };
+}
@@ -0,0 +1,1199 @@
+//  This Source Code Form is subject to the terms of the Mozilla Public
+//  License, v. 2.0. If a copy of the MPL was not distributed with this
+//  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#pragma once
+#include <vector>
+#include <cstring>
+#include <utility>
+#include "amx.h"
+
+#if !defined(AMX_JIT_X64)
+#if defined(__x86_64__) || defined(_M_X64)
+#define AMX_JIT_X64 1
+#else
+#define AMX_JIT_X64 0
+#endif
+#endif
+
+#if AMX_JIT_X64
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace amx
+{
+  namespace detail
+  {
+    // amx_guarded.h
+    template <typename Cell, size_t ValidBits>
+    class memory_backing_guarded_reservation;
+
+    // Only the x86-64 encodings the jit uses. Registers are numbered as in ModRM, r8-r15 being 8-15.
+    class x64_assembler
+    {
+      void rex(bool w, uint8_t reg, uint8_t index, uint8_t base)
+      {
+        const auto v = (uint8_t)(0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+        if (v != 0x40)
+          emit8(v);
+      }
+
+      void opcode(uint32_t op)
+      {
+        if (op > 0xFF)
+          emit8(op >> 8);
+        emit8(op);
+      }
+
+    public:
+      enum : uint8_t { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+
+      // low nibble of Jcc and SETcc
+      enum cond : uint8_t
+      {
+        cc_b = 0x2, cc_ae = 0x3, cc_e = 0x4, cc_ne = 0x5, cc_be = 0x6, cc_a = 0x7,
+        cc_s = 0x8, cc_ns = 0x9, cc_l = 0xC, cc_ge = 0xD, cc_le = 0xE, cc_g = 0xF
+      };
+
+      std::vector<uint8_t> code;
+
+      size_t size() const { return code.size(); }
+
+      void emit8(uint32_t v) { code.push_back((uint8_t)v); }
+
+      void emit32(uint32_t v)
+      {
+        for (size_t i = 0; i < 4; ++i)
+          emit8(v >> (i * 8));
+      }
+
+      void emit64(uint64_t v)
+      {
+        emit32((uint32_t)v);
+        emit32((uint32_t)(v >> 32));
+      }
+
+      // `op reg, rm` with a register operand, `reg` being the /digit of group opcodes
+      void rr(uint32_t op, bool w, uint8_t reg, uint8_t rm)
+      {
+        rex(w, reg, 0, rm);
+        opcode(op);
+        emit8(0xC0 | ((reg & 7) << 3) | (rm & 7));
+      }
+
+      // `op reg, [base + index * (1 << scale) + disp]`, an index of rsp means none
+      void mem(uint32_t op, bool w, uint8_t reg, uint8_t base, int32_t disp, uint8_t index = rsp, uint8_t scale = 0)
+      {
+        rex(w, reg, index, base);
+        opcode(op);
+        const auto mod = (disp == 0 && (base & 7) != rbp) ? 0x00 : (disp >= -128 && disp <= 127) ? 0x40 : 0x80;
+        if (index == rsp && (base & 7) != rsp)
+        {
+          emit8(mod | ((reg & 7) << 3) | (base & 7));
+        }
+        else
+        {
+          emit8(mod | ((reg & 7) << 3) | rsp);
+          emit8((scale << 6) | ((index & 7) << 3) | (base & 7));
+        }
+        if (mod == 0x40)
+          emit8((uint32_t)disp);
+        else if (mod == 0x80)
+          emit32((uint32_t)disp);
+      }
+
+      // group 1 with a sign extended immediate: add 0, or 1, and 4, sub 5, xor 6, cmp 7
+      void alu_ri(uint8_t digit, bool w, uint8_t rm, int32_t imm)
+      {
+        if (imm >= -128 && imm <= 127)
+        {
+          rr(0x83, w, digit, rm);
+          emit8((uint32_t)imm);
+        }
+        else
+        {
+          rr(0x81, w, digit, rm);
+          emit32((uint32_t)imm);
+        }
+      }
+
+      void mov_ri(bool w, uint8_t r, uint64_t imm)
+      {
+        if (!w || imm <= 0xFFFFFFFF)
+        {
+          rex(false, 0, 0, r); // zero extends
+          emit8(0xB8 | (r & 7));
+          emit32((uint32_t)imm);
+        }
+        else if ((int64_t)imm == (int32_t)imm)
+        {
+          rr(0xC7, true, 0, r);
+          emit32((uint32_t)imm);
+        }
+        else
+        {
+          rex(true, 0, 0, r);
+          emit8(0xB8 | (r & 7));
+          emit64(imm);
+        }
+      }
+
+      void push(uint8_t r)
+      {
+        rex(false, 0, 0, r);
+        emit8(0x50 | (r & 7));
+      }
+
+      void pop(uint8_t r)
+      {
+        rex(false, 0, 0, r);
+        emit8(0x58 | (r & 7));
+      }
+
+      // rel32 jumps return the position of their displacement, for bind()
+      size_t jcc(cond c)
+      {
+        emit8(0x0F);
+        emit8(0x80 | c);
+        emit32(0);
+        return size() - 4;
+      }
+
+      size_t jmp()
+      {
+        emit8(0xE9);
+        emit32(0);
+        return size() - 4;
+      }
+
+      void bind(size_t fixup, size_t target)
+      {
+        const auto rel = (uint32_t)(int32_t)((intptr_t)target - (intptr_t)(fixup + 4));
+        for (size_t i = 0; i < 4; ++i)
+          code[fixup + i] = (uint8_t)(rel >> (i * 8));
+      }
+    };
+  }
+
+  // Translates a whole code segment to x86-64 machine code, and runs it as an amx execution engine. Like the decoded
+  // stream every cell gets an entry, anything not translated is left to step(), so behavior including faults and the
+  // budget stays the same. Needs 32 or 64 bit cells and a contiguous, partial address space or guarded reservation data
+  // backing, compile() fails otherwise or on other hosts. The code must be the one mapped into the amx, and must not
+  // change while attached. Overlays aren't supported, attach() fails for an amx with an overlay handler.
+  template <typename Amx>
+  class jit
+  {
+  public:
+    using amx_t = Amx;
+    DEFINE_CELL_MEMBERS(typename amx_t::cell);
+
+  private:
+    using as = detail::x64_assembler;
+    using decoded_t = typename amx_t::decoded_t;
+    using data_backing_t = std::remove_reference_t<decltype(std::declval<typename amx_t::memory_manager_t&>().data())>;
+
+    enum class backing_kind { other, contiguous, partial, guarded };
+
+    template <typename C>
+    constexpr static backing_kind kind_of(detail::memory_backing_contignous_buffer<C>*) { return backing_kind::contiguous; }
+    template <typename C, size_t B>
+    constexpr static backing_kind kind_of(detail::memory_backing_partial_address_space<C, B>*) { return backing_kind::partial; }
+    template <typename C, size_t B>
+    constexpr static backing_kind kind_of(detail::memory_backing_guarded_reservation<C, B>*) { return backing_kind::guarded; }
+    constexpr static backing_kind kind_of(...) { return backing_kind::other; }
+
+    constexpr static auto data_kind = kind_of((data_backing_t*)nullptr);
+    constexpr static bool wide = cell_bits == 64;
+
+  public:
+    constexpr static bool supported = AMX_JIT_X64 && (cell_bits == 32 || cell_bits == 64) && data_kind != backing_kind::other;
+
+  private:
+    // registers of the compiled code, spilled here around helpers and on exit
+    struct frame
+    {
+      uint64_t pri;
+      uint64_t alt;
+      uint64_t frm;
+      uint64_t stk;
+      uint64_t cip;
+      int64_t budget;
+      uintptr_t data_base;
+      uint64_t data_size;
+      amx_t* self;
+      cell* hea;
+      uint64_t cod;
+      uint64_t dat;
+      uint64_t stp;
+      cell* stk_low;
+      cell* hea_high;
+    };
+
+    using entry_fn = uint32_t(*)(frame* f, const void* target);
+
+    // PRI, ALT, FRM, STK, instruction budget and the data base live in callee saved registers. [rsp + 32] holds the
+    // frame, [rsp + 40] the data size, below is shadow space for helpers. Six pushes and this keep calls 16 byte aligned.
+    constexpr static uint8_t r_pri = as::rbx;
+    constexpr static uint8_t r_alt = as::r12;
+    constexpr static uint8_t r_frm = as::r13;
+    constexpr static uint8_t r_stk = as::r14;
+    constexpr static uint8_t r_budget = as::rbp;
+    constexpr static uint8_t r_base = as::r15;
+    constexpr static int32_t frame_slot = 32;
+    constexpr static int32_t size_slot = 40;
+    constexpr static int32_t locals_size = 56;
+
+#if defined(_WIN32)
+    constexpr static uint8_t r_arg0 = as::rcx;
+    constexpr static uint8_t r_arg1 = as::rdx;
+#else
+    constexpr static uint8_t r_arg0 = as::rdi;
+    constexpr static uint8_t r_arg1 = as::rsi;
+#endif
+
+    constexpr static size_t dynamic_cip = ~(size_t)0;
+
+    struct fault
+    {
+      size_t fixup;
+      error e;
+      // dynamic_cip if it's in rcx already
+      size_t cip;
+      // the error is in eax already
+      bool has_error;
+    };
+
+    as _as;
+    std::vector<std::pair<size_t, size_t>> _label_fixups;
+    std::vector<fault> _faults;
+    size_t _exit{};
+    size_t _dispatch{};
+
+    std::vector<decoded_t> _decoded;
+    std::vector<const void*> _targets;
+    size_t _count{};
+    void* _exec{};
+    size_t _exec_size{};
+
+    entry_fn entry() const { return (entry_fn)_exec; }
+
+    static uint32_t sysreq(frame* f, uint64_t index)
+    {
+      const auto self = f->self;
+      self->PRI = (cell)f->pri;
+      self->ALT = (cell)f->alt;
+      self->FRM = (cell)f->frm;
+      self->STK = (cell)f->stk;
+      self->CIP = (cell)f->cip;
+      self->_budget = f->budget;
+      const auto result = self->call_native((cell)index);
+      f->pri = self->PRI;
+      f->budget = self->_budget;
+      return (uint32_t)result;
+    }
+
+    // same search as OP_SWITCH, dense tables are sorted too
+    static uint64_t switch_target(const decoded_t* table, uint64_t pri)
+    {
+      const auto record = table + 3;
+      size_t lo = 0;
+      size_t hi = (size_t)table[0].operand;
+      while (lo < hi)
+      {
+        const auto mid = lo + (hi - lo) / 2;
+        if (record[2 * mid].operand < (cell)pri)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      return lo < (size_t)table[0].operand && record[2 * lo].operand == (cell)pri
+        ? record[2 * lo + 1].operand
+        : table[1].operand;
+    }
+
+    static size_t length(cell handler)
+    {
+      switch (handler)
+      {
+      case amx_t::OP_LOAD_PRI:
+      case amx_t::OP_LOAD_ALT:
+      case amx_t::OP_LOAD_S_PRI:
+      case amx_t::OP_LOAD_S_ALT:
+      case amx_t::OP_LREF_S_PRI:
+      case amx_t::OP_LREF_S_ALT:
+      case amx_t::OP_CONST_PRI:
+      case amx_t::OP_CONST_ALT:
+      case amx_t::OP_ADDR_PRI:
+      case amx_t::OP_ADDR_ALT:
+      case amx_t::OP_STOR:
+      case amx_t::OP_STOR_S:
+      case amx_t::OP_SREF_S:
+      case amx_t::OP_ALIGN_PRI:
+      case amx_t::OP_LCTRL:
+      case amx_t::OP_SCTRL:
+      case amx_t::OP_PICK:
+      case amx_t::OP_STACK:
+      case amx_t::OP_HEAP:
+      case amx_t::OP_CALL:
+      case amx_t::OP_JUMP:
+      case amx_t::OP_JZER:
+      case amx_t::OP_JNZ:
+      case amx_t::OP_SHL_C_PRI:
+      case amx_t::OP_SHL_C_ALT:
+      case amx_t::OP_HALT:
+      case amx_t::OP_BOUNDS:
+      case amx_t::OP_SYSREQ:
+      case amx_t::OP_SWITCH:
+      case amx_t::IOP_SWITCH_DENSE:
+        return 2;
+      default:
+        return 1;
+      }
+    }
+
+    // left to step(), the decoded stream's fallbacks and the few instructions not worth translating
+    static bool is_fallback(cell handler)
+    {
+      switch (handler)
+      {
+      case amx_t::OP_LODB_I:
+      case amx_t::OP_STRB_I:
+      case amx_t::OP_MOVS:
+      case amx_t::OP_CMPS:
+      case amx_t::OP_FILL:
+      case amx_t::OP_BREAK:
+      case amx_t::IOP_FALLBACK:
+      case amx_t::IOP_CASETBL:
+      case amx_t::IOP_CASEDATA:
+      case amx_t::IOP_EXIT:
+        return true;
+      default:
+        return handler >= amx_t::IOP_NUM_OPCODES;
+      }
+    }
+
+    static bool falls_through(const decoded_t& insn)
+    {
+      switch (insn.handler)
+      {
+      case amx_t::OP_SCTRL:
+        return insn.operand != 6;
+      case amx_t::OP_RET:
+      case amx_t::OP_RETN:
+      case amx_t::OP_CALL:
+      case amx_t::OP_JUMP:
+      case amx_t::OP_HALT:
+      case amx_t::OP_SWITCH:
+      case amx_t::IOP_SWITCH_DENSE:
+        return false;
+      default:
+        return !is_fallback(insn.handler);
+      }
+    }
+
+    void mov_rr(uint8_t dst, uint8_t src) { _as.rr(0x89, wide, src, dst); }
+    void load(uint8_t dst, uint8_t base) { _as.mem(0x8B, wide, dst, base, 0); }
+    void store(uint8_t src, uint8_t base) { _as.mem(0x89, wide, src, base, 0); }
+    void load_frame(uint8_t dst) { _as.mem(0x8B, true, dst, as::rsp, frame_slot); }
+    void mov_cell(uint8_t r, cell v) { _as.mov_ri(wide, r, (uint64_t)v); }
+
+    // cell wide group 1 operation with an immediate, r9 is clobbered for 64 bit ones that don't fit
+    void alu_cell(uint8_t digit, uint8_t r, cell v)
+    {
+      if (!wide || (int64_t)v == (int32_t)(int64_t)v)
+        return _as.alu_ri(digit, wide, r, (int32_t)(int64_t)(scell)v);
+      static const uint8_t ops[8] = { 0x01, 0x09, 0, 0, 0x21, 0x29, 0x31, 0x39 };
+      _as.mov_ri(true, as::r9, (uint64_t)v);
+      _as.rr(ops[digit], true, as::r9, r);
+    }
+
+    void fault_if(as::cond c, error e, size_t cip)
+    {
+      _faults.push_back({ _as.jcc(c), e, cip, false });
+    }
+
+    void exit_with(error e, size_t cip)
+    {
+      _as.mov_ri(false, as::rax, (uint32_t)e);
+      _as.mov_ri(true, as::rcx, (uint64_t)cip);
+      _as.bind(_as.jmp(), _exit);
+    }
+
+    // data address in rax to host address in rax, rdx is clobbered
+    void translate(size_t fault_cip)
+    {
+      if constexpr (data_kind == backing_kind::contiguous)
+      {
+        _as.mem(0x3B, true, as::rax, as::rsp, size_slot);
+        fault_if(as::cc_ae, error::access_violation, fault_cip);
+        _as.alu_ri(4, true, as::rax, -(int32_t)cell_bytes);
+        _as.rr(0x01, true, r_base, as::rax);
+      }
+      else
+      {
+        if constexpr (data_kind == backing_kind::guarded)
+          if constexpr (data_backing_t::outside_mask() != 0)
+          {
+            _as.mov_ri(true, as::rdx, (uint64_t)data_backing_t::outside_mask());
+            _as.rr(0x85, true, as::rdx, as::rax);
+            fault_if(as::cc_ne, error::access_violation, fault_cip);
+          }
+        _as.mov_ri(true, as::rdx, (uint64_t)data_backing_t::address_mask());
+        _as.rr(0x21, true, as::rdx, as::rax);
+        // the guarded reservation is a base to add to, the partial address space one has the low bits clear
+        _as.rr(data_kind == backing_kind::guarded ? 0x01 : 0x09, true, r_base, as::rax);
+      }
+    }
+
+    // faults unless STK is amx_t::stack_margin bytes above the HEA in `hea`, rdx is clobbered
+    void check_collision(uint8_t hea, size_t fault_cip)
+    {
+      update_mark(offsetof(frame, stk_low), r_stk, as::cc_be);
+      update_mark(offsetof(frame, hea_high), hea, as::cc_ae);
+      mov_rr(as::rdx, r_stk);
+      _as.rr(0x29, wide, hea, as::rdx);
+      fault_if(as::cc_b, error::stack_heap_collision, fault_cip);
+      alu_cell(7, as::rdx, amx_t::stack_margin);
+      fault_if(as::cc_b, error::stack_heap_collision, fault_cip);
+    }
+
+    // the mark the frame points to at `slot` becomes `value` unless `keep` holds comparing the two, rdx is clobbered
+    void update_mark(int32_t slot, uint8_t value, as::cond keep)
+    {
+      load_frame(as::rdx);
+      _as.mem(0x8B, true, as::rdx, as::rdx, slot);
+      _as.mem(0x39, wide, value, as::rdx, 0);
+      const auto skip = _as.jcc(keep);
+      store(value, as::rdx);
+      _as.bind(skip, _as.size());
+    }
+
+    // HEA into rax
+    void load_hea()
+    {
+      load_frame(as::rax);
+      _as.mem(0x8B, true, as::rax, as::rax, offsetof(frame, hea));
+      load(as::rax, as::rax);
+    }
+
+    void push_reg(uint8_t src, size_t fault_cip)
+    {
+      _as.alu_ri(5, wide, r_stk, (int32_t)cell_bytes);
+      mov_rr(as::rax, r_stk);
+      translate(fault_cip);
+      store(src, as::rax);
+    }
+
+    void pop_reg(uint8_t dst, size_t fault_cip)
+    {
+      mov_rr(as::rax, r_stk);
+      translate(fault_cip);
+      load(dst, as::rax);
+      _as.alu_ri(0, wide, r_stk, (int32_t)cell_bytes);
+    }
+
+    void jump_label(size_t index)
+    {
+      _label_fixups.emplace_back(_as.jmp(), index);
+    }
+
+    void branch(size_t from, size_t index)
+    {
+      if (index <= from)
+      {
+        _as.rr(0x85, true, r_budget, r_budget);
+        fault_if(as::cc_le, error::yield, index * cell_bytes);
+      }
+      jump_label(index);
+    }
+
+    void conditional_branch(as::cond taken, size_t from, size_t index)
+    {
+      _as.rr(0x85, wide, r_pri, r_pri);
+      if (index > from)
+      {
+        _label_fixups.emplace_back(_as.jcc(taken), index);
+        return;
+      }
+      const auto skip = _as.jcc((as::cond)(taken ^ 1));
+      branch(from, index);
+      _as.bind(skip, _as.size());
+    }
+
+    void call_helper(const void* fn)
+    {
+      _as.mov_ri(true, as::rax, (uint64_t)(uintptr_t)fn);
+      _as.rr(0xFF, false, 2, as::rax);
+    }
+
+    void emit_prologue()
+    {
+      for (const auto r : { as::rbx, as::rbp, as::r12, as::r13, as::r14, as::r15 })
+        _as.push(r);
+      _as.alu_ri(5, true, as::rsp, locals_size);
+      _as.mem(0x89, true, r_arg0, as::rsp, frame_slot);
+      _as.mem(0x8B, true, r_pri, r_arg0, offsetof(frame, pri));
+      _as.mem(0x8B, true, r_alt, r_arg0, offsetof(frame, alt));
+      _as.mem(0x8B, true, r_frm, r_arg0, offsetof(frame, frm));
+      _as.mem(0x8B, true, r_stk, r_arg0, offsetof(frame, stk));
+      _as.mem(0x8B, true, r_budget, r_arg0, offsetof(frame, budget));
+      _as.mem(0x8B, true, r_base, r_arg0, offsetof(frame, data_base));
+      _as.mem(0x8B, true, as::rax, r_arg0, offsetof(frame, data_size));
+      _as.mem(0x89, true, as::rax, as::rsp, size_slot);
+      _as.rr(0xFF, false, 4, r_arg1);
+
+      // eax is the error, rcx the CIP
+      _exit = _as.size();
+      load_frame(as::rdx);
+      _as.mem(0x89, true, r_pri, as::rdx, offsetof(frame, pri));
+      _as.mem(0x89, true, r_alt, as::rdx, offsetof(frame, alt));
+      _as.mem(0x89, true, r_frm, as::rdx, offsetof(frame, frm));
+      _as.mem(0x89, true, r_stk, as::rdx, offsetof(frame, stk));
+      _as.mem(0x89, true, as::rcx, as::rdx, offsetof(frame, cip));
+      _as.mem(0x89, true, r_budget, as::rdx, offsetof(frame, budget));
+      _as.alu_ri(0, true, as::rsp, locals_size);
+      for (const auto r : { as::r15, as::r14, as::r13, as::r12, as::rbp, as::rbx })
+        _as.pop(r);
+      _as.emit8(0xC3);
+
+      // jumps to the CIP in rcx, or leaves it to step() if it's not an entry
+      _dispatch = _as.size();
+      _as.emit8(0xF6);
+      _as.emit8(0xC1);
+      _as.emit8(misalign_mask);
+      const auto misaligned = _as.jcc(as::cc_ne);
+      _as.mov_ri(true, as::r9, (uint64_t)_count * cell_bytes);
+      _as.rr(0x39, true, as::r9, as::rcx);
+      const auto outside = _as.jcc(as::cc_ae);
+      _as.mov_ri(true, as::rdx, (uint64_t)(uintptr_t)_targets.data());
+      _as.mem(0xFF, false, 4, as::rdx, 0, as::rcx, cell_bytes == 4 ? 1 : 0);
+      _as.bind(misaligned, _as.size());
+      _as.bind(outside, _as.size());
+      _as.rr(0x31, false, as::rax, as::rax);
+      _as.bind(_as.jmp(), _exit);
+    }
+
+    void emit_instruction(size_t i)
+    {
+      const auto& insn = _decoded[i];
+      const auto op = insn.operand;
+      const auto after = [i](size_t n) { return (i + n) * cell_bytes; };
+
+      if (is_fallback(insn.handler))
+      {
+        // not an instruction for the budget, step() counts it
+        exit_with(error::success, insn.handler == amx_t::IOP_EXIT ? 0 : i * cell_bytes);
+        return;
+      }
+
+      _as.rr(0xFF, true, 1, r_budget);
+
+      switch (insn.handler)
+      {
+      case amx_t::OP_NOP:
+        break;
+
+      case amx_t::OP_LOAD_PRI:
+      case amx_t::OP_LOAD_ALT:
+        mov_cell(as::rax, op);
+        translate(after(2));
+        load(insn.handler == amx_t::OP_LOAD_PRI ? r_pri : r_alt, as::rax);
+        break;
+
+      case amx_t::OP_LOAD_S_PRI:
+      case amx_t::OP_LOAD_S_ALT:
+        mov_rr(as::rax, r_frm);
+        alu_cell(0, as::rax, op);
+        translate(after(2));
+        load(insn.handler == amx_t::OP_LOAD_S_PRI ? r_pri : r_alt, as::rax);
+        break;
+
+      case amx_t::OP_LREF_S_PRI:
+      case amx_t::OP_LREF_S_ALT:
+        mov_rr(as::rax, r_frm);
+        alu_cell(0, as::rax, op);
+        translate(after(2));
+        load(as::rax, as::rax);
+        translate(after(2));
+        load(insn.handler == amx_t::OP_LREF_S_PRI ? r_pri : r_alt, as::rax);
+        break;
+
+      case amx_t::OP_LOAD_I:
+        mov_rr(as::rax, r_pri);
+        translate(after(1));
+        load(r_pri, as::rax);
+        break;
+
+      case amx_t::OP_CONST_PRI:
+        mov_cell(r_pri, op);
+        break;
+      case amx_t::OP_CONST_ALT:
+        mov_cell(r_alt, op);
+        break;
+
+      case amx_t::OP_ADDR_PRI:
+      case amx_t::OP_ADDR_ALT:
+      {
+        const auto r = insn.handler == amx_t::OP_ADDR_PRI ? r_pri : r_alt;
+        mov_rr(r, r_frm);
+        alu_cell(0, r, op);
+        break;
+      }
+
+      case amx_t::OP_STOR:
+        mov_cell(as::rax, op);
+        translate(after(2));
+        store(r_pri, as::rax);
+        break;
+
+      case amx_t::OP_STOR_S:
+        mov_rr(as::rax, r_frm);
+        alu_cell(0, as::rax, op);
+        translate(after(2));
+        store(r_pri, as::rax);
+        break;
+
+      case amx_t::OP_SREF_S:
+        mov_rr(as::rax, r_frm);
+        alu_cell(0, as::rax, op);
+        translate(after(2));
+        load(as::rax, as::rax);
+        translate(after(2));
+        store(r_pri, as::rax);
+        break;
+
+      case amx_t::OP_STOR_I:
+        mov_rr(as::rax, r_alt);
+        translate(after(1));
+        store(r_pri, as::rax);
+        break;
+
+      case amx_t::OP_ALIGN_PRI:
+        alu_cell(6, r_pri, op);
+        break;
+
+      case amx_t::OP_LCTRL:
+        switch (op)
+        {
+        case 0:
+          load_frame(as::rdx);
+          _as.mem(0x8B, true, r_pri, as::rdx, offsetof(frame, cod));
+          break;
+        case 1:
+          load_frame(as::rdx);
+          _as.mem(0x8B, true, r_pri, as::rdx, offsetof(frame, dat));
+          break;
+        case 2:
+          load_frame(as::rdx);
+          _as.mem(0x8B, true, as::rdx, as::rdx, offsetof(frame, hea));
+          load(r_pri, as::rdx);
+          break;
+        case 3:
+          load_frame(as::rdx);
+          _as.mem(0x8B, true, r_pri, as::rdx, offsetof(frame, stp));
+          break;
+        case 4:
+          mov_rr(r_pri, r_stk);
+          break;
+        case 5:
+          mov_rr(r_pri, r_frm);
+          break;
+        default:
+          mov_cell(r_pri, (cell)after(2));
+          break;
+        }
+        break;
+
+      case amx_t::OP_SCTRL:
+        switch (op)
+        {
+        case 2:
+          load_frame(as::rdx);
+          _as.mem(0x8B, true, as::rdx, as::rdx, offsetof(frame, hea));
+          store(r_pri, as::rdx);
+          break;
+        case 4:
+          mov_rr(r_stk, r_pri);
+          break;
+        case 5:
+          mov_rr(r_frm, r_pri);
+          break;
+        default:
+          _as.rr(0x89, true, r_pri, as::rcx);
+          _as.bind(_as.jmp(), _dispatch);
+          break;
+        }
+        break;
+
+      case amx_t::OP_XCHG:
+        _as.rr(0x87, wide, r_alt, r_pri);
+        break;
+
+      case amx_t::OP_PUSH_PRI:
+        push_reg(r_pri, after(1));
+        break;
+      case amx_t::OP_PUSH_ALT:
+        push_reg(r_alt, after(1));
+        break;
+
+      case amx_t::OP_PUSHR_PRI:
+        load_frame(as::rdx);
+        _as.mem(0x8B, true, as::r8, as::rdx, offsetof(frame, dat));
+        _as.rr(0x01, wide, r_pri, as::r8);
+        push_reg(as::r8, after(1));
+        break;
+
+      case amx_t::OP_POP_PRI:
+        pop_reg(r_pri, after(1));
+        break;
+      case amx_t::OP_POP_ALT:
+        pop_reg(r_alt, after(1));
+        break;
+
+      case amx_t::OP_PICK:
+        mov_rr(as::rax, r_stk);
+        alu_cell(0, as::rax, op);
+        translate(after(2));
+        load(r_pri, as::rax);
+        break;
+
+      case amx_t::OP_STACK:
+        alu_cell(0, r_stk, op);
+        mov_rr(r_alt, r_stk);
+        load_hea();
+        check_collision(as::rax, after(2));
+        break;
+
+      case amx_t::OP_HEAP:
+        load_frame(as::r8);
+        _as.mem(0x8B, true, as::r8, as::r8, offsetof(frame, hea));
+        load(r_alt, as::r8);
+        mov_rr(as::rax, r_alt);
+        alu_cell(0, as::rax, op);
+        store(as::rax, as::r8);
+        check_collision(as::rax, after(2));
+        break;
+
+      case amx_t::OP_PROC:
+        load_hea();
+        check_collision(as::rax, after(1));
+        push_reg(r_frm, after(1));
+        mov_rr(r_frm, r_stk);
+        break;
+
+      case amx_t::OP_RET:
+        pop_reg(r_frm, after(1));
+        pop_reg(as::rcx, after(1));
+        _as.bind(_as.jmp(), _dispatch);
+        break;
+
+      case amx_t::OP_RETN:
+        pop_reg(r_frm, after(1));
+        pop_reg(as::rcx, after(1));
+        mov_rr(as::rax, r_stk);
+        translate(dynamic_cip);
+        load(as::rdx, as::rax);
+        _as.rr(0x01, wide, as::rdx, r_stk);
+        _as.alu_ri(0, wide, r_stk, (int32_t)cell_bytes);
+        _as.bind(_as.jmp(), _dispatch);
+        break;
+
+      case amx_t::OP_CALL:
+        mov_cell(as::r8, (cell)after(2));
+        push_reg(as::r8, after(2));
+        _as.rr(0x85, true, r_budget, r_budget);
+        fault_if(as::cc_le, error::yield, (size_t)op * cell_bytes);
+        jump_label((size_t)op);
+        break;
+
+      case amx_t::OP_JUMP:
+        branch(i, (size_t)op);
+        break;
+
+      case amx_t::OP_JZER:
+        conditional_branch(as::cc_e, i, (size_t)op);
+        break;
+
+      case amx_t::OP_JNZ:
+        conditional_branch(as::cc_ne, i, (size_t)op);
+        break;
+
+      case amx_t::OP_SHL:
+      case amx_t::OP_SHR:
+      case amx_t::OP_SSHR:
+        _as.rr(0x89, false, r_alt, as::rcx);
+        _as.rr(0xD3, wide, insn.handler == amx_t::OP_SHL ? 4 : insn.handler == amx_t::OP_SHR ? 5 : 7, r_pri);
+        break;
+
+      case amx_t::OP_SHL_C_PRI:
+      case amx_t::OP_SHL_C_ALT:
+        _as.rr(0xC1, wide, 4, insn.handler == amx_t::OP_SHL_C_PRI ? r_pri : r_alt);
+        _as.emit8((uint32_t)op);
+        break;
+
+      case amx_t::OP_SMUL:
+        _as.rr(0x0FAF, wide, r_pri, r_alt);
+        break;
+
+      case amx_t::OP_SDIV:
+      {
+        _as.rr(0x85, wide, r_pri, r_pri);
+        fault_if(as::cc_e, error::division_with_zero, after(1));
+        // dividing by -1 is negation with no remainder, without the overflow trap
+        _as.alu_ri(7, wide, r_pri, -1);
+        const auto not_minus_one = _as.jcc(as::cc_ne);
+        mov_rr(r_pri, r_alt);
+        _as.rr(0xF7, wide, 3, r_pri);
+        _as.rr(0x31, false, r_alt, r_alt);
+        const auto done = _as.jmp();
+        _as.bind(not_minus_one, _as.size());
+        mov_rr(as::rax, r_alt);
+        if (wide)
+          _as.emit8(0x48);
+        _as.emit8(0x99);
+        _as.rr(0xF7, wide, 7, r_pri);
+        // round towards negative infinity
+        _as.rr(0x85, wide, as::rdx, as::rdx);
+        const auto exact = _as.jcc(as::cc_e);
+        mov_rr(as::rcx, as::rdx);
+        _as.rr(0x31, wide, r_pri, as::rcx);
+        const auto same_sign = _as.jcc(as::cc_ns);
+        _as.rr(0xFF, wide, 1, as::rax);
+        _as.rr(0x01, wide, r_pri, as::rdx);
+        _as.bind(exact, _as.size());
+        _as.bind(same_sign, _as.size());
+        mov_rr(r_pri, as::rax);
+        mov_rr(r_alt, as::rdx);
+        _as.bind(done, _as.size());
+        break;
+      }
+
+      case amx_t::OP_ADD:
+        _as.rr(0x01, wide, r_alt, r_pri);
+        break;
+
+      case amx_t::OP_SUB:
+        mov_rr(as::rax, r_alt);
+        _as.rr(0x29, wide, r_pri, as::rax);
+        mov_rr(r_pri, as::rax);
+        break;
+
+      case amx_t::OP_AND:
+        _as.rr(0x21, wide, r_alt, r_pri);
+        break;
+      case amx_t::OP_OR:
+        _as.rr(0x09, wide, r_alt, r_pri);
+        break;
+      case amx_t::OP_XOR:
+        _as.rr(0x31, wide, r_alt, r_pri);
+        break;
+
+      case amx_t::OP_NOT:
+        _as.rr(0x85, wide, r_pri, r_pri);
+        _as.rr(0x0F90 | as::cc_e, false, 0, as::rax);
+        _as.rr(0x0FB6, false, r_pri, as::rax);
+        break;
+
+      case amx_t::OP_NEG:
+        _as.rr(0xF7, wide, 3, r_pri);
+        break;
+      case amx_t::OP_INVERT:
+        _as.rr(0xF7, wide, 2, r_pri);
+        break;
+
+      case amx_t::OP_EQ:
+      case amx_t::OP_NEQ:
+      case amx_t::OP_SLESS:
+      case amx_t::OP_SLEQ:
+      case amx_t::OP_SGRTR:
+      case amx_t::OP_SGEQ:
+      {
+        static const as::cond conds[] = { as::cc_e, as::cc_ne, as::cc_l, as::cc_le, as::cc_g, as::cc_ge };
+        _as.rr(0x39, wide, r_alt, r_pri);
+        _as.rr(0x0F90 | conds[insn.handler - amx_t::OP_EQ], false, 0, as::rax);
+        _as.rr(0x0FB6, false, r_pri, as::rax);
+        break;
+      }
+
+      case amx_t::OP_INC_PRI:
+        _as.rr(0xFF, wide, 0, r_pri);
+        break;
+      case amx_t::OP_INC_ALT:
+        _as.rr(0xFF, wide, 0, r_alt);
+        break;
+      case amx_t::OP_DEC_PRI:
+        _as.rr(0xFF, wide, 1, r_pri);
+        break;
+      case amx_t::OP_DEC_ALT:
+        _as.rr(0xFF, wide, 1, r_alt);
+        break;
+
+      case amx_t::OP_INC_I:
+      case amx_t::OP_DEC_I:
+        mov_rr(as::rax, r_pri);
+        translate(after(1));
+        _as.mem(0xFF, wide, insn.handler == amx_t::OP_INC_I ? 0 : 1, as::rax, 0);
+        break;
+
+      case amx_t::OP_HALT:
+        if (op == amx_t::halt_sleep)
+        {
+          exit_with(error::sleep, after(2));
+          break;
+        }
+        mov_cell(r_pri, op);
+        exit_with(error::halt, after(2));
+        break;
+
+      case amx_t::OP_BOUNDS:
+        alu_cell(7, r_pri, op);
+        fault_if(as::cc_a, error::bounds, after(2));
+        break;
+
+      case amx_t::OP_SYSREQ:
+        load_frame(as::rdx);
+        _as.mem(0x89, true, r_pri, as::rdx, offsetof(frame, pri));
+        _as.mem(0x89, true, r_alt, as::rdx, offsetof(frame, alt));
+        _as.mem(0x89, true, r_frm, as::rdx, offsetof(frame, frm));
+        _as.mem(0x89, true, r_stk, as::rdx, offsetof(frame, stk));
+        _as.mem(0x89, true, r_budget, as::rdx, offsetof(frame, budget));
+        _as.mov_ri(true, as::rax, (uint64_t)after(2));
+        _as.mem(0x89, true, as::rax, as::rdx, offsetof(frame, cip));
+        _as.rr(0x89, true, as::rdx, r_arg0);
+        _as.mov_ri(true, r_arg1, (uint64_t)op);
+        call_helper((const void*)&sysreq);
+        load_frame(as::rdx);
+        _as.mem(0x8B, true, r_pri, as::rdx, offsetof(frame, pri));
+        _as.mem(0x8B, true, r_budget, as::rdx, offsetof(frame, budget));
+        _as.rr(0x85, false, as::rax, as::rax);
+        _faults.push_back({ _as.jcc(as::cc_ne), error::success, after(2), true });
+        break;
+
+      case amx_t::OP_SWITCH:
+      case amx_t::IOP_SWITCH_DENSE:
+        _as.mov_ri(true, r_arg0, (uint64_t)(uintptr_t)(_decoded.data() + op));
+        _as.rr(0x89, true, r_pri, r_arg1);
+        call_helper((const void*)&switch_target);
+        _as.mov_ri(true, as::rdx, (uint64_t)(uintptr_t)_targets.data());
+        _as.mem(0xFF, false, 4, as::rdx, 0, as::rax, 3);
+        break;
+
+      case amx_t::OP_SWAP_PRI:
+      case amx_t::OP_SWAP_ALT:
+      {
+        const auto r = insn.handler == amx_t::OP_SWAP_PRI ? r_pri : r_alt;
+        mov_rr(as::rax, r_stk);
+        translate(after(1));
+        load(as::rcx, as::rax);
+        store(r, as::rax);
+        mov_rr(r, as::rcx);
+        break;
+      }
+
+      default:
+        AMX_ASSERT(false);
+        break;
+      }
+    }
+
+    void release()
+    {
+      if (_exec)
+      {
+#if AMX_JIT_X64 && defined(_WIN32)
+        VirtualFree(_exec, 0, MEM_RELEASE);
+#elif AMX_JIT_X64
+        munmap(_exec, _exec_size);
+#endif
+      }
+      _exec = nullptr;
+      _exec_size = 0;
+      _count = 0;
+      _decoded.clear();
+      _targets.clear();
+    }
+
+    bool make_executable()
+    {
+#if AMX_JIT_X64 && defined(_WIN32)
+      const auto p = VirtualAlloc(nullptr, _as.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+      if (!p)
+        return false;
+      memcpy(p, _as.code.data(), _as.size());
+      DWORD old{};
+      if (!VirtualProtect(p, _as.size(), PAGE_EXECUTE_READ, &old))
+      {
+        VirtualFree(p, 0, MEM_RELEASE);
+        return false;
+      }
+#elif AMX_JIT_X64
+      const auto p = mmap(nullptr, _as.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+        return false;
+      memcpy(p, _as.code.data(), _as.size());
+      if (mprotect(p, _as.size(), PROT_READ | PROT_EXEC) != 0)
+      {
+        munmap(p, _as.size());
+        return false;
+      }
+#else
+      void* p = nullptr;
+      return false;
+#endif
+      _exec = p;
+      _exec_size = _as.size();
+      return true;
+    }
+
+    static error run(amx_t* self, void* user)
+    {
+      const auto j = (const jit*)user;
+      if (self->DAT != 0 || self->CIP % cell_bytes != 0 || self->CIP / cell_bytes >= j->_count)
+        return error::success;
+
+      frame f{};
+      f.pri = self->PRI;
+      f.alt = self->ALT;
+      f.frm = self->FRM;
+      f.stk = self->STK;
+      f.budget = self->_budget;
+      f.self = self;
+      f.hea = &self->HEA;
+      f.cod = self->COD;
+      f.dat = self->DAT;
+      f.stp = self->STP;
+      f.stk_low = &self->_stk_low;
+      f.hea_high = &self->_hea_high;
+      auto& data = self->mem.data();
+      if constexpr (data_kind == backing_kind::contiguous)
+      {
+        f.data_base = (uintptr_t)data.buffer();
+        f.data_size = data.size();
+      }
+      else if constexpr (data_kind == backing_kind::partial)
+      {
+        f.data_base = data.backing_bits();
+      }
+      else if constexpr (data_kind == backing_kind::guarded)
+      {
+        f.data_base = (uintptr_t)data.storage();
+      }
+
+      const auto result = (error)j->entry()(&f, j->_targets[self->CIP / cell_bytes]);
+      self->PRI = (cell)f.pri;
+      self->ALT = (cell)f.alt;
+      self->FRM = (cell)f.frm;
+      self->STK = (cell)f.stk;
+      self->CIP = (cell)f.cip;
+      self->_budget = f.budget;
+      return result;
+    }
+
+  public:
+    jit() = default;
+    jit(const jit&) = delete;
+    jit& operator=(const jit&) = delete;
+    ~jit() { release(); }
+
+    bool valid() const { return _exec != nullptr; }
+
+    // Compiles `count` cells of code. Returns false if this amx type or host isn't supported, or on allocation failure.
+    bool compile(const cell* code, size_t count)
+    {
+      release();
+      if constexpr (!supported)
+      {
+        (void)code;
+        (void)count;
+        return false;
+      }
+      else
+      {
+        if (count == 0 || count > (size_t)std::numeric_limits<int32_t>::max() / cell_bytes)
+          return false;
+
+        _count = count;
+        _decoded.resize(count + 1);
+        amx_t::decode_opcodes(code, count, _decoded.data(), false, nullptr);
+        _targets.assign(count, nullptr);
+
+        _as.code.clear();
+        _label_fixups.clear();
+        _faults.clear();
+        emit_prologue();
+
+        // instructions are laid out in fallthrough chains, each cell gets an entry in one
+        std::vector<size_t> offsets(count + 1, ~(size_t)0);
+        for (size_t start = 0; start < count; ++start)
+        {
+          for (size_t i = start;;)
+          {
+            if (offsets[i] != ~(size_t)0)
+            {
+              jump_label(i);
+              break;
+            }
+            offsets[i] = _as.size();
+            if (i == count)
+            {
+              exit_with(error::success, count * cell_bytes);
+              break;
+            }
+            emit_instruction(i);
+            if (!falls_through(_decoded[i]))
+              break;
+            i += length(_decoded[i].handler);
+          }
+        }
+
+        for (const auto& f : _faults)
+        {
+          _as.bind(f.fixup, _as.size());
+          if (!f.has_error)
+            _as.mov_ri(false, as::rax, (uint32_t)f.e);
+          if (f.cip != dynamic_cip)
+            _as.mov_ri(true, as::rcx, (uint64_t)f.cip);
+          _as.bind(_as.jmp(), _exit);
+        }
+
+        for (const auto& l : _label_fixups)
+          _as.bind(l.first, offsets[l.second]);
+
+        const auto ok = make_executable();
+        _as.code.clear();
+        _as.code.shrink_to_fit();
+        _label_fixups.clear();
+        _faults.clear();
+        if (!ok)
+        {
+          release();
+          return false;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+          _targets[i] = (const uint8_t*)_exec + offsets[i];
+        return true;
+      }
+    }
+
+    bool attach(amx_t& amx)
+    {
+      AMX_ASSERT(valid());
+      return amx.attach_engine(&run, this);
+    }
+
+    static void detach(amx_t& amx)
+    {
+      amx.detach_engine();
+    }
+  };
+}
@@ -3,12 +3,26 @@
 //  file, You can obtain one at http://mozilla.org/MPL/2.0/.
 #pragma once
 #include <vector>
-#include <unordered_map>
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <cstring>
+#include <memory>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <utility>
+#include <type_traits>
 #include "amx.h"
 
+#if !defined(AMX_LITTLE_ENDIAN)
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define AMX_LITTLE_ENDIAN 0
+#else
+#define AMX_LITTLE_ENDIAN 1
+#endif
+#endif
+
 namespace amx
 {
   enum class loader_error
@@ -20,6 +34,7 @@ namespace amx
     feature_not_supported,
     wrong_cell_size,
     native_not_resolved,
+    invalid_code,
     unknown
   };
 
@@ -39,6 +54,15 @@ namespace amx
       return (T)t;
     }
 
+    // FNV-1a, what native names are looked up by in cache files
+    static uint64_t name_hash(std::string_view name)
+    {
+      uint64_t h = 0xCBF29CE484222325;
+      for (const auto c : name)
+        h = (h ^ (uint8_t)c) * 0x100000001B3;
+      return h;
+    }
+
     template <typename T>
     static T read_be(const uint8_t* p)
     {
@@ -73,6 +97,19 @@ namespace amx
       return true;
     }
 
+    // Bounds are checked once, then the whole array is copied. Only big endian hosts need to swap afterwards.
+    template <typename T>
+    static bool read_le_array(const uint8_t* buf, size_t buf_size, size_t begin_offset, size_t end_offset, std::vector<T>& out)
+    {
+      if (!select_array(buf, buf_size, begin_offset, end_offset, out))
+        return false;
+#if !AMX_LITTLE_ENDIAN
+      for (auto& v : out)
+        v = read_le<T>((const uint8_t*)&v);
+#endif
+      return true;
+    }
+
     template <typename Fn>
     static bool iter_valarray(
       const uint8_t* buf,
@@ -100,19 +137,480 @@ namespace amx
           return false;
       return true;
     }
+
+    // Names kept in one pool, sorted and searched by binary search. Lookups don't allocate.
+    template <typename Value>
+    class symbol_table
+    {
+      struct entry
+      {
+        uint32_t name;
+        uint32_t name_size;
+        Value value;
+      };
+
+      std::vector<entry> _entries;
+      std::string _names;
+
+      std::string_view name_of(const entry& e) const { return { _names.data() + e.name, e.name_size }; }
+
+    public:
+      void clear()
+      {
+        _entries.clear();
+        _names.clear();
+      }
+
+      // sort() must be called after adding before anything is looked up
+      void add(std::string_view name, Value value)
+      {
+        _entries.push_back({ (uint32_t)_names.size(), (uint32_t)name.size(), value });
+        _names.append(name);
+      }
+
+      // later duplicates replace earlier ones
+      void sort()
+      {
+        std::stable_sort(
+          _entries.begin(),
+          _entries.end(),
+          [this](const entry& a, const entry& b) { return name_of(a) < name_of(b); }
+        );
+        size_t out = 0;
+        for (size_t i = 0; i < _entries.size(); ++i)
+        {
+          if (out && name_of(_entries[out - 1]) == name_of(_entries[i]))
+            --out;
+          _entries[out++] = _entries[i];
+        }
+        _entries.resize(out);
+      }
+
+      // whether adding was in order without duplicates already, so sort() isn't needed
+      bool is_sorted() const
+      {
+        for (size_t i = 1; i < _entries.size(); ++i)
+          if (!(name_of(_entries[i - 1]) < name_of(_entries[i])))
+            return false;
+        return true;
+      }
+
+      // false if not found
+      bool find(std::string_view name, Value& value) const
+      {
+        const auto result = std::lower_bound(
+          _entries.begin(),
+          _entries.end(),
+          name,
+          [this](const entry& e, std::string_view name) { return name_of(e) < name; }
+        );
+        if (result == _entries.end() || name_of(*result) != name)
+          return false;
+        value = result->value;
+        return true;
+      }
+
+      // returns a default constructed value if not found
+      Value find(std::string_view name) const
+      {
+        Value value{};
+        return find(name, value) ? value : Value{};
+      }
+
+      size_t size() const { return _entries.size(); }
+
+      template <typename Fn>
+      void for_each(Fn fn) const
+      {
+        for (const auto& e : _entries)
+          fn(name_of(e), e.value);
+      }
+    };
   }
 
+  // The arguments of a native call as one host span, validated once. Ranges and strings the arguments point to are
+  // also validated whole, instead of translating each cell.
   template <typename Amx>
-  class loader
+  class native_args
+  {
+  public:
+    using amx_t = Amx;
+    using cell = typename amx_t::cell;
+    constexpr static size_t cell_bytes = amx_t::cell_bytes;
+
+    // a string whose first cell is above this is packed, so unpacked characters beyond it can't be stored
+    constexpr static auto unpacked_max = (cell)(((cell)1 << (cell_bytes - 1) * 8) - 1);
+
+    // packed strings hold their characters most significant byte first
+    struct string_arg
+    {
+      const cell* data;
+      // in characters, without the terminator
+      size_t length;
+      bool packed;
+
+      explicit operator bool() const { return data != nullptr; }
+
+      cell operator[](size_t k) const
+      {
+        if (!packed)
+          return data[k];
+        return (cell)((data[k / cell_bytes] >> ((cell_bytes - 1 - k % cell_bytes) * 8)) & 0xFF);
+      }
+
+      // Like strcmp. Two packed strings are compared a cell at a time, as the bytes are in the order of significance.
+      int compare(const string_arg& other) const
+      {
+        const auto common = length < other.length ? length : other.length;
+        size_t k{};
+        if (packed && other.packed)
+        {
+          for (; k < common / cell_bytes; ++k)
+            if (data[k] != other.data[k])
+              return data[k] < other.data[k] ? -1 : 1;
+          k *= cell_bytes;
+        }
+        for (; k < common; ++k)
+          if ((*this)[k] != other[k])
+            return (*this)[k] < other[k] ? -1 : 1;
+        return length < other.length ? -1 : length > other.length ? 1 : 0;
+      }
+
+      // Packed characters are bytes and copied as they are, unpacked ones are code points and encoded as UTF-8.
+      void utf8(std::string& out) const
+      {
+        out.clear();
+        if (packed)
+        {
+          out.resize(length);
+          const auto whole = length / cell_bytes;
+          for (size_t k = 0; k < whole; ++k)
+            for (size_t b = 0; b < cell_bytes; ++b)
+              out[k * cell_bytes + b] = (char)(data[k] >> ((cell_bytes - 1 - b) * 8));
+          for (auto k = whole * cell_bytes; k < length; ++k)
+            out[k] = (char)(*this)[k];
+          return;
+        }
+        out.reserve(length);
+        for (size_t k = 0; k < length; ++k)
+        {
+          const auto c = data[k];
+          if (c < 0x80)
+            out.push_back((char)c);
+          else
+            append_utf8(out, c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF) ? 0xFFFD : (uint32_t)c);
+        }
+      }
+
+      std::string utf8() const
+      {
+        std::string out;
+        utf8(out);
+        return out;
+      }
+    };
+
+  private:
+    amx_t* _amx{};
+    cell* _argv{};
+    size_t _argc{};
+    bool _valid{};
+
+    static void append_utf8(std::string& out, uint32_t c)
+    {
+      if (c < 0x800)
+      {
+        out.push_back((char)(0xC0 | c >> 6));
+      }
+      else
+      {
+        if (c < 0x10000)
+        {
+          out.push_back((char)(0xE0 | c >> 12));
+        }
+        else
+        {
+          out.push_back((char)(0xF0 | c >> 18));
+          out.push_back((char)(0x80 | (c >> 12 & 0x3F)));
+        }
+        out.push_back((char)(0x80 | (c >> 6 & 0x3F)));
+      }
+      out.push_back((char)(0x80 | (c & 0x3F)));
+    }
+
+    // whether any byte of `c` is 0, without looking at them one by one
+    static bool has_zero_byte(cell c)
+    {
+      constexpr auto ones = (cell)((cell)~(cell)0 / 0xFF);
+      constexpr auto highs = (cell)(ones << 7);
+      return ((cell)(c - ones) & (cell)~c & highs) != 0;
+    }
+
+    // the next code point of `utf8` from `k`, with bytes that aren't a valid sequence taken as U+FFFD one by one
+    static uint32_t next_code_point(std::string_view utf8, size_t& k)
+    {
+      const auto first = (uint8_t)utf8[k++];
+      if (first < 0x80)
+        return first;
+      const auto extra =
+        first >= 0xC2 && first <= 0xDF ? 1 :
+        first >= 0xE0 && first <= 0xEF ? 2 :
+        first >= 0xF0 && first <= 0xF4 ? 3 :
+        0;
+      if (!extra)
+        return 0xFFFD;
+      uint32_t c = first & (0x3F >> extra);
+      for (auto i = 0; i < extra; ++i)
+      {
+        const auto next = k + i < utf8.size() ? (uint8_t)utf8[k + i] : 0;
+        if ((next & 0xC0) != 0x80)
+          return 0xFFFD;
+        c = c << 6 | (next & 0x3F);
+      }
+      const auto shortest = extra == 1 ? 0x80 : extra == 2 ? 0x800 : 0x10000;
+      if (c < (uint32_t)shortest || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+        return 0xFFFD;
+      k += extra;
+      return c;
+    }
+
+    // `chars` characters and the terminator at `dst`, character k being char_at(k)
+    template <typename CharAt>
+    static size_t store_chars(cell* dst, size_t chars, bool packed, CharAt char_at)
+    {
+      if (!packed)
+      {
+        for (size_t k = 0; k < chars; ++k)
+          dst[k] = char_at(k);
+        dst[chars] = 0;
+        return chars;
+      }
+      for (size_t k = 0; k <= chars / cell_bytes; ++k)
+      {
+        cell c{};
+        for (size_t b = 0; b < cell_bytes; ++b)
+        {
+          const auto i = k * cell_bytes + b;
+          c = (cell)(c << 8 | (i < chars ? (char_at(i) & 0xFF) : 0));
+        }
+        dst[k] = c;
+      }
+      return chars;
+    }
+
+    // extends a span translated up to `have` cells by the next one, false if it isn't contiguous in host memory
+    static bool extend(amx_t& amx, cell va, cell* first, size_t& have)
+    {
+      size_t more{};
+      const auto next = amx.data_v2p_span((cell)(va + have * cell_bytes), more);
+      if (!next || next != first + have || more == 0)
+        return false;
+      have += more;
+      return true;
+    }
+
+  public:
+    native_args() = default;
+
+    native_args(amx_t& amx, cell argc, cell argv)
+      : _amx(&amx)
+      , _argc((size_t)argc)
+    {
+      _argv = _argc ? span(amx, argv, _argc) : nullptr;
+      _valid = !_argc || _argv;
+      if (!_valid)
+        _argc = 0;
+    }
+
+    // arguments translated already
+    native_args(amx_t& amx, cell argc, cell* argv)
+      : _amx(&amx)
+      , _argv(argv)
+      , _argc((size_t)argc)
+      , _valid(true) {}
+
+    // Host pointer to `cells` cells from data address `va`, or nullptr unless all of them are mapped contiguously.
+    static cell* span(amx_t& amx, cell va, size_t cells)
+    {
+      if (cells > (size_t)(cell)~(cell)0 / cell_bytes)
+        return nullptr;
+      size_t have{};
+      const auto first = amx.data_v2p_span(va, have);
+      if (!first)
+        return nullptr;
+      while (have < cells)
+        if (!extend(amx, va, first, have))
+          return nullptr;
+      return first;
+    }
+
+    // The string at data address `va`, validated up to and including its terminator.
+    static string_arg string_at(amx_t& amx, cell va)
+    {
+      size_t have{};
+      const auto first = amx.data_v2p_span(va, have);
+      if (!first || have == 0)
+        return {};
+      const auto packed = first[0] > unpacked_max;
+      for (size_t k = 0;; ++k)
+      {
+        if (k == have && !extend(amx, va, first, have))
+          return {};
+        const auto c = first[k];
+        if (!packed)
+        {
+          if (c == 0)
+            return { first, k, false };
+          continue;
+        }
+        if (!has_zero_byte(c))
+          continue;
+        for (size_t b = 0; b < cell_bytes; ++b)
+          if (((c >> ((cell_bytes - 1 - b) * 8)) & 0xFF) == 0)
+            return { first, k * cell_bytes + b, true };
+      }
+    }
+
+    // Copies `src` into `cells` cells at `dst`, truncated to fit with its terminator, and returns the characters
+    // copied. Cells past the terminator are left alone. Packed to packed copies whole cells.
+    static size_t copy_string(const string_arg& src, cell* dst, size_t cells, bool packed)
+    {
+      if (!cells)
+        return 0;
+      const auto room = packed ? cells * cell_bytes - 1 : cells - 1;
+      const auto chars = src.length < room ? src.length : room;
+      if (packed && src.packed)
+      {
+        const auto whole = chars / cell_bytes;
+        const auto rest = chars % cell_bytes;
+        std::copy(src.data, src.data + whole, dst);
+        dst[whole] = rest ? (cell)(src.data[whole] & (cell)~((cell)~(cell)0 >> rest * 8)) : (cell)0;
+        return chars;
+      }
+      return store_chars(dst, chars, packed, [&](size_t k) { return src[k]; });
+    }
+
+    // Stores host string `utf8` into `cells` cells at `dst` the same way, as bytes when packed. Unpacked strings get a
+    // code point per cell, with '?' for those above unpacked_max. Returns the characters stored, packed strings aren't
+    // truncated inside of a sequence.
+    static size_t store_string(std::string_view utf8, cell* dst, size_t cells, bool packed)
+    {
+      if (!cells)
+        return 0;
+      if (packed)
+      {
+        auto chars = utf8.size() < cells * cell_bytes - 1 ? utf8.size() : cells * cell_bytes - 1;
+        while (chars && chars < utf8.size() && ((uint8_t)utf8[chars] & 0xC0) == 0x80)
+          --chars;
+        return store_chars(dst, chars, true, [&](size_t k) { return (cell)(uint8_t)utf8[k]; });
+      }
+      size_t chars{};
+      for (size_t k = 0; k < utf8.size() && chars < cells - 1; ++chars)
+      {
+        const auto c = next_code_point(utf8, k);
+        dst[chars] = c > unpacked_max ? (cell)'?' : (cell)c;
+      }
+      dst[chars] = 0;
+      return chars;
+    }
+
+    // false if the argument cells weren't all mapped
+    explicit operator bool() const { return _valid; }
+
+    size_t size() const { return _argc; }
+    cell* data() const { return _argv; }
+    cell* begin() const { return _argv; }
+    cell* end() const { return _argv + _argc; }
+
+    // arguments past the end read as 0
+    cell operator[](size_t i) const { return i < _argc ? _argv[i] : (cell)0; }
+
+    // `cells` cells referenced by argument `i`
+    cell* ref(size_t i, size_t cells = 1) const { return i < _argc ? span(*_amx, _argv[i], cells) : nullptr; }
+
+    // the string argument `i` points to
+    string_arg string(size_t i) const { return i < _argc ? string_at(*_amx, _argv[i]) : string_arg{}; }
+
+    // Stores `utf8` with store_string() into the buffer of `cells` cells argument `i` points to, false unless all of
+    // it is mapped.
+    bool set_string(size_t i, size_t cells, std::string_view utf8, bool packed) const
+    {
+      const auto dst = ref(i, cells);
+      if (!dst)
+        return false;
+      store_string(utf8, dst, cells, packed);
+      return true;
+    }
+  };
+
+  template <typename Amx>
+  class loader;
+
+  template <typename Amx>
+  class native_registry;
+
+  // Everything parsed from a file that stays the same between instances. Immutable once init() succeeded, so a single
+  // program can back any number of loaders, on any number of threads.
+  template <typename Amx>
+  class program
   {
   public:
     using amx_t = Amx;
+    using loader_t = loader<Amx>;
+    using registry_t = native_registry<Amx>;
 
     using cell = typename amx_t::cell;
     using scell = typename amx_t::scell;
     constexpr static size_t cell_bits = amx_t::cell_bits;
 
+    // Returning error::sleep suspends the script with its stack intact, the call returns error::sleep and can be
+    // continued once the result is ready with amx_t::resume_with().
+    using native_fn = error(*)(amx_t* amx, loader_t* loader, void* user, cell argc, cell argv, cell& retval);
+    // Called straight from SYSREQ with the arguments already translated, see amx_t::attach_natives(). `user` is the
+    // user data of the loader's callbacks.
+    using direct_fn = typename amx_t::native_t;
+
+    // Either function is enough, `direct` is preferred when both are set.
+    struct native_arg
+    {
+      const char* name;
+      native_fn callback;
+      direct_fn direct = nullptr;
+    };
+    struct options_arg
+    {
+      // decode the code segment once for the threaded interpreter, only used while single stepping is off
+      bool predecode;
+      // use the code segment straight from the file buffer instead of copying it, when the host is little endian and
+      // the segment is aligned. The buffer must then outlive the program. Ignored with a von Neumann memory manager,
+      // whose scripts could write the buffer through data addresses.
+      bool borrow_code;
+      // look natives up on their first call instead of on load, unresolvable ones then fail with invalid_operand
+      bool lazy_natives;
+      // don't fuse common instruction sequences into superinstructions when predecoding
+      bool no_fusion;
+      // check the code once with amx_t::verify(), failing with invalid_code, and run it without per-fetch checks
+      bool verify;
+      // with overlays, how many decoded overlays the instances share at most when predecoding, 0 for no limit
+      size_t overlay_cache_size;
+      // bytes of stack and heap for each instance instead of what the file asks for, 0 to keep that. Running out
+      // fails with error::stack_heap_collision rather than overwriting the heap.
+      size_t stack_heap_size;
+    };
+
+    // Overlays are decoded when one is switched to, and cached until the least recently used ones are evicted.
+    struct overlay_stats
+    {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+      // decoded overlays in the cache, instances still hold on to the one they run even if it's evicted
+      size_t resident;
+    };
+
   private:
+    friend loader_t;
+
     constexpr static uint16_t expected_magic =
       cell_bits == 32 ? 0xF1E0 :
       cell_bits == 64 ? 0xF1E1 :
@@ -128,105 +626,270 @@ namespace amx
       flag_dseg_init  = 1 << 5,
     };
 
+    // options_arg::borrow_code only applies when scripts can't reach the code through data addresses
+    constexpr static bool can_borrow_code = !detail::shares_backing<typename amx_t::memory_manager_t>::value;
+
     std::vector<cell> _code;
+    // either _code or the borrowed file buffer
+    const cell* _code_view{};
+    size_t _code_size{};
+    // initialized part of the data segment, stack and heap come after it
     std::vector<cell> _data;
+    size_t _stack_heap_cells{};
+    using decoded_stream = std::vector<typename amx_t::decoded_t>;
+    decoded_stream _decoded;
+    // which cells start an instruction, when verified
+    std::vector<uint8_t> _starts;
+    // resolved on load, or on the first SYSREQ with options_arg::lazy_natives. Resolving again always stores the same
+    // pointer, so racing instances on different threads are fine.
+    mutable std::unique_ptr<std::atomic<native_fn>[]> _natives;
+    mutable std::unique_ptr<std::atomic<direct_fn>[]> _directs;
+    size_t _natives_count{};
+    std::vector<uint32_t> _native_names;
+    std::vector<uint64_t> _native_hashes;
+    std::string _native_name_pool;
+    const registry_t* _registry{};
 
-  public:
-    amx_t amx{ &amx_callback_wrapper, this };
-    
-    using native_fn = error(*)(amx_t* amx, loader* loader, void* user, cell argc, cell argv, cell& retval);
-    using single_step_fn = error(*)(amx_t* amx, loader* loader, void* user);
-    using break_fn = error(*)(amx_t* amx, loader* loader, void* user);
-
-    struct native_arg
+    // slices of the code segment, empty without flag_overlay
+    struct overlay_range
     {
-      const char* name;
-      native_fn callback;
+      size_t first;
+      size_t cells;
     };
-    struct callbacks_arg
+    std::vector<overlay_range> _overlays;
+    bool _overlay_decode{};
+    bool _overlay_fuse{};
+    size_t _overlay_cache_size{};
+
+    // the overlay cache, with the most recently used overlay at the front of _overlay_lru
+    struct overlay_slot
     {
-      const native_arg* natives;
-      size_t natives_count;
-      single_step_fn on_single_step;
-      break_fn on_break;
-      void* user_data;
+      std::shared_ptr<const decoded_stream> decoded;
+      std::list<size_t>::iterator position;
     };
+    mutable std::mutex _overlay_lock;
+    mutable std::list<size_t> _overlay_lru;
+    mutable std::vector<overlay_slot> _overlay_slots;
+    mutable overlay_stats _overlay_stats{};
 
-  private:
-    single_step_fn _on_single_step{};
-    break_fn _on_break{};
-    void* _callback_user_data{};
-    std::vector<native_fn> _natives;
+    // Nothing under the lock touches script data, so a fault caught by a guarded data backing can't leave it held.
+    std::shared_ptr<const decoded_stream> decoded_overlay(size_t index) const
+    {
+      std::lock_guard<std::mutex> guard(_overlay_lock);
+      auto& slot = _overlay_slots[index];
+      if (slot.decoded)
+      {
+        ++_overlay_stats.hits;
+        _overlay_lru.splice(_overlay_lru.begin(), _overlay_lru, slot.position);
+        return slot.decoded;
+      }
+      ++_overlay_stats.misses;
+      if (_overlay_cache_size && _overlay_lru.size() >= _overlay_cache_size)
+      {
+        _overlay_slots[_overlay_lru.back()].decoded.reset();
+        _overlay_lru.pop_back();
+        ++_overlay_stats.evictions;
+      }
+      const auto& range = _overlays[index];
+      auto decoded = std::make_shared<decoded_stream>(range.cells + 1);
+      amx_t::decode(_code_view + range.first, range.cells, decoded->data(), _overlay_fuse);
+      _overlay_lru.push_front(index);
+      slot = { std::move(decoded), _overlay_lru.begin() };
+      return slot.decoded;
+    }
+
+    bool resolve_native(const registry_t& registry, size_t index) const
+    {
+      const auto arg = registry.find(_native_name_pool.c_str() + _native_names[index], _native_hashes[index]);
+      if (!arg)
+        return false;
+      _directs[index].store(arg->direct, std::memory_order_relaxed);
+      _natives[index].store(arg->callback, std::memory_order_relaxed);
+      return true;
+    }
+
+    // The code, and that the entry points are instructions.
+    bool verify()
+    {
+      _starts.resize(_code_size);
+      cell cip{};
+      if (amx_t::verify(_code_view, _code_size, _natives_count, _starts.data(), cip) != error::success)
+        return false;
+      const auto is_start = [this](cell address)
+      {
+        return address % sizeof(cell) == 0 && address / sizeof(cell) < _code_size && _starts[address / sizeof(cell)];
+      };
+      bool entries = !_main || is_start(_main);
+      _publics.for_each([&](std::string_view, cell address) { entries = entries && is_start(address); });
+      return entries;
+    }
 
-    std::unordered_map<std::string, cell> _publics;
-    std::unordered_map<std::string, cell> _pubvars;
+    // false if native `index` isn't resolved, nor can be now
+    bool get_native(cell index, native_fn& fn, direct_fn& direct) const
+    {
+      if (index >= _natives_count)
+        return false;
+      const auto i = (size_t)index;
+      direct = _directs[i].load(std::memory_order_relaxed);
+      fn = _natives[i].load(std::memory_order_relaxed);
+      if (fn || direct)
+        return true;
+      if (!_registry || !resolve_native(*_registry, i))
+        return false;
+      direct = _directs[i].load(std::memory_order_relaxed);
+      fn = _natives[i].load(std::memory_order_relaxed);
+      return true;
+    }
+
+    detail::symbol_table<cell> _publics;
+    detail::symbol_table<cell> _pubvars;
 
     cell _main{};
 
   public:
-    cell get_public(const char* v)
+    cell get_public(std::string_view v) const { return _publics.find(v); }
+    cell get_pubvar(std::string_view v) const { return _pubvars.find(v); }
+    cell get_main() const { return _main; }
+
+    // the code segment as loaded, for engines that translate it ahead of time
+    const cell* get_code() const { return _code_view; }
+    size_t get_code_size() const { return _code_size; }
+
+    const detail::symbol_table<cell>& get_publics() const { return _publics; }
+    bool is_verified() const { return !_starts.empty(); }
+    const detail::symbol_table<cell>& get_pubvars() const { return _pubvars; }
+
+    // Publics and main are overlay indexes of programs with overlays.
+    size_t get_overlay_count() const { return _overlays.size(); }
+
+    overlay_stats get_overlay_stats() const
+    {
+      std::lock_guard<std::mutex> guard(_overlay_lock);
+      auto stats = _overlay_stats;
+      stats.resident = _overlay_lru.size();
+      return stats;
+    }
+
+    // the name of the native a SYSREQ operand refers to, empty if there is no such native
+    std::string_view get_native_name(cell index) const
     {
-      const auto result = _publics.find(v);
-      return result == _publics.end() ? 0 : result->second;
+      if (index >= _natives_count)
+        return {};
+      return _native_name_pool.c_str() + _native_names[(size_t)index];
     }
-    cell get_pubvar(const char* v)
+
+    // Natives aren't looked up lazily here, since the registry is temporary.
+    loader_error init(
+      const uint8_t* buf,
+      size_t buf_size,
+      const native_arg* natives,
+      size_t natives_count,
+      const options_arg& options = {}
+    )
     {
-      const auto result = _pubvars.find(v);
-      return result == _pubvars.end() ? 0 : result->second;
+      auto eager = options;
+      eager.lazy_natives = false;
+      return init(buf, buf_size, registry_t{ natives, natives_count }, eager);
     }
-    cell get_main() { return _main; }
 
   private:
-    error amx_callback(cell index, cell stk, cell& pri)
+    struct header
     {
-      if (index == amx_t::cbid_single_step)
-        return _on_single_step ? _on_single_step(&amx, this, _callback_user_data) : error::success;
-      if (index == amx_t::cbid_break)
-        return _on_break ? _on_break(&amx, this, _callback_user_data) : error::success;
-      if (index >= _natives.size())
-        return error::invalid_operand;
-      const auto pargc = amx.data_v2p(stk);
-      if (!pargc)
-        return error::access_violation;
-      return _natives[(size_t)index](&amx, this, _callback_user_data, (*pargc / sizeof(cell)), stk + sizeof(cell), pri);
+      uint32_t size;
+      uint16_t flags;
+      uint16_t defsize;
+      uint32_t cod;
+      uint32_t dat;
+      uint32_t hea;
+      uint32_t stp;
+      uint32_t cip;
+      uint32_t publics;
+      uint32_t natives;
+      uint32_t libraries;
+      uint32_t pubvars;
+      uint32_t tags;
+      uint32_t nametable;
+      uint32_t overlays;
+    };
+
+    constexpr static size_t header_size = 60;
+
+    // Cache files, see write_cache().
+    constexpr static uint32_t cache_magic = 0x43415050; // "PPAC"
+    constexpr static uint16_t cache_version = 1;
+    constexpr static size_t cache_header_size = 80;
+
+    void clear()
+    {
+      _code.clear();
+      _code_view = nullptr;
+      _code_size = 0;
+      _data.clear();
+      _decoded.clear();
+      _starts.clear();
+      _natives.reset();
+      _directs.reset();
+      _natives_count = 0;
+      _native_names.clear();
+      _native_hashes.clear();
+      _native_name_pool.clear();
+      _registry = nullptr;
+      _publics.clear();
+      _pubvars.clear();
+      _overlays.clear();
+      _overlay_decode = false;
+      _overlay_lru.clear();
+      _overlay_slots.clear();
+      _overlay_stats = {};
     }
 
-    static error amx_callback_wrapper(amx_t*, void* user_data, cell index, cell stk, cell& pri)
+    void add_native(std::string_view name, uint64_t hash)
     {
-      return ((loader*)user_data)->amx_callback(index, stk, pri);
+      _native_names.push_back((uint32_t)_native_name_pool.size());
+      _native_hashes.push_back(hash);
+      _native_name_pool.append(name);
+      _native_name_pool.push_back('\0');
     }
 
-  public:
-    loader_error init(const uint8_t* buf, size_t buf_size, const callbacks_arg& callbacks)
+    // Once every native was added.
+    loader_error bind_natives(const registry_t& natives, bool lazy)
+    {
+      _natives_count = _native_names.size();
+      _natives.reset(new std::atomic<native_fn>[_natives_count]());
+      _directs.reset(new std::atomic<direct_fn>[_natives_count]());
+      if (lazy)
+        _registry = &natives;
+      else
+        for (size_t i = 0; i < _natives_count; ++i)
+          if (!resolve_native(natives, i))
+            return loader_error::native_not_resolved;
+      return loader_error::success;
+    }
+
+    // The first header_size bytes of the file.
+    static loader_error read_header(const uint8_t* buf, header& h)
     {
       static_assert(expected_magic != 0, "unsupported cell size");
       using namespace detail;
 
-      _on_single_step = callbacks.on_single_step;
-      _on_break = callbacks.on_break;
-      _callback_user_data = callbacks.user_data;
-
-      if (buf_size < 60)
-        return loader_error::invalid_file;
-
-      const auto size = read_le<uint32_t>(buf);
+      h.size = read_le<uint32_t>(buf);
       const auto magic = read_le<uint16_t>(buf + 4);
       const auto file_version = *(buf + 6);
       const auto amx_version = *(buf + 7);
-      const auto flags = read_le<uint16_t>(buf + 8);
-      const auto defsize = read_le<uint16_t>(buf + 10);
-      const auto cod = read_le<uint32_t>(buf + 12);
-      const auto dat = read_le<uint32_t>(buf + 16);
-      const auto hea = read_le<uint32_t>(buf + 20);
-      const auto stp = read_le<uint32_t>(buf + 24);
-      const auto cip = read_le<uint32_t>(buf + 28);
-      const auto publics = read_le<uint32_t>(buf + 32);
-      const auto natives = read_le<uint32_t>(buf + 36);
-      const auto libraries = read_le<uint32_t>(buf + 40);
-      const auto pubvars = read_le<uint32_t>(buf + 44);
-      const auto tags = read_le<uint32_t>(buf + 48);
-      //const auto nametable = read_le<uint32_t>(buf + 52);
-      //const auto overlays = read_le<uint32_t>(buf + 56);
+      h.flags = read_le<uint16_t>(buf + 8);
+      h.defsize = read_le<uint16_t>(buf + 10);
+      h.cod = read_le<uint32_t>(buf + 12);
+      h.dat = read_le<uint32_t>(buf + 16);
+      h.hea = read_le<uint32_t>(buf + 20);
+      h.stp = read_le<uint32_t>(buf + 24);
+      h.cip = read_le<uint32_t>(buf + 28);
+      h.publics = read_le<uint32_t>(buf + 32);
+      h.natives = read_le<uint32_t>(buf + 36);
+      h.libraries = read_le<uint32_t>(buf + 40);
+      h.pubvars = read_le<uint32_t>(buf + 44);
+      h.tags = read_le<uint32_t>(buf + 48);
+      h.nametable = read_le<uint32_t>(buf + 52);
+      h.overlays = read_le<uint32_t>(buf + 56);
       if (magic != expected_magic)
       {
         switch (magic)
@@ -239,61 +902,31 @@ namespace amx
           return loader_error::invalid_file;
         }
       }
-      if (size > buf_size)
-        return loader_error::invalid_file;
       if (file_version != 11)
         return loader_error::unsupported_file_version;
       if (amx_version > amx_t::version)
         return loader_error::unsupported_amx_version;
-      if (flags & flag_overlay || flags & flag_sleep)
-        return loader_error::feature_not_supported;
-      if (defsize < 8)
+      if (h.defsize < 8)
         return loader_error::invalid_file;
-      
-      _code.clear();
-      auto success = iter_valarray(
-        buf,
-        buf_size,
-        cod,
-        dat,
-        sizeof(cell),
-        [&](const uint8_t* p)
-        {
-          _code.push_back(read_le<cell>(p));
-          return true;
-        }
-      );
-      if (!success)
-        return loader_error::invalid_file;
-      
-      _data.clear();
-      success = iter_valarray(
-        buf,
-        buf_size,
-        dat,
-        hea,
-        sizeof(cell),
-        [&](const uint8_t* p)
-        {
-          _data.push_back(read_le<cell>(p));
-          return true;
-        }
-      );
-      if (!success)
-        return loader_error::invalid_file;
-      
-      const auto extra_size = (stp - hea) + sizeof(cell) - 1;
-      const auto data_oldsize = _data.size();
-      _data.resize(data_oldsize + extra_size / sizeof(cell));
+      return loader_error::success;
+    }
+
+    // Everything but the segments, from the first `buf_size` bytes of the file that hold the tables and names.
+    loader_error read_tables(const uint8_t* buf, size_t buf_size, const header& h, const registry_t& natives, bool lazy)
+    {
+      using namespace detail;
 
-      _main = (cip == (uint32_t)-1 ? 0 : cip);
+      const auto extra_size = (h.stp - h.hea) + sizeof(cell) - 1;
+      _stack_heap_cells = extra_size / sizeof(cell);
 
-      success = iter_valarray(
+      _main = (h.cip == (uint32_t)-1 ? 0 : h.cip);
+
+      auto success = iter_valarray(
         buf,
         buf_size,
-        publics,
-        natives,
-        defsize,
+        h.publics,
+        h.natives,
+        h.defsize,
         [&](const uint8_t* p)
         {
           const auto address = read_le<uint32_t>(p);
@@ -304,8 +937,7 @@ namespace amx
               break;
           if (nameend >= buf_size)
             return false;
-          std::string name{ (const char*)buf + nameofs, (const char*)buf + nameend };
-          this->_publics[name] = address;
+          this->_publics.add({ (const char*)buf + nameofs, nameend - nameofs }, address);
           return true;
         }
       );
@@ -313,13 +945,12 @@ namespace amx
       if (!success)
         return loader_error::invalid_file;
 
-      bool native_not_found = false;
       success = iter_valarray(
         buf,
         buf_size,
-        natives,
-        libraries,
-        defsize,
+        h.natives,
+        h.libraries,
+        h.defsize,
         [&](const uint8_t* p)
         {
           const auto nameofs = read_le<uint32_t>(p + 4);
@@ -329,35 +960,28 @@ namespace amx
               break;
           if (nameend >= buf_size)
             return false;
-          std::string name{ (const char*)buf + nameofs, (const char*)buf + nameend };
-          const auto callbacks_natives_end = callbacks.natives + callbacks.natives_count;
-          const auto result = std::find_if(
-            callbacks.natives,
-            callbacks_natives_end,
-            [&name](const native_arg& current) { return name == current.name; }
-          );
-          if (result == callbacks_natives_end)
-          {
-            native_not_found = true;
-            return false;
-          }
-          this->_natives.push_back(result->callback);
+          const std::string_view name{ (const char*)buf + nameofs, nameend - nameofs };
+          this->add_native(name, name_hash(name));
           return true;
         }
       );
 
       if (!success)
-        return native_not_found ? loader_error::native_not_resolved : loader_error::invalid_file;
+        return loader_error::invalid_file;
+
+      const auto result = bind_natives(natives, lazy);
+      if (result != loader_error::success)
+        return result;
 
-      if (libraries != pubvars)
+      if (h.libraries != h.pubvars)
         return loader_error::feature_not_supported;
 
       success = iter_valarray(
         buf,
         buf_size,
-        pubvars,
-        tags,
-        defsize,
+        h.pubvars,
+        h.tags,
+        h.defsize,
         [&](const uint8_t* p)
         {
           const auto address = read_le<uint32_t>(p);
@@ -368,8 +992,7 @@ namespace amx
               break;
           if (nameend >= buf_size)
             return false;
-          std::string name{ (const char*)buf + nameofs, (const char*)buf + nameend };
-          this->_pubvars[name] = address;
+          this->_pubvars.add({ (const char*)buf + nameofs, nameend - nameofs }, address);
           return true;
         }
       );
@@ -377,29 +1000,982 @@ namespace amx
       if (!success)
         return loader_error::invalid_file;
 
+      if (h.flags & flag_overlay)
+      {
+        // up to the name table if that follows, return addresses hold offsets and indexes in half a cell each
+        const auto end = h.nametable > h.overlays ? h.nametable : h.cod;
+        const auto code_bytes = (uint64_t)(h.dat - h.cod);
+        constexpr auto half_limit = (uint64_t)1 << (cell_bits / 2);
+        success = iter_valarray(
+          buf,
+          buf_size,
+          h.overlays,
+          end,
+          8,
+          [&](const uint8_t* p)
+          {
+            const auto offset = read_le<uint32_t>(p);
+            const auto size = read_le<uint32_t>(p + 4);
+            if (offset % sizeof(cell) != 0 || size % sizeof(cell) != 0 || size == 0 || size >= half_limit)
+              return false;
+            if (offset > code_bytes || size > code_bytes - offset)
+              return false;
+            this->_overlays.push_back({ offset / sizeof(cell), size / sizeof(cell) });
+            return true;
+          }
+        );
+        if (!success || _overlays.empty() || _overlays.size() > half_limit)
+          return loader_error::invalid_file;
+      }
+
+      _publics.sort();
+      _pubvars.sort();
+      return loader_error::success;
+    }
+
+    // Once the segments are in place.
+    loader_error finish(const options_arg& options)
+    {
+      if (options.stack_heap_size)
+        _stack_heap_cells = (options.stack_heap_size + sizeof(cell) - 1) / sizeof(cell);
+
+      if (!_overlays.empty())
+      {
+        // overlays are decoded one at a time, once an instance switches to them
+        if (options.verify)
+          return loader_error::feature_not_supported;
+        _overlay_decode = options.predecode;
+        _overlay_fuse = !options.no_fusion;
+        _overlay_cache_size = options.overlay_cache_size;
+        _overlay_slots.resize(_overlays.size());
+        return loader_error::success;
+      }
+
+      if (options.verify && !verify())
+      {
+        _starts.clear();
+        return loader_error::invalid_code;
+      }
+
+      if (options.predecode)
+      {
+        _decoded.resize(_code_size + 1);
+        amx_t::decode(_code_view, _code_size, _decoded.data(), !options.no_fusion, is_verified() ? _starts.data() : nullptr);
+      }
+
+      return loader_error::success;
+    }
+
+  public:
+    // With options_arg::lazy_natives the registry must outlive the program.
+    loader_error init(
+      const uint8_t* buf,
+      size_t buf_size,
+      const registry_t& natives,
+      const options_arg& options = {}
+    )
+    {
+      using namespace detail;
+
+      clear();
+
+      if (buf_size < header_size)
+        return loader_error::invalid_file;
+
+      header h{};
+      auto result = read_header(buf, h);
+      if (result != loader_error::success)
+        return result;
+      if (h.size > buf_size)
+        return loader_error::invalid_file;
+
+      auto success = false;
+      if (can_borrow_code && options.borrow_code && AMX_LITTLE_ENDIAN && (uintptr_t)(buf + h.cod) % alignof(cell) == 0)
+      {
+        success = h.cod <= h.dat && h.dat <= buf_size && (h.dat - h.cod) % sizeof(cell) == 0;
+        _code_view = (const cell*)(buf + h.cod);
+        _code_size = (h.dat - h.cod) / sizeof(cell);
+      }
+      else
+      {
+        success = read_le_array(buf, buf_size, h.cod, h.dat, _code);
+        _code_view = _code.data();
+        _code_size = _code.size();
+      }
+      if (!success)
+        return loader_error::invalid_file;
+
+      success = read_le_array(buf, buf_size, h.dat, h.hea, _data);
+      if (!success)
+        return loader_error::invalid_file;
+
+      result = read_tables(buf, buf_size, h, natives, options.lazy_natives);
+      if (result != loader_error::success)
+        return result;
+
+      return finish(options);
+    }
+
+    // Fills `dst` with the next up to `size` bytes of the file, returning how many it did. Fewer only at the end of the
+    // file or on an error.
+    using read_fn = size_t(*)(void* user, uint8_t* dst, size_t size);
+
+    // Reads the file in order through `read`, without the whole file ever being in memory: the header, tables and
+    // names before the code segment are buffered, then the segments are read straight into place, and whatever follows
+    // them isn't read at all. Names have to be before the code segment, as the compiler puts them.
+    // options_arg::borrow_code doesn't apply. Verifying and predecoding still wait for the whole code segment: jump
+    // targets and case tables can be anywhere in it, and predecoding verified code needs where its instructions start.
+    loader_error init(read_fn read, void* user, const registry_t& natives, const options_arg& options = {})
+    {
+      using namespace detail;
+
+      clear();
+
+      const auto read_all = [&](uint8_t* dst, size_t size)
+      {
+        while (size)
+        {
+          const auto got = read(user, dst, size);
+          if (got == 0 || got > size)
+            return false;
+          dst += got;
+          size -= got;
+        }
+        return true;
+      };
+
+      std::vector<uint8_t> tables(header_size);
+      if (!read_all(tables.data(), tables.size()))
+        return loader_error::invalid_file;
+
+      header h{};
+      auto result = read_header(tables.data(), h);
+      if (result != loader_error::success)
+        return result;
+      if (h.cod < header_size || h.cod > h.dat || h.dat > h.hea || h.hea > h.size)
+        return loader_error::invalid_file;
+      if ((h.dat - h.cod) % sizeof(cell) != 0 || (h.hea - h.dat) % sizeof(cell) != 0)
+        return loader_error::invalid_file;
+
+      tables.resize(h.cod);
+      if (!read_all(tables.data() + header_size, h.cod - header_size))
+        return loader_error::invalid_file;
+      result = read_tables(tables.data(), tables.size(), h, natives, options.lazy_natives);
+      if (result != loader_error::success)
+        return result;
+      tables = {};
+
+      _code.resize((h.dat - h.cod) / sizeof(cell));
+      if (!read_all((uint8_t*)_code.data(), _code.size() * sizeof(cell)))
+        return loader_error::invalid_file;
+      _data.resize((h.hea - h.dat) / sizeof(cell));
+      if (!read_all((uint8_t*)_data.data(), _data.size() * sizeof(cell)))
+        return loader_error::invalid_file;
+#if !AMX_LITTLE_ENDIAN
+      for (auto& v : _code)
+        v = read_le<cell>((const uint8_t*)&v);
+      for (auto& v : _data)
+        v = read_le<cell>((const uint8_t*)&v);
+#endif
+      _code_view = _code.data();
+      _code_size = _code.size();
+
+      return finish(options);
+    }
+
+    loader_error init(
+      read_fn read,
+      void* user,
+      const native_arg* natives,
+      size_t natives_count,
+      const options_arg& options = {}
+    )
+    {
+      auto eager = options;
+      eager.lazy_natives = false;
+      return init(read, user, registry_t{ natives, natives_count }, eager);
+    }
+
+    // Writes the program as loaded into a cache file for init_cached(), which needs next to no parsing: segments are
+    // cells already, symbols are sorted, and natives carry the hash of their name. Overwrites `out`.
+    // The format is little endian, with every section 8 byte aligned:
+    //  - header: magic (u32), version (u16), cell bits (u8), 0 (u8), then (offset, count) u32 pairs for the code and
+    //    data cells, publics, pubvars, natives, overlays and the bytes of the name pool, then stack and heap cells
+    //    (u32), 0 (u32) and main (u64)
+    //  - publics and pubvars, by name: name offset (u32), name size (u32) and value (u64)
+    //  - natives, by index: name hash (u64), name offset (u32) and name size (u32)
+    //  - overlays: first cell (u32) and cells (u32)
+    // Nothing ties a cache to the file it was made from, keeping it up to date is up to the caller.
+    void write_cache(std::vector<uint8_t>& out) const
+    {
+      out.assign(cache_header_size, 0);
+      const auto put = [&](size_t at, uint64_t v, size_t bytes)
+      {
+        for (size_t i = 0; i < bytes; ++i)
+          out[at + i] = (uint8_t)(v >> (8 * i));
+      };
+      const auto append = [&](uint64_t v, size_t bytes)
+      {
+        out.resize(out.size() + bytes);
+        put(out.size() - bytes, v, bytes);
+      };
+      const auto section = [&](size_t at, size_t count)
+      {
+        out.resize((out.size() + 7) & ~(size_t)7);
+        put(at, out.size(), 4);
+        put(at + 4, count, 4);
+      };
+
+      put(0, cache_magic, 4);
+      put(4, cache_version, 2);
+      put(6, cell_bits, 1);
+
+      section(8, _code_size);
+      for (size_t i = 0; i < _code_size; ++i)
+        append(_code_view[i], sizeof(cell));
+      section(16, _data.size());
+      for (const auto v : _data)
+        append(v, sizeof(cell));
+
+      std::string names;
+      const auto symbols = [&](size_t at, const detail::symbol_table<cell>& table)
+      {
+        section(at, table.size());
+        table.for_each([&](std::string_view name, cell value)
+        {
+          append(names.size(), 4);
+          append(name.size(), 4);
+          append(value, 8);
+          names.append(name);
+        });
+      };
+      symbols(24, _publics);
+      symbols(32, _pubvars);
+
+      section(40, _natives_count);
+      for (size_t i = 0; i < _natives_count; ++i)
+      {
+        const auto name = get_native_name((cell)i);
+        append(_native_hashes[i], 8);
+        append(names.size(), 4);
+        append(name.size(), 4);
+        names.append(name);
+      }
+
+      section(48, _overlays.size());
+      for (const auto& range : _overlays)
+      {
+        append(range.first, 4);
+        append(range.cells, 4);
+      }
+
+      section(56, names.size());
+      out.insert(out.end(), names.begin(), names.end());
+
+      put(64, _stack_heap_cells, 4);
+      put(72, _main, 8);
+    }
+
+    // Loads a file made by write_cache() for the same cell size. With options_arg::borrow_code the code is used in
+    // place, so a mapped file works without copying it, and must then outlive the program.
+    loader_error init_cached(const uint8_t* buf, size_t buf_size, const registry_t& natives, const options_arg& options = {})
+    {
+      using namespace detail;
+
+      clear();
+
+      if (buf_size < cache_header_size || read_le<uint32_t>(buf) != cache_magic)
+        return loader_error::invalid_file;
+      if (read_le<uint16_t>(buf + 4) != cache_version)
+        return loader_error::unsupported_file_version;
+      if (buf[6] != cell_bits)
+        return loader_error::wrong_cell_size;
+
+      // the begin and count of the section described at `at`
+      const auto section = [&](size_t at, size_t entry_size, const uint8_t*& begin, size_t& count)
+      {
+        const auto offset = (size_t)read_le<uint32_t>(buf + at);
+        count = read_le<uint32_t>(buf + at + 4);
+        begin = buf + offset;
+        return offset % 8 == 0 && offset <= buf_size && count <= (buf_size - offset) / entry_size;
+      };
+
+      const uint8_t* p{};
+      size_t count{};
+      if (!section(8, sizeof(cell), p, count))
+        return loader_error::invalid_file;
+      const auto code_offset = (size_t)(p - buf);
+      if (can_borrow_code && options.borrow_code && AMX_LITTLE_ENDIAN && (uintptr_t)p % alignof(cell) == 0)
+      {
+        _code_view = (const cell*)p;
+        _code_size = count;
+      }
+      else
+      {
+        if (!read_le_array(buf, buf_size, code_offset, code_offset + count * sizeof(cell), _code))
+          return loader_error::invalid_file;
+        _code_view = _code.data();
+        _code_size = _code.size();
+      }
+
+      if (!section(16, sizeof(cell), p, count))
+        return loader_error::invalid_file;
+      if (!read_le_array(buf, buf_size, (size_t)(p - buf), (size_t)(p - buf) + count * sizeof(cell), _data))
+        return loader_error::invalid_file;
+
+      const uint8_t* names{};
+      size_t names_size{};
+      if (!section(56, 1, names, names_size))
+        return loader_error::invalid_file;
+      bool success = true;
+      const auto name_at = [&](const uint8_t* entry)
+      {
+        const auto offset = (size_t)read_le<uint32_t>(entry);
+        const auto size = (size_t)read_le<uint32_t>(entry + 4);
+        success = success && offset <= names_size && size <= names_size - offset;
+        return success ? std::string_view{ (const char*)names + offset, size } : std::string_view{};
+      };
+
+      const auto symbols = [&](size_t at, detail::symbol_table<cell>& table)
+      {
+        if (!section(at, 16, p, count))
+          return false;
+        for (size_t i = 0; i < count; ++i, p += 16)
+          table.add(name_at(p), (cell)read_le<uint64_t>(p + 8));
+        return success && table.is_sorted();
+      };
+      if (!symbols(24, _publics) || !symbols(32, _pubvars))
+        return loader_error::invalid_file;
+
+      if (!section(40, 16, p, count))
+        return loader_error::invalid_file;
+      for (size_t i = 0; i < count; ++i, p += 16)
+        add_native(name_at(p + 8), read_le<uint64_t>(p));
+      if (!success)
+        return loader_error::invalid_file;
+      const auto result = bind_natives(natives, options.lazy_natives);
+      if (result != loader_error::success)
+        return result;
+
+      if (!section(48, 8, p, count))
+        return loader_error::invalid_file;
+      constexpr auto half_limit = (uint64_t)1 << (cell_bits / 2);
+      for (size_t i = 0; i < count; ++i, p += 8)
+      {
+        const overlay_range range{ read_le<uint32_t>(p), read_le<uint32_t>(p + 4) };
+        if (range.cells == 0 || range.cells * sizeof(cell) >= half_limit || range.first > _code_size)
+          return loader_error::invalid_file;
+        if (range.cells > _code_size - range.first)
+          return loader_error::invalid_file;
+        _overlays.push_back(range);
+      }
+      if (_overlays.size() > half_limit)
+        return loader_error::invalid_file;
+
+      _stack_heap_cells = read_le<uint32_t>(buf + 64);
+      _main = (cell)read_le<uint64_t>(buf + 72);
+
+      return finish(options);
+    }
+
+    loader_error init_cached(
+      const uint8_t* buf,
+      size_t buf_size,
+      const native_arg* natives,
+      size_t natives_count,
+      const options_arg& options = {}
+    )
+    {
+      auto eager = options;
+      eager.lazy_natives = false;
+      return init_cached(buf, buf_size, registry_t{ natives, natives_count }, eager);
+    }
+
+    program() = default;
+
+    program(const program&) = delete;
+    program(program&&) = delete;
+
+    program& operator=(const program&) = delete;
+    program& operator=(program&&) = delete;
+  };
+
+  // Natives sorted by name once, shareable between any number of programs. Lookups don't allocate.
+  template <typename Amx>
+  class native_registry
+  {
+  public:
+    using program_t = program<Amx>;
+    using native_fn = typename program_t::native_fn;
+    using native_arg = typename program_t::native_arg;
+
+  private:
+    std::vector<native_arg> _natives;
+    // indexes into _natives sorted by the hash of their name
+    std::vector<std::pair<uint64_t, size_t>> _hashes;
+
+    static int compare(const char* a, std::string_view b)
+    {
+      for (size_t i = 0; i < b.size(); ++i)
+        if (a[i] != b[i])
+          return (uint8_t)a[i] < (uint8_t)b[i] ? -1 : 1;
+      return a[b.size()] ? 1 : 0;
+    }
+
+  public:
+    native_registry() = default;
+    native_registry(const native_arg* natives, size_t natives_count)
+      : _natives(natives, natives + natives_count)
+    {
+      std::sort(
+        _natives.begin(),
+        _natives.end(),
+        [](const native_arg& a, const native_arg& b) { return strcmp(a.name, b.name) < 0; }
+      );
+      _hashes.reserve(_natives.size());
+      for (size_t i = 0; i < _natives.size(); ++i)
+        _hashes.emplace_back(detail::name_hash(_natives[i].name), i);
+      std::sort(_hashes.begin(), _hashes.end());
+    }
+
+    native_fn find(std::string_view name) const
+    {
+      const auto result = std::lower_bound(
+        _natives.begin(),
+        _natives.end(),
+        name,
+        [](const native_arg& current, std::string_view name) { return compare(current.name, name) < 0; }
+      );
+      if (result == _natives.end() || compare(result->name, name) != 0)
+        return nullptr;
+      return result->callback;
+    }
+
+    // The whole entry with the hash of the name known, comparing names only on equal hashes.
+    const native_arg* find(std::string_view name, uint64_t hash) const
+    {
+      auto it = std::lower_bound(_hashes.begin(), _hashes.end(), std::make_pair(hash, (size_t)0));
+      for (; it != _hashes.end() && it->first == hash; ++it)
+        if (compare(_natives[it->second].name, name) == 0)
+          return &_natives[it->second];
+      return nullptr;
+    }
+
+    size_t size() const { return _natives.size(); }
+  };
+
+  namespace detail
+  {
+    template <typename Amx, typename Fn>
+    struct static_native;
+
+    template <typename Amx, typename R, typename... Args>
+    struct static_native<Amx, R(*)(Args...)>
+    {
+      using cell = typename Amx::cell;
+
+      template <auto Fn, size_t... I>
+      static cell invoke(const cell* argv, std::index_sequence<I...>)
+      {
+        if constexpr (std::is_void<R>::value)
+        {
+          Fn((Args)argv[I]...);
+          return 0;
+        }
+        else
+        {
+          return (cell)Fn((Args)argv[I]...);
+        }
+      }
+
+      template <auto Fn>
+      static error call(Amx*, void*, cell argc, cell* argv, cell& retval)
+      {
+        if ((size_t)argc < sizeof...(Args))
+          return error::invalid_operand;
+        retval = invoke<Fn>(argv, std::index_sequence_for<Args...>{});
+        return error::success;
+      }
+    };
+  }
+
+  // A native calling `Fn` directly, a function taking cells and returning a cell or nothing. The arguments are
+  // unpacked inline from the stack, calls with fewer arguments than `Fn` takes fail with error::invalid_operand.
+  template <typename Amx, auto Fn>
+  constexpr typename program<Amx>::native_arg make_native(const char* name)
+  {
+    return { name, nullptr, &detail::static_native<Amx, decltype(Fn)>::template call<Fn> };
+  }
+
+  // A running instance of a program. Owns the data segment and the registers, the code is shared with the program.
+  // An instance, and the amx in it, must only be used by one thread at a time.
+  template <typename Amx>
+  class loader
+  {
+  public:
+    using amx_t = Amx;
+    using program_t = program<Amx>;
+
+    using cell = typename amx_t::cell;
+    using scell = typename amx_t::scell;
+    constexpr static size_t cell_bits = amx_t::cell_bits;
+
+  private:
+    using data_backing_t = std::remove_reference_t<decltype(std::declval<amx_t&>().mem.data())>;
+
+    std::shared_ptr<const program_t> _program;
+    // the mapped code, only used when scripts can write it through data addresses
+    std::vector<cell> _code;
+    // unused if the backing owns its storage
+    std::vector<cell> _data;
+    // the mapped data segment
+    cell* _data_view{};
+    size_t _data_size{};
+    // cells mapped at COD, the whole code segment or the current overlay
+    size_t _code_mapped{};
+    size_t _overlay_mapped{};
+    std::shared_ptr<const typename program_t::decoded_stream> _overlay_decoded;
+
+  public:
+    amx_t amx{ &amx_callback_wrapper, this };
+    
+    using native_fn = typename program_t::native_fn;
+    using direct_fn = typename program_t::direct_fn;
+    using single_step_fn = error(*)(amx_t* amx, loader* loader, void* user);
+    using break_fn = error(*)(amx_t* amx, loader* loader, void* user);
+
+    using native_arg = typename program_t::native_arg;
+    using options_arg = typename program_t::options_arg;
+    using native_args_t = native_args<amx_t>;
+    struct callbacks_arg
+    {
+      const native_arg* natives;
+      size_t natives_count;
+      single_step_fn on_single_step;
+      break_fn on_break;
+      void* user_data;
+    };
+
+  private:
+    single_step_fn _on_single_step{};
+    break_fn _on_break{};
+    void* _callback_user_data{};
+    native_args_t _args;
+
+    // The native table of the amx. Natives resolved on load with a direct function are bound to it as they are, the
+    // others to bound_native(), which also resolves lazy ones.
+    struct binding_context
+    {
+      loader* self;
+      cell index;
+    };
+    std::vector<typename amx_t::native_binding> _bindings;
+    std::vector<binding_context> _binding_contexts;
+
+  public:
+    // Arguments of the innermost native being called, the same cells as its (argc, argv) but already translated.
+    const native_args_t& args() const { return _args; }
+
+    cell get_public(std::string_view v) const { return _program ? _program->get_public(v) : 0; }
+    cell get_pubvar(std::string_view v) const { return _program ? _program->get_pubvar(v) : 0; }
+    cell get_main() const { return _program ? _program->get_main() : 0; }
+
+    // A public looked up once and called any number of times afterwards, valid for every instance of the program.
+    class public_handle
+    {
+      friend loader;
+
+      cell _cip{};
+
+      explicit public_handle(cell cip) : _cip(cip) {}
+
+    public:
+      public_handle() = default;
+
+      explicit operator bool() const { return _cip != 0; }
+      cell get() const { return _cip; }
+    };
+
+    public_handle find_public(std::string_view v) const { return public_handle{ get_public(v) }; }
+
+    error call(public_handle fn, cell& pri, typename amx_t::argument_span args = {}, uint64_t budget = amx_t::unlimited_budget)
+    {
+      if (!fn)
+        return error::invalid_operand;
+      return amx.call(fn._cip, pri, args, budget);
+    }
+
+    error call_batch(
+      public_handle fn,
+      const cell* args,
+      size_t arity,
+      cell* results,
+      size_t count,
+      size_t& completed,
+      uint64_t budget = amx_t::unlimited_budget
+    )
+    {
+      completed = 0;
+      if (!fn)
+        return error::invalid_operand;
+      return amx.call_batch(fn._cip, args, arity, results, count, completed, budget);
+    }
+
+    const std::shared_ptr<const program_t>& get_program() const { return _program; }
+
+    // Saved data segment and registers of an instance, restorable into any instance of the same program.
+    struct snapshot_t
+    {
+      std::vector<cell> data;
+      cell PRI{};
+      cell ALT{};
+      cell FRM{};
+      cell CIP{};
+      cell STP{};
+      cell STK{};
+      cell HEA{};
+      cell overlay{};
+    };
+
+    // Reuses the storage of `out`, so taking snapshots repeatedly into the same object doesn't allocate.
+    void snapshot(snapshot_t& out) const
+    {
+      out.data.assign(_data_view, _data_view + _data_size);
+      out.PRI = amx.PRI;
+      out.ALT = amx.ALT;
+      out.FRM = amx.FRM;
+      out.CIP = amx.CIP;
+      out.STP = amx.STP;
+      out.STK = amx.STK;
+      out.HEA = amx.HEA;
+      out.overlay = amx.get_overlay();
+    }
+
+    snapshot_t snapshot() const
+    {
+      snapshot_t result;
+      snapshot(result);
+      return result;
+    }
+
+    // The data segment is restored with one bulk copy into the already mapped buffer, so DAT and COD stay valid.
+    // Backings can't tell reads from writes, therefore the whole segment is copied rather than only dirty pages.
+    bool restore(const snapshot_t& snap)
+    {
+      if (!_program || snap.data.size() != _data_size)
+        return false;
+      if (snap.overlay != amx.get_overlay() && amx.switch_overlay(snap.overlay) != error::success)
+        return false;
+      std::copy(snap.data.begin(), snap.data.end(), _data_view);
+      amx.PRI = snap.PRI;
+      amx.ALT = snap.ALT;
+      amx.FRM = snap.FRM;
+      amx.CIP = snap.CIP;
+      amx.STP = snap.STP;
+      amx.STK = snap.STK;
+      amx.HEA = snap.HEA;
+      return true;
+    }
+
+    // Returns the instance to the state right after init(), without parsing anything again. Also clears a fault caught
+    // by a guarded data backing, which may have skipped restoring args().
+    void reset()
+    {
+      if (!_program)
+        return;
+      amx.clear_fault();
+      _args = {};
+      const auto& initial = _program->_data;
+      std::copy(initial.begin(), initial.end(), _data_view);
+      std::fill(_data_view + initial.size(), _data_view + _data_size, (cell)0);
+      amx.PRI = 0;
+      amx.ALT = 0;
+      amx.FRM = 0;
+      amx.CIP = 0;
+      amx.STK = amx.STP = (cell)((_data_size - 1) * sizeof(cell));
+      amx.HEA = (cell)(initial.size() * sizeof(cell));
+      if (amx.get_overlay() != 0)
+        amx.switch_overlay(0);
+    }
+
+  private:
+    error amx_callback(cell index, cell stk, cell& pri)
+    {
+      if (index == amx_t::cbid_single_step)
+        return _on_single_step ? _on_single_step(&amx, this, _callback_user_data) : error::success;
+      if (index == amx_t::cbid_break)
+        return _on_break ? _on_break(&amx, this, _callback_user_data) : error::success;
+      native_fn native{};
+      direct_fn direct{};
+      if (!_program->get_native(index, native, direct))
+        return error::invalid_operand;
+      const auto pargc = amx.data_v2p(stk);
+      if (!pargc)
+        return error::access_violation;
+      const auto argc = (cell)(*pargc / sizeof(cell));
+      const auto argv = (cell)(stk + sizeof(cell));
+      return call_native(native, direct, native_args_t{ amx, argc, argv }, argc, argv, pri);
+    }
+
+    error call_native(native_fn native, direct_fn direct, const native_args_t& args, cell argc, cell argv, cell& pri)
+    {
+      if (direct)
+        return args ? direct(&amx, _callback_user_data, argc, args.data(), pri) : error::access_violation;
+      // natives can call back into the script, which may call natives again
+      const auto outer = _args;
+      _args = args;
+      const auto result = native(&amx, this, _callback_user_data, argc, argv, pri);
+      _args = outer;
+      return result;
+    }
+
+    static error amx_callback_wrapper(amx_t*, void* user_data, cell index, cell stk, cell& pri)
+    {
+      return ((loader*)user_data)->amx_callback(index, stk, pri);
+    }
+
+    // SYSREQ of a native without a direct function bound, called with its arguments at STK already translated
+    static error bound_native(amx_t* amx, void* user, cell argc, cell* argv, cell& retval)
+    {
+      const auto context = (const binding_context*)user;
+      const auto self = context->self;
+      native_fn native{};
+      direct_fn direct{};
+      if (!self->_program->get_native(context->index, native, direct))
+        return error::invalid_operand;
+      const auto args = native_args_t{ *amx, argc, argv };
+      return self->call_native(native, direct, args, argc, (cell)(amx->STK + sizeof(cell)), retval);
+    }
+
+    void bind_natives()
+    {
+      const auto count = _program->_natives_count;
+      _bindings.resize(count);
+      _binding_contexts.resize(count);
+      for (size_t i = 0; i < count; ++i)
+      {
+        _binding_contexts[i] = { this, (cell)i };
+        const auto direct = _program->_directs[i].load(std::memory_order_relaxed);
+        if (direct)
+          _bindings[i] = { direct, _callback_user_data };
+        else
+          _bindings[i] = { &bound_native, &_binding_contexts[i] };
+      }
+      amx.attach_natives(_bindings.data(), count);
+    }
+
+    // The program's code is shared by its instances, so with a von Neumann memory manager a private copy of it is
+    // mapped instead, or a script could change what the others run.
+    bool map_code(const program_t& program, size_t first, size_t cells, cell& code_base)
+    {
+      auto code = const_cast<cell*>(program._code_view) + first;
+      if constexpr (detail::shares_backing<typename amx_t::memory_manager_t>::value)
+      {
+        _code.assign(code, code + cells);
+        code = _code.data();
+      }
+      return amx.mem.code().map(code, cells, code_base);
+    }
+
+    // Maps overlay `index` in place of the current one, along with its decoded stream from the program's cache.
+    error map_overlay(cell index)
+    {
+      // the amx keeps engines away while overlays are in use
+      AMX_ASSERT(!amx.has_engine());
+      const auto& overlays = _program->_overlays;
+      if (index >= overlays.size())
+        return error::invalid_operand;
+      if ((size_t)index == _overlay_mapped)
+        return error::success;
+      amx.detach_decoded();
+      if (_code_mapped)
+        amx.mem.code().unmap(amx.COD, _code_mapped);
+      _code_mapped = 0;
+      _overlay_mapped = (size_t)-1;
+      _overlay_decoded.reset();
+      const auto& range = overlays[(size_t)index];
+      cell code_base{};
+      if (!map_code(*_program, range.first, range.cells, code_base))
+        return error::access_violation_code;
+      amx.COD = code_base;
+      _code_mapped = range.cells;
+      _overlay_mapped = (size_t)index;
+      if (_program->_overlay_decode)
+      {
+        _overlay_decoded = _program->decoded_overlay((size_t)index);
+        amx.attach_decoded(_overlay_decoded->data(), range.cells);
+      }
+      return error::success;
+    }
+
+    static error overlay_wrapper(amx_t*, void* user, cell index)
+    {
+      return ((loader*)user)->map_overlay(index);
+    }
+
+    // An attached engine is detached along with the code, as it was made for that code.
+    void unmap()
+    {
+      amx.detach_engine();
+      amx.detach_decoded();
+      amx.detach_verified();
+      amx.set_overlay_handler(nullptr, nullptr);
+      amx.detach_natives();
+      _bindings.clear();
+      _binding_contexts.clear();
+      _overlay_decoded.reset();
+      _overlay_mapped = (size_t)-1;
+      amx.clear_fault();
+      _args = {};
+      if (!_program)
+        return;
+      amx.mem.data().unmap(amx.DAT, _data_size);
+      if (_code_mapped)
+        amx.mem.code().unmap(amx.COD, _code_mapped);
+      _code_mapped = 0;
+      _program.reset();
+      _data_view = nullptr;
+      _data_size = 0;
+    }
+
+  public:
+    loader_error init(const uint8_t* buf, size_t buf_size, const callbacks_arg& callbacks, const options_arg& options = {})
+    {
+      const auto program = std::make_shared<program_t>();
+      const auto result = program->init(buf, buf_size, callbacks.natives, callbacks.natives_count, options);
+      if (result != loader_error::success)
+        return result;
+      return init(program, callbacks);
+    }
+
+    // Loads through program_t::init() from a reader instead of a buffer.
+    loader_error init(
+      typename program_t::read_fn read,
+      void* read_user,
+      const callbacks_arg& callbacks,
+      const options_arg& options = {}
+    )
+    {
+      const auto program = std::make_shared<program_t>();
+      const auto result = program->init(read, read_user, callbacks.natives, callbacks.natives_count, options);
+      if (result != loader_error::success)
+        return result;
+      return init(program, callbacks);
+    }
+
+    // Creates an instance of an already loaded program, the natives in `callbacks` are not used.
+    loader_error init(std::shared_ptr<const program_t> program, const callbacks_arg& callbacks)
+    {
+      unmap();
+
+      _on_single_step = callbacks.on_single_step;
+      _on_break = callbacks.on_break;
+      _callback_user_data = callbacks.user_data;
+
+      const auto data_oldsize = program->_data.size();
+      const auto data_size = data_oldsize + program->_stack_heap_cells;
+
+      // with overlays, overlay 0 is mapped at first
+      const auto& overlays = program->_overlays;
+      const auto code_first = overlays.empty() ? 0 : overlays[0].first;
+      const auto code_size = overlays.empty() ? program->_code_size : overlays[0].cells;
+
       cell code_base{};
-      bool result = amx.mem.code().map(_code.data(), _code.size(), code_base);
+      bool result = map_code(*program, code_first, code_size, code_base);
       if (!result)
         return loader_error::unknown;
 
       cell data_base{};
-      result = amx.mem.data().map(_data.data(), _data.size(), data_base);
+      if constexpr (detail::owns_storage<data_backing_t>::value)
+      {
+        result = amx.mem.data().map(data_size, data_base);
+        _data_view = amx.mem.data().storage();
+      }
+      else
+      {
+        _data.resize(data_size);
+        result = amx.mem.data().map(_data.data(), data_size, data_base);
+        _data_view = _data.data();
+      }
       if (!result)
+      {
+        amx.mem.code().unmap(code_base, code_size);
         return loader_error::unknown;
+      }
+      _data_size = data_size;
+      std::copy(program->_data.begin(), program->_data.end(), _data_view);
+      std::fill(_data_view + data_oldsize, _data_view + data_size, (cell)0);
+
+      _program = std::move(program);
+      _code_mapped = code_size;
 
       amx.COD = code_base;
       amx.DAT = data_base;
 
-      amx.STK = amx.STP = (cell)((_data.size() - 1) * sizeof(cell));
+      amx.STK = amx.STP = (cell)((_data_size - 1) * sizeof(cell));
       amx.HEA = (cell)(data_oldsize * sizeof(cell));
 
+      amx.set_single_step(_on_single_step != nullptr);
+      bind_natives();
+
+      if (!_program->_decoded.empty())
+        amx.attach_decoded(_program->_decoded.data(), code_size);
+      if (_program->is_verified())
+        amx.attach_verified(_program->_code_view, _program->_starts.data(), code_size);
+      if (!overlays.empty())
+      {
+        _overlay_mapped = 0;
+        if (_program->_overlay_decode)
+        {
+          _overlay_decoded = _program->decoded_overlay(0);
+          amx.attach_decoded(_overlay_decoded->data(), code_size);
+        }
+        amx.set_overlay_handler(&overlay_wrapper, this);
+      }
+
+      return loader_error::success;
+    }
+
+    // Swaps `program` in place of the running one, between calls. The program can be loaded on any thread beforehand,
+    // so nothing is parsed or decoded here. The data segment starts over from `program`, except for public variables
+    // both programs have, which keep their value. Only the cell at the address of each is kept, arrays restart too.
+    //
+    // Public handles and a suspended call belong to the old program. An attached engine is detached, as with init().
+    // The callbacks stay, and natives are bound again from `program`. On failure the instance is left without a
+    // program.
+    loader_error reload(std::shared_ptr<const program_t> program)
+    {
+      if (!program)
+        return loader_error::unknown;
+      const auto old = _program;
+      std::vector<std::pair<std::string_view, cell>> kept;
+      if (old)
+        old->_pubvars.for_each([&](std::string_view name, cell address)
+        {
+          if (address % sizeof(cell) == 0 && address / sizeof(cell) < _data_size)
+            kept.emplace_back(name, _data_view[address / sizeof(cell)]);
+        });
+      const auto result = init(std::move(program), { nullptr, 0, _on_single_step, _on_break, _callback_user_data });
+      if (result != loader_error::success)
+        return result;
+      for (const auto& var : kept)
+      {
+        cell address{};
+        if (_program->_pubvars.find(var.first, address) && address % sizeof(cell) == 0 && address / sizeof(cell) < _data_size)
+          _data_view[address / sizeof(cell)] = var.second;
+      }
       return loader_error::success;
     }
 
     loader() = default;
-    loader(const uint8_t* buf, size_t buf_size, const callbacks_arg& callbacks)
+    loader(const uint8_t* buf, size_t buf_size, const callbacks_arg& callbacks, const options_arg& options = {})
+    {
+      init(buf, buf_size, callbacks, options);
+    }
+
+    ~loader()
     {
-      init(buf, buf_size, callbacks);
+      unmap();
     }
 
     loader(const loader&) = delete;
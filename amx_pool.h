@@ -0,0 +1,261 @@
+//  This Source Code Form is subject to the terms of the Mozilla Public
+//  License, v. 2.0. If a copy of the MPL was not distributed with this
+//  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include "amx_loader.h"
+
+namespace amx
+{
+  // Runs publics of one program on a set of worker threads, each with its own ready instance of the program. Calls are
+  // queued round robin per worker, and a worker whose queue is empty steals from the others.
+  //
+  // A program is immutable once loaded and can be shared freely, but an amx and its loader belong to one thread at a
+  // time. Here every instance stays on its worker, so:
+  //  - natives run on the workers concurrently, and have to be thread safe along with the callbacks' user data
+  //  - script globals are per instance, a call can't rely on what an earlier one left in them
+  template <typename Amx>
+  class dispatcher
+  {
+  public:
+    using amx_t = Amx;
+    using loader_t = loader<Amx>;
+    using program_t = typename loader_t::program_t;
+    using public_handle = typename loader_t::public_handle;
+    using callbacks_arg = typename loader_t::callbacks_arg;
+    using argument = typename amx_t::argument;
+    using cell = typename amx_t::cell;
+
+    // Called on the worker that ran the call, once it returned.
+    using completion_fn = void(*)(void* user, error result, cell retval);
+
+    struct options_arg
+    {
+      // 0 for one per hardware thread
+      size_t threads;
+      // also reset the instance after calls that succeeded, not only after failed ones
+      bool reset_after_call;
+    };
+
+  private:
+    struct task
+    {
+      public_handle fn;
+      // arrays are copied onto the heap only once the call runs, so they have to live until it completes
+      std::vector<argument> args;
+      completion_fn done;
+      void* user;
+      // a chunk of a batch when count isn't 0
+      const cell* rows;
+      size_t arity;
+      cell* results;
+      size_t count;
+    };
+
+    struct worker
+    {
+      std::mutex lock;
+      std::deque<task> queue;
+      loader_t instance;
+      std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> _workers;
+    std::atomic<size_t> _next{};
+    bool _reset_after_call{};
+
+    // guards the counters below, which the condition variables wait on
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::condition_variable _idle;
+    // in a queue, not taken by a worker yet
+    size_t _queued{};
+    // submitted and not completed yet
+    size_t _unfinished{};
+    bool _stop{};
+
+    // The own queue is taken from the front, others are stolen from at the back.
+    bool take(size_t self, task& out)
+    {
+      const auto count = _workers.size();
+      for (size_t i = 0; i < count; ++i)
+      {
+        auto& victim = *_workers[(self + i) % count];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (victim.queue.empty())
+          continue;
+        if (i == 0)
+        {
+          out = std::move(victim.queue.front());
+          victim.queue.pop_front();
+        }
+        else
+        {
+          out = std::move(victim.queue.back());
+          victim.queue.pop_back();
+        }
+        return true;
+      }
+      return false;
+    }
+
+    void work(size_t self)
+    {
+      auto& instance = _workers[self]->instance;
+      task current;
+      while (true)
+      {
+        if (!take(self, current))
+        {
+          std::unique_lock<std::mutex> guard(_lock);
+          if (_queued == 0 && _stop)
+            return;
+          _wake.wait(guard, [this] { return _queued != 0 || _stop; });
+          continue;
+        }
+
+        {
+          std::lock_guard<std::mutex> guard(_lock);
+          --_queued;
+        }
+
+        cell retval{};
+        auto result = error::success;
+        if (current.count)
+        {
+          size_t completed{};
+          result = instance.call_batch(current.fn, current.rows, current.arity, current.results, current.count, completed);
+          retval = (cell)completed;
+        }
+        else
+        {
+          result = instance.call(current.fn, retval, { current.args.data(), current.args.size() });
+        }
+        // a sleeping or yielded call isn't continued here, it would hold the instance
+        if (result != error::success || _reset_after_call)
+          instance.reset();
+        if (current.done)
+          current.done(current.user, result, retval);
+
+        std::lock_guard<std::mutex> guard(_lock);
+        if (--_unfinished == 0)
+          _idle.notify_all();
+      }
+    }
+
+    void shutdown()
+    {
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+      }
+      _wake.notify_all();
+      for (auto& w : _workers)
+        if (w->thread.joinable())
+          w->thread.join();
+      _workers.clear();
+      _stop = false;
+    }
+
+    // Counted in the same critical section as the push, so a worker can't complete the task before it's counted.
+    // Workers never take _lock while holding a queue lock, so nesting them in this order is fine.
+    void enqueue(task&& t)
+    {
+      auto& target = *_workers[_next.fetch_add(1, std::memory_order_relaxed) % _workers.size()];
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        ++_queued;
+        ++_unfinished;
+        std::lock_guard<std::mutex> queue_guard(target.lock);
+        target.queue.push_back(std::move(t));
+      }
+      _wake.notify_one();
+    }
+
+  public:
+    // Creates the instances and starts the workers. Calls submitted before that finished are completed first.
+    loader_error init(std::shared_ptr<const program_t> program, const callbacks_arg& callbacks, const options_arg& options = {})
+    {
+      shutdown();
+
+      auto threads = options.threads;
+      if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+      if (threads == 0)
+        threads = 1;
+
+      _reset_after_call = options.reset_after_call;
+      std::vector<std::unique_ptr<worker>> workers(threads);
+      for (auto& w : workers)
+      {
+        w = std::make_unique<worker>();
+        const auto result = w->instance.init(program, callbacks);
+        if (result != loader_error::success)
+          return result;
+      }
+
+      _workers = std::move(workers);
+      for (size_t i = 0; i < _workers.size(); ++i)
+        _workers[i]->thread = std::thread(&dispatcher::work, this, i);
+      return loader_error::success;
+    }
+
+    // Queues a call of `fn` with a copy of `args`, `done` is called with the result unless it's nullptr.
+    bool submit(public_handle fn, typename amx_t::argument_span args, completion_fn done, void* user)
+    {
+      if (_workers.empty())
+        return false;
+      enqueue(task{ fn, { args.data(), args.data() + args.size() }, done, user, nullptr, 0, nullptr, 0 });
+      return true;
+    }
+
+    // Splits a loader_t::call_batch() into one chunk per worker, of at least `min_chunk` rows. `done` is called for
+    // each chunk, with how many of its rows completed as the retval. `args` and `results` must live until then.
+    bool submit_batch(
+      public_handle fn,
+      const cell* args,
+      size_t arity,
+      cell* results,
+      size_t count,
+      completion_fn done,
+      void* user,
+      size_t min_chunk = 64
+    )
+    {
+      if (_workers.empty())
+        return false;
+      auto chunk = (count + _workers.size() - 1) / _workers.size();
+      chunk = chunk < min_chunk ? min_chunk : chunk;
+      for (size_t first = 0; first < count; first += chunk)
+      {
+        const auto rows = count - first < chunk ? count - first : chunk;
+        enqueue(task{ fn, {}, done, user, args + first * arity, arity, results + first, rows });
+      }
+      return true;
+    }
+
+    // Blocks until every call submitted so far completed.
+    void wait()
+    {
+      std::unique_lock<std::mutex> guard(_lock);
+      _idle.wait(guard, [this] { return _unfinished == 0; });
+    }
+
+    size_t thread_count() const { return _workers.size(); }
+
+    dispatcher() = default;
+    ~dispatcher() { shutdown(); }
+
+    dispatcher(const dispatcher&) = delete;
+    dispatcher(dispatcher&&) = delete;
+
+    dispatcher& operator=(const dispatcher&) = delete;
+    dispatcher& operator=(dispatcher&&) = delete;
+  };
+}
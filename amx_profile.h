@@ -0,0 +1,330 @@
+//  This Source Code Form is subject to the terms of the Mozilla Public
+//  License, v. 2.0. If a copy of the MPL was not distributed with this
+//  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "amx_loader.h"
+
+#if !AMX_PROFILE
+#error "the profiler needs the hooks compiled in with AMX_PROFILE=1, in every translation unit using the amx"
+#endif
+
+namespace amx
+{
+  // What the folded stacks of profiler::folded() are weighted by.
+  enum class profile_weight
+  {
+    instructions,
+    nanoseconds
+  };
+
+  // Collects what the AMX_PROFILE hooks of the interpreters report for one amx:
+  //  - how many times each opcode, and the instruction at each cell of code was executed
+  //  - per function, keyed by the CIP of its PROC: calls, and inclusive and exclusive instructions and host time
+  //  - per native, keyed by its SYSREQ operand: calls and host time around the callback
+  //  - the same per call stack, as folded stacks ("main;f;g 1234" lines) that flame graph tools read
+  // Natives are a level of the call stack of their own, so their time isn't exclusive time of the calling function.
+  // Recursive functions count the nested calls again in their inclusive figures. Calls still running aren't counted
+  // until they return, and ones that fail count up to the failure.
+  //
+  // The JIT has no hooks, so an attached one is bypassed while profiling.
+  template <typename Amx>
+  class profiler
+  {
+  public:
+    using amx_t = Amx;
+    using cell = typename amx_t::cell;
+    using loader_t = loader<Amx>;
+    using program_t = typename loader_t::program_t;
+    using clock = std::chrono::steady_clock;
+
+    struct function_stats
+    {
+      uint64_t calls;
+      uint64_t inclusive_instructions;
+      uint64_t exclusive_instructions;
+      clock::duration inclusive_time;
+      clock::duration exclusive_time;
+    };
+
+    struct native_stats
+    {
+      uint64_t calls;
+      clock::duration time;
+    };
+
+  private:
+    // a distinct call stack, with what was spent in its innermost frame
+    struct node
+    {
+      size_t parent;
+      cell id;
+      bool native;
+      uint64_t instructions;
+      clock::duration time;
+    };
+
+    struct frame
+    {
+      size_t node;
+      // FRM of a function, STK at the SYSREQ of a native
+      cell frm;
+      uint64_t instructions;
+      clock::time_point start;
+      uint64_t child_instructions;
+      clock::duration child_time;
+    };
+
+    constexpr static size_t root = 0;
+
+    amx_t* _amx{};
+    typename amx_t::profile_hooks _hooks{};
+    std::vector<uint64_t> _hits;
+    const cell* _code{};
+    std::shared_ptr<const program_t> _program;
+    std::unordered_map<cell, std::string> _function_names;
+
+    std::vector<node> _nodes;
+    std::map<std::tuple<size_t, bool, cell>, size_t> _children;
+    std::vector<frame> _stack;
+    std::unordered_map<cell, function_stats> _functions;
+    std::unordered_map<cell, native_stats> _natives;
+
+    size_t child(size_t parent, bool native, cell id)
+    {
+      const auto it = _children.emplace(std::make_tuple(parent, native, id), _nodes.size());
+      if (it.second)
+        _nodes.push_back({ parent, id, native, 0, {} });
+      return it.first->second;
+    }
+
+    void push(bool native, cell id, cell frm)
+    {
+      const auto parent = _stack.empty() ? root : _stack.back().node;
+      // the PROC of a function was counted already, and belongs to it
+      const auto instructions = _hooks.instructions - (native ? 0 : 1);
+      _stack.push_back({ child(parent, native, id), frm, instructions, clock::now(), 0, {} });
+    }
+
+    void pop()
+    {
+      const auto f = _stack.back();
+      _stack.pop_back();
+      const auto instructions = _hooks.instructions - f.instructions;
+      const auto time = clock::now() - f.start;
+      auto& n = _nodes[f.node];
+      n.instructions += instructions - f.child_instructions;
+      n.time += time - f.child_time;
+      if (n.native)
+      {
+        auto& stats = _natives[n.id];
+        ++stats.calls;
+        stats.time += time;
+      }
+      else
+      {
+        auto& stats = _functions[n.id];
+        ++stats.calls;
+        stats.inclusive_instructions += instructions;
+        stats.exclusive_instructions += instructions - f.child_instructions;
+        stats.inclusive_time += time;
+        stats.exclusive_time += time - f.child_time;
+      }
+      if (!_stack.empty())
+      {
+        _stack.back().child_instructions += instructions;
+        _stack.back().child_time += time;
+      }
+    }
+
+    // pops up to and including the innermost frame matching, if there is one
+    template <typename Pred>
+    void pop_through(Pred pred)
+    {
+      for (size_t i = _stack.size(); i-- > 0;)
+      {
+        if (!pred(_stack[i]))
+          continue;
+        while (_stack.size() > i)
+          pop();
+        return;
+      }
+    }
+
+    static void on_enter(void* user, cell cip, cell frm)
+    {
+      const auto self = (profiler*)user;
+      // a frame at or below a new one is from a call that didn't return through RET
+      while (!self->_stack.empty() && self->_stack.back().frm <= frm)
+        self->pop();
+      self->push(false, cip, frm);
+    }
+
+    static void on_leave(void* user, cell frm)
+    {
+      const auto self = (profiler*)user;
+      self->pop_through([&](const frame& f) { return !self->_nodes[f.node].native && f.frm == frm; });
+    }
+
+    static void on_native_begin(void* user, cell index, cell stk)
+    {
+      ((profiler*)user)->push(true, index, stk);
+    }
+
+    static void on_native_end(void* user, cell index)
+    {
+      const auto self = (profiler*)user;
+      self->pop_through([&](const frame& f) { return self->_nodes[f.node].native && self->_nodes[f.node].id == index; });
+    }
+
+    static void on_unwind(void* user, cell stk)
+    {
+      const auto self = (profiler*)user;
+      while (!self->_stack.empty() && self->_stack.back().frm < stk)
+        self->pop();
+    }
+
+    std::string node_name(const node& n) const
+    {
+      char buf[32];
+      if (n.native)
+      {
+        if (_program)
+        {
+          const auto name = _program->get_native_name(n.id);
+          if (!name.empty())
+            return std::string{ name };
+        }
+        snprintf(buf, sizeof(buf), "native#%llu", (unsigned long long)n.id);
+        return buf;
+      }
+      return function_name(n.id);
+    }
+
+  public:
+    // `code` is the code segment as executed, `code_cells` long, and has to live while attached. Functions are named
+    // by their address.
+    void attach(amx_t& amx, const cell* code, size_t code_cells)
+    {
+      detach();
+      _amx = &amx;
+      _code = code;
+      _hits.assign(code_cells, 0);
+      _hooks.hits = _hits.data();
+      _hooks.hit_count = _hits.size();
+      _hooks.user = this;
+      _hooks.enter = &on_enter;
+      _hooks.leave = &on_leave;
+      _hooks.native_begin = &on_native_begin;
+      _hooks.native_end = &on_native_end;
+      _hooks.unwind = &on_unwind;
+      clear();
+      amx.attach_profiler(&_hooks);
+    }
+
+    // Publics and natives are named after the program of `instance`, which has to stay loaded while attached.
+    void attach(loader_t& instance)
+    {
+      const auto program = instance.get_program();
+      if (!program)
+        return;
+      attach(instance.amx, program->get_code(), program->get_code_size());
+      _program = program;
+      program->get_publics().for_each([this](std::string_view name, cell cip) { _function_names[cip] = name; });
+    }
+
+    void detach()
+    {
+      if (_amx)
+        _amx->detach_profiler();
+      _amx = nullptr;
+      _code = nullptr;
+      _program.reset();
+      _function_names.clear();
+    }
+
+    // Forgets everything counted so far. Calls that are running are counted from here on.
+    void clear()
+    {
+      _hooks.instructions = 0;
+      std::fill(_hits.begin(), _hits.end(), 0);
+      _nodes.assign(1, node{ root, 0, false, 0, {} });
+      _children.clear();
+      _stack.clear();
+      _functions.clear();
+      _natives.clear();
+    }
+
+    uint64_t instructions() const { return _hooks.instructions; }
+
+    // indexed by CIP / cell_bytes
+    const std::vector<uint64_t>& instruction_hits() const { return _hits; }
+
+    // indexed by opcode
+    std::array<uint64_t, amx_t::opcode_count> opcode_counts() const
+    {
+      std::array<uint64_t, amx_t::opcode_count> counts{};
+      for (size_t i = 0; i < _hits.size(); ++i)
+        if (_hits[i] && (size_t)_code[i] < counts.size())
+          counts[(size_t)_code[i]] += _hits[i];
+      return counts;
+    }
+
+    const std::unordered_map<cell, function_stats>& functions() const { return _functions; }
+    const std::unordered_map<cell, native_stats>& natives() const { return _natives; }
+
+    // the public at `cip`, or its address
+    std::string function_name(cell cip) const
+    {
+      const auto it = _function_names.find(cip);
+      if (it != _function_names.end())
+        return it->second;
+      char buf[32];
+      snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)cip);
+      return buf;
+    }
+
+    // One "outermost;...;innermost weight" line per call stack that spent anything in its innermost frame.
+    std::string folded(profile_weight weight = profile_weight::instructions) const
+    {
+      std::string out;
+      std::vector<size_t> path;
+      for (size_t i = 1; i < _nodes.size(); ++i)
+      {
+        const auto& n = _nodes[i];
+        const auto value = weight == profile_weight::instructions
+          ? n.instructions
+          : (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(n.time).count();
+        if (!value)
+          continue;
+        path.clear();
+        for (auto k = i; k != root; k = _nodes[k].parent)
+          path.push_back(k);
+        for (size_t k = path.size(); k-- > 0;)
+        {
+          out += node_name(_nodes[path[k]]);
+          out += k ? ';' : ' ';
+        }
+        out += std::to_string(value);
+        out += '\n';
+      }
+      return out;
+    }
+
+    profiler() = default;
+    ~profiler() { detach(); }
+
+    profiler(const profiler&) = delete;
+    profiler(profiler&&) = delete;
+
+    profiler& operator=(const profiler&) = delete;
+    profiler& operator=(profiler&&) = delete;
+  };
+}